@@ -0,0 +1,482 @@
+/*
+ * Benchmarks for the settings module.
+ *
+ * Generates configs with the given numbers of keys (1k, 100k and 10M by
+ * default), and measures loading, lookups, updates and saving for each,
+ * in both the text and the binary format.
+ * Allocations are counted with the malloc and realloc wrappers from test.h.
+ *
+ * The results are printed as key/value pairs, one per line, so they can
+ * be loaded back with settings_load (or split on '=' by a script):
+ *
+ *     <benchmark>.<keys>.<metric> = <value>
+ *
+ * Usage: ./bench [keys...]
+ */
+
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "settings.h"
+
+/* Maximum number of operations to time for each benchmark */
+#define BENCH_MAX_OPS 1000000L
+
+/* Number of keys looked up at a time with settings_get_many */
+#define BENCH_BATCH 40
+
+/* Number of keys in the generated configs if none are given */
+static const long default_key_counts[] = { 1000L, 100000L, 10000000L };
+
+/* Counters at the start of the current measurement */
+struct Measurement {
+	double start;
+	long allocs;
+};
+
+/*
+ * Get the current time in seconds from a monotonic clock.
+ */
+static double now(void) {
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Get the number of allocations made so far.
+ */
+static long allocations(void) {
+	return test_malloc_call_count + test_realloc_call_count;
+}
+
+/*
+ * Start measuring an operation.
+ */
+static void measure_begin(struct Measurement *m) {
+	m->allocs = allocations();
+	m->start = now();
+}
+
+/*
+ * Stop measuring, and print the results for the given number of
+ * operations. If bytes is not zero, the throughput is printed too.
+ */
+static void measure_end(struct Measurement *m, const char *name, long keys, long ops, size_t bytes) {
+	const double seconds = now() - m->start;
+	const long allocs = allocations() - m->allocs;
+	printf("%s.%ld.ops = %ld\n", name, keys, ops);
+	printf("%s.%ld.seconds = %.6f\n", name, keys, seconds);
+	printf("%s.%ld.ns_per_op = %.1f\n", name, keys, seconds * 1e9 / ops);
+	printf("%s.%ld.ops_per_sec = %.0f\n", name, keys, ops / seconds);
+	if (bytes > 0) {
+		printf("%s.%ld.mb_per_sec = %.1f\n", name, keys, bytes / seconds / (1024.0 * 1024.0));
+	}
+	printf("%s.%ld.allocs_per_op = %.3f\n", name, keys, (double) allocs / ops);
+	fflush(stdout);
+}
+
+/*
+ * Write the key with the given number into the given buffer.
+ * Every third key holds a string, an int and a float, respectively.
+ */
+static void make_key(char *buf, const char *prefix, long i) {
+	sprintf(buf, "%s.section%ld.key%ld", prefix, i % 100, i);
+}
+
+/*
+ * Write the value of the key with the given number into the given buffer.
+ */
+static void make_value(char *buf, long i) {
+	switch (i % 3) {
+	case 0:
+		sprintf(buf, "value number %ld", i);
+		break;
+	case 1:
+		sprintf(buf, "%ld", i);
+		break;
+	default:
+		sprintf(buf, "%ld.5", i);
+		break;
+	}
+}
+
+/*
+ * Generate a config file with the given number of keys.
+ * Returns the size of the file in bytes, or 0 on failure.
+ */
+static size_t generate_config(const char *path, long keys) {
+	char key[64];
+	char value[64];
+	size_t size = 0;
+	FILE *f;
+	long i;
+
+	if (!(f = fopen(path, "wb"))) {
+		return 0;
+	}
+	for (i = 0; i < keys; ++i) {
+		int n;
+		make_key(key, "app", i);
+		make_value(value, i);
+		if ((n = fprintf(f, "%s = %s\n", key, value)) < 0) {
+			fclose(f);
+			return 0;
+		}
+		size += n;
+	}
+	if (fclose(f) != 0) {
+		return 0;
+	}
+	return size;
+}
+
+/*
+ * Get the size of the given file in bytes, or 0 on failure.
+ */
+static size_t file_size(const char *path) {
+	FILE *f = fopen(path, "rb");
+	long size;
+	if (!f) {
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fclose(f);
+	return size > 0 ? (size_t) size : 0;
+}
+
+/*
+ * A set of keys to run the operations of a benchmark on.
+ * Key numbers are picked with a fixed stride, so that lookups
+ * do not simply walk the table in order.
+ */
+struct KeySet {
+	long count;
+	char **keys;
+};
+
+/*
+ * Build a key set for the given number of keys, with every key
+ * number mapped to one with the given remainder modulo 3.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int make_key_set(struct KeySet *set, const char *prefix, long keys, long remainder) {
+	const long count = keys < BENCH_MAX_OPS ? keys : BENCH_MAX_OPS;
+	char key[64];
+	long i;
+
+	set->count = 0;
+	if (!(set->keys = malloc(count * sizeof(char *)))) {
+		return 0;
+	}
+	for (i = 0; i < count; ++i) {
+		/* A large odd stride visits the keys in a scattered order */
+		long n = (long) ((i * 2654435761UL) % (unsigned long) keys);
+		if (remainder >= 0) {
+			n = n - n % 3 + remainder;
+			if (n >= keys) {
+				n = remainder;
+			}
+		}
+		make_key(key, prefix, n);
+		if (!(set->keys[i] = malloc(strlen(key) + 1))) {
+			break;
+		}
+		strcpy(set->keys[i], key);
+		++set->count;
+	}
+	return set->count == count;
+}
+
+/*
+ * Free the keys of a key set.
+ */
+static void free_key_set(struct KeySet *set) {
+	long i;
+	for (i = 0; i < set->count; ++i) {
+		free(set->keys[i]);
+	}
+	free(set->keys);
+}
+
+/*
+ * Run all the benchmarks with the given number of keys.
+ * Returns 1 on success, or 0 on failure.
+ */
+static int run_benchmarks(long keys) {
+	struct Measurement m;
+	struct KeySet strings, ints, floats, missing;
+	char path[64];
+	char binary_path[64];
+	const char *batch[BENCH_BATCH];
+	char value[64];
+	Settings *settings;
+	Settings *frozen;
+	Settings *overrides;
+	Settings *overlay;
+	size_t size;
+	long checksum = 0;
+	long i;
+
+	sprintf(path, "bench_%ld.txt", keys);
+	if (!(size = generate_config(path, keys))) {
+		fprintf(stderr, "Could not generate %s\n", path);
+		return 0;
+	}
+
+	if (!make_key_set(&strings, "app", keys, 0) || !make_key_set(&ints, "app", keys, 1)
+			|| !make_key_set(&floats, "app", keys, 2) || !make_key_set(&missing, "missing", keys, -1)) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+
+	/* Loading */
+	settings = settings_create();
+	measure_begin(&m);
+	if (!settings_load(settings, path)) {
+		fprintf(stderr, "Could not load %s\n", path);
+		return 0;
+	}
+	measure_end(&m, "load", keys, keys, size);
+	settings_free(settings);
+
+	settings = settings_create();
+	measure_begin(&m);
+	if (!settings_load_mmap(settings, path)) {
+		fprintf(stderr, "Could not load %s\n", path);
+		return 0;
+	}
+	measure_end(&m, "load_mmap", keys, keys, size);
+	settings_free(settings);
+
+	settings = settings_create();
+	measure_begin(&m);
+	if (!settings_load_parallel(settings, path, 0)) {
+		fprintf(stderr, "Could not load %s\n", path);
+		return 0;
+	}
+	measure_end(&m, "load_parallel", keys, keys, size);
+	settings_free(settings);
+
+	settings = settings_create();
+	settings_load(settings, path);
+	sprintf(binary_path, "bench_%ld.bin", keys);
+	measure_begin(&m);
+	if (!settings_save_binary(settings, binary_path)) {
+		fprintf(stderr, "Could not save %s\n", binary_path);
+		return 0;
+	}
+	measure_end(&m, "save_binary", keys, keys, file_size(binary_path));
+	settings_free(settings);
+
+	settings = settings_create();
+	measure_begin(&m);
+	if (!settings_load_binary(settings, binary_path)) {
+		fprintf(stderr, "Could not load %s\n", binary_path);
+		return 0;
+	}
+	measure_end(&m, "load_binary", keys, keys, file_size(binary_path));
+	settings_free(settings);
+	remove(binary_path);
+
+	settings = settings_create();
+	settings_load(settings, path);
+
+	/* Lookups that hit and miss */
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		checksum += settings_get_string(settings, strings.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_hit", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < strings.count; i += BENCH_BATCH) {
+		const long n = strings.count - i < BENCH_BATCH ? strings.count - i : BENCH_BATCH;
+		checksum += settings_get_many(settings, (const char *const *) strings.keys + i, n, batch);
+	}
+	measure_end(&m, "get_many_hit", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		checksum += settings_get_string(settings, missing.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_miss", keys, missing.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < ints.count; ++i) {
+		checksum += settings_get_int(settings, ints.keys[i], 0);
+	}
+	measure_end(&m, "get_int_hit", keys, ints.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < ints.count; ++i) {
+		checksum += settings_get_int(settings, ints.keys[i], 0);
+	}
+	measure_end(&m, "get_int_hit_cached", keys, ints.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		checksum += settings_get_int(settings, missing.keys[i], 0);
+	}
+	measure_end(&m, "get_int_miss", keys, missing.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < floats.count; ++i) {
+		checksum += (long) settings_get_float(settings, floats.keys[i], 0.0f);
+	}
+	measure_end(&m, "get_float_hit", keys, floats.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < floats.count; ++i) {
+		checksum += (long) settings_get_double(settings, floats.keys[i], 0.0);
+	}
+	measure_end(&m, "get_double_hit", keys, floats.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		checksum += (long) settings_get_float(settings, missing.keys[i], 0.0f);
+	}
+	measure_end(&m, "get_float_miss", keys, missing.count, 0);
+
+	/* Lookups in frozen settings */
+	frozen = settings_create();
+	settings_load(frozen, path);
+	measure_begin(&m);
+	if (!settings_freeze(frozen)) {
+		fprintf(stderr, "Could not freeze %s\n", path);
+		return 0;
+	}
+	measure_end(&m, "freeze", keys, keys, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		checksum += settings_get_string(frozen, strings.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_hit_frozen", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		checksum += settings_get_string(frozen, missing.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_miss_frozen", keys, missing.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < ints.count; ++i) {
+		checksum += settings_get_int(frozen, ints.keys[i], 0);
+	}
+	measure_end(&m, "get_int_hit_frozen", keys, ints.count, 0);
+
+	/* Lookups that fall through an overlay to the frozen settings */
+	overrides = settings_create();
+	measure_begin(&m);
+	overlay = settings_create_overlay(frozen, overrides);
+	measure_end(&m, "create_overlay", keys, 1, 0);
+	if (overlay == NULL) {
+		fprintf(stderr, "Could not create an overlay\n");
+		return 0;
+	}
+
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		checksum += settings_get_string(overlay, strings.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_hit_overlay_cold", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		checksum += settings_get_string(overlay, strings.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_hit_overlay", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		checksum += settings_get_string(overlay, missing.keys[i], "")[0];
+	}
+	measure_end(&m, "get_string_miss_overlay", keys, missing.count, 0);
+	settings_free(overlay);
+	settings_free(overrides);
+	settings_free(frozen);
+
+	/* Updates */
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		make_value(value, i);
+		settings_set_string(settings, strings.keys[i], value);
+	}
+	measure_end(&m, "replace_string", keys, strings.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < ints.count; ++i) {
+		settings_set_int(settings, ints.keys[i], (int) i);
+	}
+	measure_end(&m, "replace_int", keys, ints.count, 0);
+
+	measure_begin(&m);
+	for (i = 0; i < floats.count; ++i) {
+		settings_set_double(settings, floats.keys[i], i + 0.5);
+	}
+	measure_end(&m, "replace_double", keys, floats.count, 0);
+
+	/* Saving */
+	measure_begin(&m);
+	if (!settings_save(settings, path)) {
+		fprintf(stderr, "Could not save %s\n", path);
+		return 0;
+	}
+	measure_end(&m, "save", keys, keys, file_size(path));
+
+	measure_begin(&m);
+	for (i = 0; i < strings.count; ++i) {
+		settings_remove(settings, strings.keys[i]);
+	}
+	measure_end(&m, "remove", keys, strings.count, 0);
+	settings_free(settings);
+
+	settings = settings_create();
+	measure_begin(&m);
+	for (i = 0; i < missing.count; ++i) {
+		settings_set_string(settings, missing.keys[i], "value");
+	}
+	measure_end(&m, "set_new", keys, missing.count, 0);
+	settings_free(settings);
+
+	/* Keep the lookups from being optimized away */
+	printf("checksum.%ld = %ld\n", keys, checksum);
+
+	free_key_set(&strings);
+	free_key_set(&ints);
+	free_key_set(&floats);
+	free_key_set(&missing);
+	remove(path);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	int result = 1;
+	int i;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; ++i) {
+			const long keys = atol(argv[i]);
+			if (keys <= 0) {
+				fprintf(stderr, "Invalid number of keys: %s\n", argv[i]);
+				return 1;
+			}
+			result &= run_benchmarks(keys);
+		}
+	} else {
+		for (i = 0; i < (int) (sizeof(default_key_counts) / sizeof(default_key_counts[0])); ++i) {
+			result &= run_benchmarks(default_key_counts[i]);
+		}
+	}
+
+	return !result;
+}
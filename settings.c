@@ -1,11 +1,62 @@
+/* Needed for mmap and friends when compiling as strict C99 */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <float.h>
+#include <locale.h>
+#include <stdint.h>
 #include "settings.h"
 
+/* Memory mapping and file descriptors are available on POSIX systems */
+#if defined(__unix__) || defined(__APPLE__)
+	#define HAVE_POSIX
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+/* Windows can replace a file with another in one step */
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#endif
+
+/* POSIX threads are available on POSIX systems */
+#ifdef HAVE_POSIX
+	#define HAVE_THREADS
+	#include <pthread.h>
+#endif
+
+/* Sharded settings need a mutex for each shard, so they are only available with one */
+#ifdef HAVE_THREADS
+	#define HAVE_SHARD_LOCKS
+#endif
+
+/* Parallel loading starts threads of its own, unless it is turned off */
+#if defined(HAVE_THREADS) && !defined(SETTINGS_NO_THREADS)
+	#define HAVE_PARALLEL_LOAD
+#endif
+
+/* Pick a vector instruction set for scanning lines */
+#if defined(__AVX2__)
+	#define SCAN_AVX2
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SCAN_SSE2
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define SCAN_NEON
+	#include <arm_neon.h>
+#endif
+
 /* Optionally, use the memory module */
 #ifdef USE_MEMORY
 	#include "memory.h"
@@ -15,389 +66,5854 @@
 	#define memory_free free
 #endif
 
-/* Utility macros for calculating the number of digits for integers */
-#define STRINGIFY(x) #x
-#define NUM_DIGITS(x) (sizeof(STRINGIFY(x)) - 1)
+/*
+ * Atomic operations for the lock-free read path.
+ *
+ * Readers may look values up while a single writer changes them, so
+ * anything a reader can see is loaded and published with these. Without
+ * compiler support for atomics, only single-threaded use is supported.
+ */
+#if defined(__GNUC__)
+	#define load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+	#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define store_relaxed(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+	#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define fetch_or_release(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELEASE)
+	#define compare_exchange(p, expected, desired) \
+		__atomic_compare_exchange_n((p), (expected), (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+	#define copy_relaxed(dst, src) __atomic_store((dst), (src), __ATOMIC_RELAXED)
+	#define fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+	#define fetch_sub(p, v) __atomic_fetch_sub((p), (v), __ATOMIC_ACQ_REL)
+	#define add_relaxed(p, v) ((void) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+	#define full_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+	#define acquire_fence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+	#define release_fence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+	#define load_relaxed(p) (*(p))
+	#define load_acquire(p) (*(p))
+	#define store_relaxed(p, v) (*(p) = (v))
+	#define store_release(p, v) (*(p) = (v))
+	#define fetch_or_release(p, v) (*(p) |= (v))
+	#define compare_exchange(p, expected, desired) \
+		(*(p) == *(expected) ? (*(p) = (desired), 1) : (*(expected) = *(p), 0))
+	#define copy_relaxed(dst, src) (*(dst) = *(src))
+	#define fetch_add(p, v) ((*(p) += (v)) - (v))
+	#define fetch_sub(p, v) ((*(p) -= (v)) + (v))
+	#define add_relaxed(p, v) ((void) (*(p) += (v)))
+	#define full_fence() do {} while (0)
+	#define acquire_fence() do {} while (0)
+	#define release_fence() do {} while (0)
+#endif
+
+/* Hint that the given address is about to be read */
+#if defined(__GNUC__)
+	#define prefetch(p) __builtin_prefetch(p)
+#else
+	#define prefetch(p) ((void) (p))
+#endif
+
+/* Number of keys that are hashed and prefetched at a time in batches */
+#define BATCH_SIZE 8
+
+/* Initial number of slots in the hash index (must be a power of two) */
+#define INDEX_MIN_CAPACITY 16
+
+/* Size of the chunks that an arena allocates at a time */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Number of retired allocations to collect before trying to free them */
+#define RECLAIM_BATCH 32
+
+/* Most pairs to add to or remove from the sorted array one by one before it is rebuilt instead */
+#define SORTED_MAX_CHANGES 32
+
+/* Largest pair or value allocation that is recycled through the free lists */
+#define FREE_MAX_SIZE 512
+
+/* Most bytes of freed pairs and values to keep for reuse */
+#define FREE_MAX_BYTES (1024 * 1024)
+
+/* Number of stripes that the operation counters are spread over */
+#define STAT_STRIPES 8
+
+/* Average number of keys in a bucket of the perfect hash of frozen settings */
+#define FROZEN_BUCKET_SIZE 4
+
+/* Bounds on the number of entries in the resolution cache of an overlay */
+#define OVERLAY_CACHE_MIN 16
+#define OVERLAY_CACHE_MAX 65536
+
+/* A type with the strictest alignment, used for aligning allocations */
+union Align {
+	long l;
+	double d;
+	long double ld;
+	void *p;
+};
+
+/* Round the given size up to a multiple of the strictest alignment */
+#define ALIGN_UP(size) (((size) + sizeof(union Align) - 1) / sizeof(union Align) * sizeof(union Align))
+
+/* Number of free lists, one for each multiple of the alignment up to FREE_MAX_SIZE */
+#define FREE_LISTS (FREE_MAX_SIZE / sizeof(union Align) + 1)
+
+/* Operations counted for settings_stats */
+enum Stat {
+	STAT_GET_HIT,
+	STAT_GET_MISS,
+	STAT_SET,
+	STAT_REMOVE,
+	STAT_LOAD,
+	STAT_SAVE,
+	STAT_COUNT
+};
+
+/*
+ * A stripe of the operation counters.
+ *
+ * Each thread counts in the stripe picked by the address of its stack,
+ * so that readers on different threads rarely touch the same counters.
+ * The padding keeps stripes that are next to each other from sharing
+ * a cache line.
+ */
+struct StatStripe {
+	unsigned long long counts[STAT_COUNT];
+	char padding[64];
+};
+
+/*
+ * Timing of the trace points, which compiles to nothing unless built with
+ * SETTINGS_TRACE. TRACE_BEGIN declares a start time, so it goes with the
+ * declarations, and TRACE_END records the time since then at the point.
+ * Without tracing, the start is a constant that nothing else uses.
+ * TRACE_PARSE_BEGIN and TRACE_PARSE_END time parsing, leaving out the
+ * time the handler spent inserting.
+ */
+#ifdef SETTINGS_TRACE
+	#include <time.h>
+	#define TRACE_BEGIN(start) const unsigned long long start = trace_now()
+	#define TRACE_END(settings, point, start) trace_record((settings), (point), trace_now() - (start))
+	#define TRACE_PARSE_BEGIN(settings, start) \
+		const unsigned long long start = trace_now(); \
+		const unsigned long long start##_inserts = trace_total((settings), SETTINGS_TRACE_INSERT)
+	#define TRACE_PARSE_END(settings, start) trace_record((settings), SETTINGS_TRACE_PARSE, \
+		trace_now() - (start) - (trace_total((settings), SETTINGS_TRACE_INSERT) - start##_inserts))
+#else
+	#define TRACE_BEGIN(start) const int start = 0
+	#define TRACE_END(settings, point, start) ((void) (settings), (void) (start))
+	#define TRACE_PARSE_BEGIN(settings, start) const int start = 0
+	#define TRACE_PARSE_END(settings, start) ((void) (settings), (void) (start))
+#endif
+
+/* A freed allocation waiting in a free list to be reused */
+struct FreeBlock {
+	struct FreeBlock *next;
+};
+
+/* A chunk of memory that arena allocations are carved out of */
+struct Chunk {
+	struct Chunk *next;
+	size_t size; /* Usable size of data */
+	size_t used; /* Bytes of data handed out so far */
+	union Align data[];
+};
+
+/*
+ * A file mapped into memory by settings_load_mmap or settings_load_binary,
+ * or just a block of pairs built by a parallel load (without a file).
+ */
+struct Mapping {
+	struct Mapping *next;
+	void *addr;  /* NULL if there is no file */
+	size_t size;
+	void *pairs; /* Block of pairs pointing into the mapping, if any */
+};
 
-/* Maximum number of digits for ints and doubles */
-#define INT_DIGITS (NUM_DIGITS(INT_MAX) + 1)
-#define DBL_DIGITS (3 + DBL_MANT_DIG - DBL_MIN_EXP)
+/*
+ * The value of a pair.
+ *
+ * A value is not modified after it has been published in a pair, except
+ * for filling in its typed cache, so readers always see a whole value.
+ * Setting a new value publishes a new block, and the old one is retired.
+ *
+ * The string usually follows the block, but it may also be borrowed from
+ * a memory-mapped file. The first value of a pair is allocated together
+ * with the pair, and is marked as embedded.
+ */
+struct Value {
+	const char *str;
+	size_t len;
+	unsigned flags;
+	/* Parsed values, valid for the CACHED_* bits that are set */
+	unsigned cached;
+	int64_t int_value;
+	float float_value;
+	/* Size of the allocation in multiples of the alignment, or 0 if embedded */
+	unsigned units;
+	double double_value;
+	char data[];
+};
 
-/* A single key-value pair */
+/*
+ * A single key-value pair.
+ *
+ * A pair whose key has been interned as a SettingsKey stays in the index
+ * even when the key is removed, with a NULL value. Such a pair is not in
+ * the list, and is treated as missing until a value is set again.
+ *
+ * The list keeps the pairs with a value in insertion order. It is an
+ * array in which removed pairs leave holes, until it is compacted.
+ *
+ * The key is stored inline right after the pair, so that a lookup finds
+ * the hash and the start of the key on the same cache line, and a pair
+ * with its first value takes a single allocation. The key may also be
+ * borrowed from a memory-mapped file, in which case nothing follows the
+ * pair but its embedded value.
+ */
 struct Pair {
 	char *key;
-	char *value;
-	struct Pair *next;
-	struct Pair *prev;
+	size_t key_len;
+	size_t hash;
+	struct Value *value;
+	unsigned flags;
+	unsigned units; /* Size of the allocation in multiples of the alignment */
+	size_t position; /* Position in the list, if listed */
 };
 
-/* The main settings structure */
-struct Settings {
-	struct Pair *first;
-	struct Pair *last;
+/* Flags for pairs */
+#define PAIR_INTERNED     1u
+#define PAIR_IN_BLOCK     4u /* Part of the block of a mapping */
+#define PAIR_SEEN         8u /* Found in the file during settings_reload */
+#define PAIR_CHANGED     16u /* Has a change waiting in settings_reload */
+
+/* Flags for values */
+#define VALUE_EMBEDDED 1u
+
+/* Flags for the typed values cached in a value */
+#define CACHED_INT    1u
+#define CACHED_FLOAT  2u
+#define CACHED_DOUBLE 4u
+
+/* Size of the inline copy of a key, which is 0 if the key is borrowed */
+#define INLINE_KEY_SIZE(key_len, borrow) ((borrow) ? 0 : (key_len) + 1)
+
+/* Offset of the embedded first value from the start of its pair */
+#define EMBEDDED_VALUE_OFFSET(key_size) ALIGN_UP(sizeof(struct Pair) + (key_size))
+
+/*
+ * An entry in the list of pairs.
+ *
+ * Every appended pair gets the next sequence number, so the numbers
+ * increase along the list. A hole (with a NULL pair) keeps its number,
+ * so that iterators can find their place again after a compaction.
+ */
+struct ListEntry {
+	struct Pair *pair;
+	size_t seq;
 };
 
 /*
- * Remove extra whitespace from around the string.
- * Modifies the given string by removing all leading
- * and trailing whitespace characters.
+ * Open-addressing hash index over the pairs.
+ *
+ * The hashes of the pairs are kept in an array of their own next to the
+ * slots, so that probing compares hashes from contiguous memory, and only
+ * follows a slot to its pair (and key) when the hash matches. The hash of
+ * a free slot or a tombstone is meaningless.
  */
-static void trim(char *str) {
-	if (str != NULL) {
-		size_t i;
-		size_t begin = 0;
-		size_t end = strlen(str) - 1;
+struct Index {
+	size_t capacity; /* Number of slots (a power of two) */
+	size_t *hashes;  /* Hashes of the pairs in the slots, after them */
+	struct Pair *slots[];
+};
 
-		/* Shift begin to the first non-space */
-		while (isspace((unsigned char) str[begin])) {
-			++begin;
-		}
+/* A slot of a frozen table, with the hash of its pair, so that most missing keys stop here */
+struct FrozenSlot {
+	size_t hash;
+	struct Pair *pair;
+};
 
-		/* Shift end to the first non-space */
-		while ((end >= begin) && isspace((unsigned char) str[end])) {
-			--end;
-		}
+/*
+ * Minimal perfect hash over the pairs of frozen settings, which replaces the index.
+ *
+ * The keys are spread over buckets of about FROZEN_BUCKET_SIZE keys by
+ * their hash, and each bucket has a displacement that was picked when
+ * freezing so that all the keys land in different slots ("Hash, displace,
+ * and compress" by Belazzougui, Botelho and Dietzfelbinger). There are as
+ * many slots as pairs, so a lookup looks at a single slot. The pairs
+ * follow the table in the same allocation, each with its key and value.
+ */
+struct Frozen {
+	size_t count;            /* Number of pairs, and of slots (at least one) */
+	size_t bucket_count;
+	uint32_t *displacements; /* Displacement of each bucket, after the slots */
+	size_t table_size;       /* Bytes up to the pairs */
+	size_t size;             /* Bytes of the whole allocation */
+	struct FrozenSlot slots[];
+};
 
-		/* Shift all characters back to the start of the string array */
-		for (i = begin; i <= end; ++i) {
-			str[i - begin] = str[i];
-		}
+/*
+ * A reader registered with settings_reader_create.
+ *
+ * The epoch is the writer's epoch at the start of the current read
+ * section, or 0 outside of one. The padding keeps readers that are
+ * allocated next to each other from sharing a cache line.
+ *
+ * A reader of sharded settings has a reader of its own for each shard,
+ * which follow it in the same allocation, since each shard frees its
+ * values on its own. Its read sections are read sections of all of them.
+ */
+struct SettingsReader {
+	Settings *settings;
+	struct SettingsReader *next;
+	unsigned long epoch;
+	int dead;
+	struct SettingsReader **shards; /* Readers of the shards, if sharded */
+	char padding[64];
+};
 
-		/* Make sure it's NUL-terminated */
-		str[i - begin] = '\0';
-	}
-}
+/* Kinds of retired allocations */
+enum RetiredKind {
+	RETIRED_VALUE,
+	RETIRED_PAIR,
+	RETIRED_INDEX
+};
+
+/* An allocation that readers may still be using */
+struct Retired {
+	struct Retired *next;
+	void *ptr;
+	enum RetiredKind kind;
+	unsigned long epoch; /* Writer's epoch when it was retired */
+};
+
+/* A watch added with settings_watch */
+struct SettingsWatch {
+	struct SettingsWatch *next;
+	SettingsWatchCallback callback;
+	void *ctx;
+	int prefix;  /* Set if the pattern ended in an asterisk */
+	int pending; /* Set if a watched key changed since the callback was called */
+	size_t len;  /* Length of the pattern, without the asterisk */
+	char pattern[];
+};
 
 /*
- * (Re)allocates space for the given array.
+ * A sub-table of sharded settings.
+ *
+ * Every call on a key of the shard holds its lock, so calls on keys in
+ * different shards run in parallel. The padding keeps the locks of
+ * neighbouring shards off each other's cache lines.
  */
-static char *resize(char *array, size_t size) {
-	size += 1; /* Leave room for NUL */
+struct Shard {
+	Settings *settings;
+#ifdef HAVE_SHARD_LOCKS
+	pthread_mutex_t lock;
+#endif
+	char padding[64];
+};
 
-	if (array == NULL || strlen(array) <= size) {
-		array = memory_realloc(array, size);
-		if (array) {
-			/* Make sure it terminates */
-			array[size - 1] = '\0';
-		}
-	}
+/*
+ * An entry of the resolution cache of an overlay: the pair of a layer
+ * that a key was last found in, and the generation of the layers at the
+ * time. The sequence number is odd while a reader fills the entry.
+ */
+struct OverlayEntry {
+	unsigned long seq;
+	unsigned long generation;
+	struct Pair *pair;
+};
 
-	return array;
-}
+/* What a file looked like when settings_reload last applied it */
+struct Fingerprint {
+	int valid;
+	long long size;
+	long long mtime; /* Modification time in seconds, or 0 if unknown */
+	unsigned long long hash; /* Hash of the whole contents */
+	unsigned long writes; /* Writes made to the settings at the time */
+};
+
+/* The main settings structure */
+struct Settings {
+	/* Pairs with a value, in insertion order */
+	struct ListEntry *list;
+	size_t list_len;      /* Number of entries, including holes */
+	size_t list_capacity;
+	size_t listed;        /* Number of entries that are not holes */
+	size_t list_seq;      /* Sequence number of the latest entry */
+	unsigned long compactions;
+	/* Hash index over all the pairs, including interned ones without a value */
+	struct Index *index;
+	/* If frozen, the perfect hash over the pairs, which then has no index */
+	struct Frozen *frozen;
+	size_t count; /* Number of pairs in the index */
+	size_t used;  /* Number of pairs and tombstones in the index */
+	/* If set, pairs and strings are allocated from arena chunks */
+	int use_arena;
+	struct Chunk *chunks;
+	/* Freed pairs and values by size, which new ones are taken from first */
+	struct FreeBlock *free_lists[FREE_LISTS];
+	struct Index *spare_index; /* The index replaced by the last rebuild */
+	size_t free_bytes;    /* Bytes in the free lists */
+	size_t storage_bytes; /* Bytes of pairs and values in use */
+	/* Files mapped by settings_load_mmap, which pairs may borrow from */
+	struct Mapping *mappings;
+	/* Readers and the allocations retired while they may be reading */
+	struct SettingsReader *readers;
+	struct Retired *retired;
+	size_t retired_count;
+	unsigned long epoch;
+	/* Records for retired allocations that have been freed, kept for reuse */
+	struct Retired *spare_retired;
+	size_t spare_count;
+	/* References held through a SettingsSnapshot, including its own */
+	unsigned long refs;
+	/* Listed pairs sorted by key, for settings_foreach_prefix; rebuilt when stale */
+	struct Pair **sorted;
+	size_t sorted_count;
+	size_t sorted_capacity;
+	size_t sorted_changes; /* Pairs added or removed one by one since it was used */
+	int sorted_stale;
+	/* Number of values set or removed so far, for noticing changes */
+	unsigned long writes;
+	/* The file that settings_reload last applied */
+	struct Fingerprint reloaded;
+	/* Watches, and whether any of them have changes to be told about */
+	struct SettingsWatch *watches;
+	int watch_pending;
+	/* Buffer that the last stream was read into, kept for the next one */
+	char *stream_buf;
+	size_t stream_size;
+	/* If created sharded, the sub-tables that keys are spread over by hash */
+	struct Shard *shards;
+	size_t shard_count;
+	/* Number of times that a key gained or lost its value, for overlays to notice */
+	unsigned long generation;
+	/* If created as an overlay, the settings below its own keys, topmost first */
+	Settings **layers;
+	size_t layer_count;
+	/* Pairs that keys were last found in among the layers, by hash */
+	struct OverlayEntry *cache;
+	size_t cache_size; /* Number of entries (a power of two) */
+	/* Operation counters, added up by settings_stats */
+	struct StatStripe stats[STAT_STRIPES];
+#ifdef SETTINGS_TRACE
+	/* Latency histograms of the trace points, reported by settings_trace */
+	SettingsTrace traces[SETTINGS_TRACE_POINTS];
+#endif
+};
 
 /*
- * Copy key and value from the source to destination.
+ * A slot holding the current settings, which can be swapped as a whole.
+ *
+ * Acquiring counts itself in one of the two acquiring counters, picked by
+ * the generation, while it loads the pointer and takes a reference.
+ * Publishing moves on to the next generation and waits only for the count
+ * of the previous one to drop, so readers arriving meanwhile use the other
+ * counter and cannot keep it waiting. Both sides fence between counting
+ * and looking at the other side's variable, so that either publishing sees
+ * the count or the reader sees the new pointer.
  */
-static int copy_pair(char *dst_key, char *dst_val, const char *src_key, const char *src_val) {
-	size_t key_len;
-	size_t val_len;
+struct SettingsSnapshot {
+	Settings *current;
+	unsigned long generation;
+	unsigned long acquiring[2];
+};
 
-	/* Cannot insert NULL */
-	if (dst_key == NULL || dst_val == NULL) {
-		return 0;
-	}
+/* Marks an index slot whose pair has been removed */
+static struct Pair tombstone;
+#define TOMBSTONE (&tombstone)
 
-	/* Leave room for NUL */
-	key_len = strlen(src_key) + 1;
-	val_len = strlen(src_val) + 1;
+/*
+ * Allocate memory from the arena, adding a new chunk if the current one
+ * is full. Allocations larger than a chunk get a chunk of their own.
+ * Returns a pointer to the memory, or NULL if out of memory.
+ */
+static void *arena_alloc(struct Chunk **chunks, size_t size) {
+	struct Chunk *chunk = *chunks;
+	void *ptr;
 
-	/* Replace key and value */
-	strncpy(dst_key, src_key, key_len);
-	strncpy(dst_val, src_val, val_len);
+	/* Round up so that the next allocation stays aligned */
+	size = ALIGN_UP(size);
 
-	/* Make sure they terminate at least at the very end */
-	dst_key[key_len - 1] = '\0';
-	dst_val[val_len - 1] = '\0';
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		const size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = memory_malloc(sizeof(struct Chunk) + chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		if (*chunks != NULL && size > ARENA_CHUNK_SIZE) {
+			/* Keep filling the current chunk after this one */
+			chunk->next = (*chunks)->next;
+			(*chunks)->next = chunk;
+		} else {
+			chunk->next = *chunks;
+			*chunks = chunk;
+		}
+	}
 
-	return 1;
+	ptr = (char *) chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
 }
 
 /*
- * Free the memory allocated for the given pair.
+ * Free all the chunks of an arena.
  */
-static void free_pair(struct Pair *pair) {
-	if (pair != NULL) {
-		memory_free(pair->key);
-		pair->key = NULL;
-		memory_free(pair->value);
-		pair->value = NULL;
-		memory_free(pair);
+static void arena_free(struct Chunk *chunks) {
+	while (chunks != NULL) {
+		struct Chunk *next = chunks->next;
+		memory_free(chunks);
+		chunks = next;
 	}
 }
 
 /*
- * Create a new key/value pair from the given key and value.
- * Returns a newly allocated pair, or NULL on failure.
+ * Allocate memory for pairs and strings of the given settings.
+ *
+ * The size is rounded up to a multiple of the alignment, which is stored
+ * in units for storage_free. Small allocations are taken from the free
+ * list of their size if it has any, so that setting and removing keys
+ * over and over does not go through malloc.
+ * Returns a pointer to the memory, or NULL if out of memory.
  */
-static struct Pair *create_pair(const char *key, const char *value) {
-	struct Pair *pair = NULL;
+static void *storage_alloc(Settings *settings, size_t size, unsigned *units) {
+	const size_t n = ALIGN_UP(size) / sizeof(union Align);
+	void *ptr;
 
-	/* NULL keys and values are not accepted */
-	if (key != NULL && value != NULL) {
-		pair = memory_malloc(sizeof(struct Pair));
-		if (pair) {
-			/* By default this is the last pair with empty key and value */
-			pair->key = resize(NULL, strlen(key));
-			pair->value = resize(NULL, strlen(value));
-			pair->next = NULL;
-			pair->prev = NULL;
-			/* Fill pair with the new values */
-			if (!copy_pair(pair->key, pair->value, key, value)) {
-				free_pair(pair);
-				pair = NULL;
-			}
-		}
+	if (n > UINT_MAX || size > ALIGN_UP(size)) {
+		return NULL; /* Too large to record, or the size overflowed */
 	}
-
-	return pair;
+	*units = (unsigned) n;
+	if (settings->use_arena) {
+		return arena_alloc(&settings->chunks, size);
+	}
+	if (n < FREE_LISTS && settings->free_lists[n] != NULL) {
+		struct FreeBlock *block = settings->free_lists[n];
+		settings->free_lists[n] = block->next;
+		settings->free_bytes -= n * sizeof(union Align);
+		ptr = block;
+	} else if (!(ptr = memory_malloc(n * sizeof(union Align)))) {
+		return NULL;
+	}
+	settings->storage_bytes += n * sizeof(union Align);
+	return ptr;
 }
 
 /*
- * Check if the given keys match.
- * Both keys should be non-NULL.
- * Returns 1 if the keys are the same, 0 otherwise.
+ * Free memory from storage_alloc of the given number of units.
+ * Small allocations go to a free list for reuse, as long as the free
+ * lists hold at most FREE_MAX_BYTES. In arena mode, the memory is only
+ * released in settings_free.
  */
-static int keys_match(const char *key1, const char *key2) {
-	if (key1 == NULL || key2 == NULL) {
-		return 0;
+static void storage_free(Settings *settings, void *ptr, unsigned units) {
+	const size_t size = units * sizeof(union Align);
+	if (settings->use_arena) {
+		return;
+	}
+	settings->storage_bytes -= size;
+	if (units < FREE_LISTS && settings->free_bytes + size <= FREE_MAX_BYTES) {
+		struct FreeBlock *block = ptr;
+		block->next = settings->free_lists[units];
+		settings->free_lists[units] = block;
+		settings->free_bytes += size;
+	} else {
+		memory_free(ptr);
 	}
-	return strcmp(key1, key2) == 0;
 }
 
 /*
- * Find the key/value pair corresponding to the given key.
- * Performs a linear search on the linked list.
- * Returns the pair if it exists, NULL otherwise.
+ * Give the memory in the free lists, the spare index and the spare
+ * retired records back.
  */
-static struct Pair *find_pair(Settings *settings, const char *key) {
-	if (settings != NULL) {
-		struct Pair *pair = settings->first;
-		while (pair != NULL) {
-			if (keys_match(pair->key, key)) {
-				return pair;
-			}
-			pair = pair->next;
+static void release_free_lists(Settings *settings) {
+	size_t i;
+	for (i = 0; i < FREE_LISTS; ++i) {
+		while (settings->free_lists[i] != NULL) {
+			struct FreeBlock *next = settings->free_lists[i]->next;
+			memory_free(settings->free_lists[i]);
+			settings->free_lists[i] = next;
 		}
 	}
-	return NULL;
+	settings->free_bytes = 0;
+	while (settings->spare_retired != NULL) {
+		struct Retired *next = settings->spare_retired->next;
+		memory_free(settings->spare_retired);
+		settings->spare_retired = next;
+	}
+	settings->spare_count = 0;
+	memory_free(settings->spare_index);
+	settings->spare_index = NULL;
 }
 
 /*
- * Read a line from the given file.
+ * Shift the given begin and end pointers inwards
+ * past any leading and trailing whitespace.
  */
-char *get_line(FILE *f) {
-	size_t size = BUFSIZ;
-	size_t len;
-	char *buf = memory_malloc(size);
+static void trim_span(const char **begin, const char **end) {
+	const char *b = *begin;
+	const char *e = *end;
+	while (b < e && isspace((unsigned char) *b)) {
+		++b;
+	}
+	while (e > b && isspace((unsigned char) e[-1])) {
+		--e;
+	}
+	*begin = b;
+	*end = e;
+}
 
-	if (buf == NULL || fgets(buf, size, f) == NULL) {
-		return NULL;
+/*
+ * Vector block scanning.
+ *
+ * scan_block compares SCAN_WIDTH bytes at once against '\n' and '=',
+ * and produces a bit mask for each, with the lowest bits for the first
+ * bytes. Each byte maps to (1 << SCAN_SHIFT) bits in the masks.
+ */
+#if defined(SCAN_AVX2)
+	#define SCAN_WIDTH 32
+	#define SCAN_SHIFT 0
+static void scan_block(const char *p, unsigned long long *nl_mask, unsigned long long *eq_mask) {
+	const __m256i block = _mm256_loadu_si256((const __m256i *) p);
+	*nl_mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+	*eq_mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('=')));
+}
+#elif defined(SCAN_SSE2)
+	#define SCAN_WIDTH 16
+	#define SCAN_SHIFT 0
+static void scan_block(const char *p, unsigned long long *nl_mask, unsigned long long *eq_mask) {
+	const __m128i block = _mm_loadu_si128((const __m128i *) p);
+	*nl_mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+	*eq_mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('=')));
+}
+#elif defined(SCAN_NEON)
+	#define SCAN_WIDTH 16
+	#define SCAN_SHIFT 2
+static unsigned long long neon_mask(uint8x16_t cmp) {
+	/* Narrow each byte to a nibble, as NEON has no movemask */
+	const uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+static void scan_block(const char *p, unsigned long long *nl_mask, unsigned long long *eq_mask) {
+	const uint8x16_t block = vld1q_u8((const uint8_t *) p);
+	*nl_mask = neon_mask(vceqq_u8(block, vdupq_n_u8('\n')));
+	*eq_mask = neon_mask(vceqq_u8(block, vdupq_n_u8('=')));
+}
+#endif
+
+#ifdef SCAN_WIDTH
+/*
+ * Count the trailing zero bits of a non-zero mask.
+ */
+static unsigned trailing_zeros(unsigned long long mask) {
+#if defined(__GNUC__)
+	return (unsigned) __builtin_ctzll(mask);
+#else
+	unsigned n = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		++n;
 	}
+	return n;
+#endif
+}
+#endif
 
-	len = strlen(buf);
-	while (strchr(buf, '\n') == NULL) {
-		size += BUFSIZ;
-		buf = memory_realloc(buf, size);
-		if (fgets(buf + len, size - len, f) == NULL) {
-			return buf;
+/*
+ * Scan a line from the given buffer in a single pass.
+ * Finds the end of the line, which is the first newline or the end
+ * of the buffer, and the first equals sign before it (or NULL).
+ * Returns a pointer to the end of the line.
+ */
+static const char *scan_line(const char *p, const char *end, const char **eq) {
+	*eq = NULL;
+
+#ifdef SCAN_WIDTH
+	while (end - p >= SCAN_WIDTH) {
+		unsigned long long nl_mask;
+		unsigned long long eq_mask;
+		scan_block(p, &nl_mask, &eq_mask);
+		if (*eq == NULL) {
+			if (nl_mask != 0) {
+				/* Only count equals signs before the newline */
+				eq_mask &= nl_mask ^ (nl_mask - 1);
+			}
+			if (eq_mask != 0) {
+				*eq = p + (trailing_zeros(eq_mask) >> SCAN_SHIFT);
+			}
+		}
+		if (nl_mask != 0) {
+			return p + (trailing_zeros(nl_mask) >> SCAN_SHIFT);
 		}
-		len += strlen(buf + len);
+		p += SCAN_WIDTH;
 	}
+#endif
 
-	if (buf) {
-		buf[size - 1] = '\0';
+	/* Scan the rest (or everything, without vectors) one byte at a time */
+	for (; p < end; ++p) {
+		if (*p == '\n') {
+			return p;
+		}
+		if (*p == '=' && *eq == NULL) {
+			*eq = p;
+		}
 	}
-
-	return buf;
+	return end;
 }
 
-Settings *settings_create(void) {
-	Settings *settings = memory_malloc(sizeof(Settings));
-	if (settings) {
-		settings->first = NULL;
-		settings->last = NULL;
+/*
+ * Free the memory of a value, unless it is embedded in its pair.
+ */
+static void free_value(Settings *settings, struct Value *value) {
+	if (value != NULL && !(value->flags & VALUE_EMBEDDED)) {
+		storage_free(settings, value, value->units);
 	}
-	return settings;
 }
 
-void settings_free(Settings *settings) {
-	if (settings != NULL) {
-		struct Pair *pair = settings->first;
-		while (pair != NULL) {
-			struct Pair *next = pair->next;
-			free_pair(pair);
-			pair = next;
+/*
+ * Free the memory allocated for the given pair, along with its value.
+ */
+static void free_pair(Settings *settings, struct Pair *pair) {
+	if (pair != NULL) {
+		free_value(settings, pair->value);
+		if (!(pair->flags & PAIR_IN_BLOCK)) {
+			storage_free(settings, pair, pair->units);
 		}
 	}
 }
 
-int settings_load(Settings *settings, const char *path) {
-	FILE *f;
-	char *line;
-
-	/* Settings and path are required */
-	if (settings == NULL || path == NULL) {
-		return 0;
+/*
+ * Free a retired allocation for good.
+ */
+static void free_retired(Settings *settings, void *ptr, enum RetiredKind kind) {
+	switch (kind) {
+	case RETIRED_VALUE:
+		free_value(settings, ptr);
+		break;
+	case RETIRED_PAIR:
+		free_pair(settings, ptr);
+		break;
+	case RETIRED_INDEX:
+		/* Keep it for the next rebuild, which is at the same size when clearing tombstones */
+		memory_free(settings->spare_index);
+		settings->spare_index = ptr;
+		break;
 	}
+}
 
-	/* Attempt to open file as text */
-	if (!(f = fopen(path, "rt"))) {
-		return 0;
-	}
+/*
+ * Get the oldest epoch that any reader is in a read section for.
+ * Readers that have been freed are unlinked from the list on the way,
+ * except for the first one, which a new reader may be linking to.
+ * Returns the oldest epoch, or ULONG_MAX if nobody is reading.
+ */
+static unsigned long oldest_reader_epoch(Settings *settings) {
+	unsigned long oldest = ULONG_MAX;
+	struct SettingsReader *prev = NULL;
+	struct SettingsReader *reader = load_acquire(&settings->readers);
 
-	/* Successfully opened, so read any settings */
-	while ((line = get_line(f)) != NULL) {
-		/* Look for an equals sign */
-		char *p = strchr(line, '=');
-		if (p != NULL) {
-			/* Lengths of each part */
-			const size_t key_len = p - line;      /* [####=....] */
-			const size_t val_len = strlen(p + 1); /* [....=####] */
-			/* Buffers of appropriate length*/
-			char key[key_len];
-			char val[val_len];
-			/* Split at the equals sign */
-			strncpy(key, line, key_len);
-			strncpy(val, p + 1, val_len);
-			/* Terminate the parts */
-			key[key_len - 1] = '\0';
-			val[val_len - 1] = '\0';
-			/* Remove extraneous spaces */
-			trim(key);
-			trim(val);
-			/* Add to settings */
-			settings_set_string(settings, key, val);
+	while (reader != NULL) {
+		struct SettingsReader *next = reader->next;
+		if (prev != NULL && load_acquire(&reader->dead)) {
+			prev->next = next;
+			memory_free(reader);
+		} else {
+			const unsigned long epoch = load_acquire(&reader->epoch);
+			if (epoch != 0 && epoch < oldest) {
+				oldest = epoch;
+			}
+			prev = reader;
 		}
-		memory_free(line);
+		reader = next;
 	}
 
-	fclose(f);
-	return 1;
+	return oldest;
 }
 
-int settings_save(Settings *settings, const char *path) {
-	FILE *f;
-	struct Pair *pair;
+/*
+ * Free the retired allocations that no reader can be using anymore.
+ * Anything retired before the oldest ongoing read section began is safe.
+ */
+static void reclaim(Settings *settings) {
+	struct Retired **link = &settings->retired;
+	unsigned long oldest;
 
-	/* Settings and path are mandatory */
-	if (settings == NULL || path == NULL) {
-		return 0;
+	full_fence();
+	oldest = oldest_reader_epoch(settings);
+	while (*link != NULL) {
+		struct Retired *retired = *link;
+		if (retired->epoch < oldest) {
+			*link = retired->next;
+			free_retired(settings, retired->ptr, retired->kind);
+			/* Keep the record for the next retire */
+			retired->next = settings->spare_retired;
+			settings->spare_retired = retired;
+			++settings->spare_count;
+			--settings->retired_count;
+		} else {
+			link = &retired->next;
+		}
 	}
+}
 
-	/* Open for writing */
-	if (!(f = fopen(path, "wt"))) {
-		return 0;
-	}
+/*
+ * Free an allocation that has just been unpublished, once no reader
+ * can be using it anymore. Without registered readers, it is freed
+ * right away. Otherwise it is kept until the ongoing read sections end.
+ */
+static void retire(Settings *settings, void *ptr, enum RetiredKind kind) {
+	struct Retired *retired;
 
-	/* Write one key and value per line */
-	pair = settings->first;
-	while (pair != NULL) {
-		fprintf(f, "%s = %s\n", pair->key, pair->value);
-		pair = pair->next;
+	if (ptr == NULL || (kind != RETIRED_INDEX && settings->use_arena)) {
+		return; /* Nothing to free */
 	}
 
-	fclose(f);
-	return 1;
-}
+	/* Make sure new readers can no longer find the allocation */
+	full_fence();
+	if (load_acquire(&settings->readers) == NULL) {
+		free_retired(settings, ptr, kind);
+		return;
+	}
 
-const char *settings_get_string(Settings *settings, const char *key, const char *default_value) {
-	struct Pair *pair = find_pair(settings, key);
-	if (pair != NULL) {
-		return pair->value;
+	if ((retired = settings->spare_retired) != NULL) {
+		settings->spare_retired = retired->next;
+		--settings->spare_count;
+	} else {
+		retired = memory_malloc(sizeof(struct Retired));
+	}
+	if (retired == NULL) {
+		/* No memory to defer it, so wait for the readers instead */
+		const unsigned long epoch = settings->epoch;
+		store_release(&settings->epoch, epoch + 1);
+		full_fence();
+		while (oldest_reader_epoch(settings) <= epoch) {
+			/* Spin until the readers are done */
+		}
+		free_retired(settings, ptr, kind);
+		return;
 	}
-	return default_value;
-}
 
-int settings_get_int(Settings *settings, const char *key, int default_value) {
-	struct Pair *pair = find_pair(settings, key);
-	if (pair != NULL) {
-		return atoi(pair->value);
+	retired->ptr = ptr;
+	retired->kind = kind;
+	retired->epoch = settings->epoch;
+	retired->next = settings->retired;
+	settings->retired = retired;
+	store_release(&settings->epoch, settings->epoch + 1);
+
+	if (++settings->retired_count >= RECLAIM_BATCH) {
+		reclaim(settings);
 	}
-	return default_value;
 }
 
-float settings_get_float(Settings *settings, const char *key, float default_value) {
-	struct Pair *pair = find_pair(settings, key);
-	if (pair != NULL) {
-		return atof(pair->value);
+/*
+ * Allocate a new value holding a copy of the given string.
+ * If memory is given, the value is placed there instead, and is
+ * marked as embedded; it must have room for value_size(len) bytes.
+ * Returns the value, or NULL if out of memory.
+ */
+#define value_size(len) (sizeof(struct Value) + (len) + 1)
+static struct Value *new_value(Settings *settings, void *memory, const char *str, size_t len) {
+	unsigned units = 0;
+	struct Value *value = memory != NULL ? memory : storage_alloc(settings, value_size(len), &units);
+	if (value) {
+		memcpy(value->data, str, len);
+		value->data[len] = '\0';
+		value->str = value->data;
+		value->len = len;
+		value->flags = memory != NULL ? VALUE_EMBEDDED : 0;
+		value->cached = 0;
+		value->units = units;
 	}
-	return default_value;
+	return value;
 }
 
-int settings_set_string(Settings *settings, const char *key, const char *value) {
-	int result = 0;
-	struct Pair *pair;
+/*
+ * Number formatting and parsing.
+ *
+ * These do not depend on the locale, so the same text is written and read
+ * everywhere. Integers are written two digits at a time. Floating-point
+ * numbers are written with the shortest digits that read back as the same
+ * number, using Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers"), and an exact search with snprintf for
+ * the fraction of a percent of numbers that it cannot decide. Parsing
+ * takes Clinger's fast path when the digits and the power of ten are
+ * exact, and falls back to strtod otherwise.
+ */
 
-	if (settings == NULL || key == NULL || value == NULL) {
-		/* Settings, key, and value are mandatory */
-		return 0;
-	}
+/* Sizes of the buffers that numbers are formatted into, with the NUL */
+#define INT64_CHARS 21
+#define NUMBER_CHARS 32
 
-	pair = find_pair(settings, key);
-	if (pair != NULL) {
-		pair->key = resize(pair->key, strlen(key));
-		pair->value = resize(pair->value, strlen(value));
-		result = copy_pair(pair->key, pair->value, key, value);
+/* The digit pairs from "00" to "99" */
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+/*
+ * Write an unsigned integer into the buffer, and NUL-terminate it.
+ * Returns the number of characters written.
+ */
+static size_t format_uint64(char *buf, uint64_t number) {
+	char digits[INT64_CHARS];
+	char *p = digits + sizeof(digits);
+	size_t len;
+	while (number >= 100) {
+		const size_t i = (size_t) (number % 100) * 2;
+		number /= 100;
+		p -= 2;
+		memcpy(p, digit_pairs + i, 2);
+	}
+	if (number >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + number * 2, 2);
 	} else {
-		/* We have to create a new pair */
-		pair = create_pair(key, value);
-		if (pair != NULL) {
-			if (settings->first == NULL) {
-				settings->first = pair;
-			}
-			if (settings->last == NULL) {
-				settings->last = pair;
-			} else {
-				/* Append to last */
-				settings->last->next = pair;
-				pair->prev = settings->last;
-				settings->last = pair;
-			}
-			result = 1;
-		}
+		*--p = (char) ('0' + number);
 	}
-	return result; /* Failed to set value */
+	len = (size_t) (digits + sizeof(digits) - p);
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return len;
 }
 
-int settings_set_int(Settings *settings, const char *key, int value) {
-	/* Convert int to string */
-	char value_str[INT_DIGITS + 1] = { '\0' };
-	snprintf(value_str, INT_DIGITS, "%d", value);
-
-	/* Save the string */
-	return settings_set_string(settings, key, value_str);
+/*
+ * Write an integer into the buffer, which needs room for INT64_CHARS.
+ * Returns the number of characters written.
+ */
+static size_t format_int64(char *buf, int64_t number) {
+	if (number < 0) {
+		buf[0] = '-';
+		return 1 + format_uint64(buf + 1, 0 - (uint64_t) number);
+	}
+	return format_uint64(buf, (uint64_t) number);
 }
 
-int settings_set_float(Settings *settings, const char *key, float value) {
-	/* Convert float to string */
-	char value_str[DBL_DIGITS + 1] = { '\0' };
-	snprintf(value_str, DBL_DIGITS, "%f", value);
+/* A floating-point number with a 64-bit significand, f * 2^e */
+struct DiyFp {
+	uint64_t f;
+	int e;
+};
+
+/*
+ * Normalized powers of ten from 10^-348 to 10^340, in steps of 10^8,
+ * with their significand and binary exponent in separate tables.
+ */
+static const uint64_t cached_powers_f[] = {
+	0xfa8fd5a0081c0288u, 0xbaaee17fa23ebf76u, 0x8b16fb203055ac76u,
+	0xcf42894a5dce35eau, 0x9a6bb0aa55653b2du, 0xe61acf033d1a45dfu,
+	0xab70fe17c79ac6cau, 0xff77b1fcbebcdc4fu, 0xbe5691ef416bd60cu,
+	0x8dd01fad907ffc3cu, 0xd3515c2831559a83u, 0x9d71ac8fada6c9b5u,
+	0xea9c227723ee8bcbu, 0xaecc49914078536du, 0x823c12795db6ce57u,
+	0xc21094364dfb5637u, 0x9096ea6f3848984fu, 0xd77485cb25823ac7u,
+	0xa086cfcd97bf97f4u, 0xef340a98172aace5u, 0xb23867fb2a35b28eu,
+	0x84c8d4dfd2c63f3bu, 0xc5dd44271ad3cdbau, 0x936b9fcebb25c996u,
+	0xdbac6c247d62a584u, 0xa3ab66580d5fdaf6u, 0xf3e2f893dec3f126u,
+	0xb5b5ada8aaff80b8u, 0x87625f056c7c4a8bu, 0xc9bcff6034c13053u,
+	0x964e858c91ba2655u, 0xdff9772470297ebdu, 0xa6dfbd9fb8e5b88fu,
+	0xf8a95fcf88747d94u, 0xb94470938fa89bcfu, 0x8a08f0f8bf0f156bu,
+	0xcdb02555653131b6u, 0x993fe2c6d07b7facu, 0xe45c10c42a2b3b06u,
+	0xaa242499697392d3u, 0xfd87b5f28300ca0eu, 0xbce5086492111aebu,
+	0x8cbccc096f5088ccu, 0xd1b71758e219652cu, 0x9c40000000000000u,
+	0xe8d4a51000000000u, 0xad78ebc5ac620000u, 0x813f3978f8940984u,
+	0xc097ce7bc90715b3u, 0x8f7e32ce7bea5c70u, 0xd5d238a4abe98068u,
+	0x9f4f2726179a2245u, 0xed63a231d4c4fb27u, 0xb0de65388cc8ada8u,
+	0x83c7088e1aab65dbu, 0xc45d1df942711d9au, 0x924d692ca61be758u,
+	0xda01ee641a708deau, 0xa26da3999aef774au, 0xf209787bb47d6b85u,
+	0xb454e4a179dd1877u, 0x865b86925b9bc5c2u, 0xc83553c5c8965d3du,
+	0x952ab45cfa97a0b3u, 0xde469fbd99a05fe3u, 0xa59bc234db398c25u,
+	0xf6c69a72a3989f5cu, 0xb7dcbf5354e9beceu, 0x88fcf317f22241e2u,
+	0xcc20ce9bd35c78a5u, 0x98165af37b2153dfu, 0xe2a0b5dc971f303au,
+	0xa8d9d1535ce3b396u, 0xfb9b7cd9a4a7443cu, 0xbb764c4ca7a44410u,
+	0x8bab8eefb6409c1au, 0xd01fef10a657842cu, 0x9b10a4e5e9913129u,
+	0xe7109bfba19c0c9du, 0xac2820d9623bf429u, 0x80444b5e7aa7cf85u,
+	0xbf21e44003acdd2du, 0x8e679c2f5e44ff8fu, 0xd433179d9c8cb841u,
+	0x9e19db92b4e31ba9u, 0xeb96bf6ebadf77d9u, 0xaf87023b9bf0ee6bu
+};
+
+static const int16_t cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+/* Powers of ten that fit in 32 bits */
+static const uint32_t powers_of_ten[] = {
+	1u, 10u, 100u, 1000u, 10000u, 100000u, 1000000u, 10000000u, 100000000u, 1000000000u
+};
+
+/*
+ * Multiply two numbers, rounding the product to 64 bits.
+ */
+static struct DiyFp diy_multiply(struct DiyFp x, struct DiyFp y) {
+	const uint64_t mask = 0xffffffffu;
+	const uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+	const uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	const uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (1u << 31);
+	struct DiyFp product;
+	product.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+	product.e = x.e + y.e + 64;
+	return product;
+}
+
+/*
+ * Shift a non-zero number left until its top bit is set.
+ */
+static struct DiyFp diy_normalize(struct DiyFp x) {
+	while (!(x.f & ((uint64_t) 1 << 63))) {
+		x.f <<= 1;
+		--x.e;
+	}
+	return x;
+}
+
+/*
+ * Get a cached power of ten c = 10^-k, such that multiplying a number
+ * with the given binary exponent by it gives an exponent from -60 to -32.
+ */
+static struct DiyFp cached_power(int e, int *k) {
+	const double dk = (-61 - e) * 0.30102999566398114 + 347;
+	struct DiyFp power;
+	int index = (int) dk;
+	if (dk - index > 0.0) {
+		++index;
+	}
+	index = (index >> 3) + 1;
+	*k = -(-348 + index * 8);
+	power.f = cached_powers_f[index];
+	power.e = cached_powers_e[index];
+	return power;
+}
+
+/*
+ * Move the last digit down while that brings the number closer to the
+ * scaled value w, and keeps it within the unsafe interval around it.
+ * The scaled numbers are only known to within unit, so this also checks
+ * that no other digits could be closer, and that the digits are safely
+ * inside the rounding interval; the distance is that of w from the
+ * widened upper boundary. Returns 1 if so, or 0 if it cannot tell.
+ */
+static int round_weed(char *digits, int len, uint64_t distance, uint64_t unsafe, uint64_t rest,
+		uint64_t ten_kappa, uint64_t unit) {
+	const uint64_t small_distance = distance - unit;
+	const uint64_t big_distance = distance + unit;
+	while (rest < small_distance && unsafe - rest >= ten_kappa
+			&& (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+		--digits[len - 1];
+		rest += ten_kappa;
+	}
+	/* Moving down once more could still have come closer to the real value */
+	if (rest < big_distance && unsafe - rest >= ten_kappa
+			&& (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+		return 0;
+	}
+	return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/*
+ * Generate the digits of the scaled upper boundary high, widened by the
+ * error of the scaling, stopping as soon as they are within the widened
+ * interval down to low, and round them towards the scaled value w.
+ * Sets the number of digits and adds their decimal exponent to k.
+ * Returns 1 if the digits are the shortest and closest, or 0 if unsure.
+ */
+static int digit_gen(struct DiyFp low, struct DiyFp w, struct DiyFp high, char *digits, int *len, int *k) {
+	const int shift = -w.e;
+	const uint64_t one = (uint64_t) 1 << shift;
+	const uint64_t too_high = high.f + 1;
+	uint64_t unit = 1;
+	uint64_t unsafe = too_high - (low.f - unit);
+	uint32_t p1 = (uint32_t) (too_high >> shift);
+	uint64_t p2 = too_high & (one - 1);
+	int kappa = 1;
+
+	while (kappa < 10 && p1 >= powers_of_ten[kappa]) {
+		++kappa;
+	}
+
+	/* Digits of the integer part */
+	*len = 0;
+	while (kappa > 0) {
+		const uint32_t divisor = powers_of_ten[kappa - 1];
+		uint64_t rest;
+		digits[(*len)++] = (char) ('0' + p1 / divisor);
+		p1 %= divisor;
+		--kappa;
+		rest = ((uint64_t) p1 << shift) + p2;
+		if (rest < unsafe) {
+			*k += kappa;
+			return round_weed(digits, *len, too_high - w.f, unsafe, rest, (uint64_t) divisor << shift, unit);
+		}
+	}
+
+	/* Digits of the fractional part */
+	for (;;) {
+		p2 *= 10;
+		unit *= 10;
+		unsafe *= 10;
+		digits[(*len)++] = (char) ('0' + (p2 >> shift));
+		p2 &= one - 1;
+		--kappa;
+		if (p2 < unsafe) {
+			*k += kappa;
+			return round_weed(digits, *len, (too_high - w.f) * unit, unsafe, p2, one, unit);
+		}
+	}
+}
+
+/*
+ * Write the shortest digits of the positive number f * 2^e, which is
+ * rounded to a precision of as many bits as f has, with Grisu3. The lower
+ * boundary is closer when f is a power of two, except for the smallest
+ * exponent. Sets the number of digits and k to their decimal exponent.
+ * Returns 1 on success, or 0 for the few numbers that need exact_digits.
+ */
+static int grisu3(uint64_t f, int e, int lower_closer, char *digits, int *len, int *k) {
+	struct DiyFp v, high, low, power;
+	v.f = f;
+	v.e = e;
+	high.f = (f << 1) + 1;
+	high.e = e - 1;
+	high = diy_normalize(high);
+	if (lower_closer) {
+		low.f = (f << 2) - 1;
+		low.e = e - 2;
+	} else {
+		low.f = (f << 1) - 1;
+		low.e = e - 1;
+	}
+	low.f <<= low.e - high.e;
+	low.e = high.e;
+	v = diy_normalize(v);
+
+	power = cached_power(high.e, k);
+	v = diy_multiply(v, power);
+	high = diy_multiply(high, power);
+	low = diy_multiply(low, power);
+	return digit_gen(low, v, high, digits, len, k);
+}
+
+/*
+ * Check whether the given character is a decimal digit.
+ */
+static int is_digit(char c) {
+	return (unsigned char) (c - '0') < 10;
+}
+
+/*
+ * Check whether the given digits with the decimal exponent k read back as
+ * the given double, or float if single is set. The text has no decimal
+ * point, so that reading it does not depend on the locale.
+ */
+static int digits_read_back(const char *digits, int len, int k, double number, int single) {
+	char text[NUMBER_CHARS + 8];
+	memcpy(text, digits, (size_t) len);
+	sprintf(text + len, "e%d", k);
+	return single ? strtof(text, NULL) == (float) number : strtod(text, NULL) == number;
+}
+
+/*
+ * Write the digits of the given positive number with the given precision
+ * that read back as it, if any. Those are the correctly rounded digits,
+ * or the ones just above them, which may be the only ones that read back
+ * when the interval below a power of two is the narrower one.
+ * Returns 1 if either reads back, 0 otherwise.
+ */
+static int precise_digits(double number, int single, int precision, char *digits, int *len, int *k) {
+	char text[NUMBER_CHARS + 8];
+	const char *p;
+	int i;
+
+	/* Take the digits of d.ddde+x, whatever the decimal point is */
+	snprintf(text, sizeof(text), "%.*e", precision - 1, number);
+	*len = 0;
+	for (p = text; *p != 'e'; ++p) {
+		if (is_digit(*p)) {
+			digits[(*len)++] = *p;
+		}
+	}
+	*k = atoi(p + 1) - *len + 1;
+	if (digits_read_back(digits, *len, *k, number, single)) {
+		return 1;
+	}
+	for (i = *len - 1; i >= 0 && digits[i] == '9'; --i) {
+		digits[i] = '0';
+	}
+	if (i < 0) {
+		digits[0] = '1';
+		++*k;
+	} else {
+		++digits[i];
+	}
+	return digits_read_back(digits, *len, *k, number, single);
+}
+
+/*
+ * Write the shortest digits that read back as the given positive number,
+ * the slow but exact way, for the numbers that Grisu3 cannot decide.
+ * Digits that read back at one precision do at any higher one too, so
+ * the fewest are found by bisecting, up to the precision that always does.
+ * Returns the number of digits, and sets k to their decimal exponent.
+ */
+static int exact_digits(double number, int single, char *digits, int *k) {
+	int low = 1;
+	int high = single ? 9 : 17;
+	int len;
+	while (low < high) {
+		const int mid = low + (high - low) / 2;
+		if (precise_digits(number, single, mid, digits, &len, k)) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	precise_digits(number, single, high, digits, &len, k);
+	return len;
+}
+
+/*
+ * Write a decimal exponent from -999 to 999 into the buffer.
+ * Returns the number of characters written.
+ */
+static int format_exponent(char *buf, int exponent) {
+	int len = 0;
+	if (exponent < 0) {
+		buf[len++] = '-';
+		exponent = -exponent;
+	}
+	if (exponent >= 100) {
+		buf[len++] = (char) ('0' + exponent / 100);
+		exponent %= 100;
+		memcpy(buf + len, digit_pairs + exponent * 2, 2);
+		return len + 2;
+	}
+	if (exponent >= 10) {
+		memcpy(buf + len, digit_pairs + exponent * 2, 2);
+		return len + 2;
+	}
+	buf[len++] = (char) ('0' + exponent);
+	return len;
+}
+
+/*
+ * Lay out the given digits with the decimal exponent k as a number,
+ * like 12.34, 0.001234, 1e30 or 1.234e33. Numbers without an exponent
+ * always have a '.', so they are not mistaken for integers.
+ * Returns the number of characters.
+ */
+static int prettify(char *buf, int len, int k) {
+	const int point = len + k; /* Position of the decimal point */
+	int i;
+	if (k >= 0 && point <= 21) {
+		/* 1234e7 -> 12340000000.0 */
+		for (i = len; i < point; ++i) {
+			buf[i] = '0';
+		}
+		buf[point] = '.';
+		buf[point + 1] = '0';
+		return point + 2;
+	} else if (point > 0 && point <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memmove(buf + point + 1, buf + point, len - point);
+		buf[point] = '.';
+		return len + 1;
+	} else if (point > -6 && point <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		const int offset = 2 - point;
+		memmove(buf + offset, buf, len);
+		buf[0] = '0';
+		buf[1] = '.';
+		for (i = 2; i < offset; ++i) {
+			buf[i] = '0';
+		}
+		return len + offset;
+	} else if (len == 1) {
+		/* 1e30 */
+		buf[1] = 'e';
+		return 2 + format_exponent(buf + 2, point - 1);
+	}
+	/* 1234e30 -> 1.234e33 */
+	memmove(buf + 2, buf + 1, len - 1);
+	buf[1] = '.';
+	buf[len + 1] = 'e';
+	return len + 2 + format_exponent(buf + len + 2, point - 1);
+}
+
+/*
+ * Write an IEEE 754 number, given as its fields, into the buffer.
+ * Returns the number of characters written.
+ */
+static size_t format_ieee(char *buf, double number, int negative, int exponent, uint64_t significand,
+		int mantissa_bits, int max_exponent, int bias) {
+	char *p = buf;
+	int len;
+	int k;
+	if (exponent == max_exponent && significand != 0) {
+		memcpy(buf, "nan", 4);
+		return 3;
+	}
+	if (negative) {
+		*p++ = '-';
+	}
+	if (exponent == max_exponent) {
+		memcpy(p, "inf", 4);
+	} else if (exponent == 0 && significand == 0) {
+		memcpy(p, "0.0", 4);
+	} else {
+		int shortest;
+		if (exponent == 0) {
+			/* Subnormal */
+			shortest = grisu3(significand, 1 - bias - mantissa_bits, 0, p, &len, &k);
+		} else {
+			shortest = grisu3(significand | (uint64_t) 1 << mantissa_bits, exponent - bias - mantissa_bits,
+					significand == 0 && exponent > 1, p, &len, &k);
+		}
+		if (!shortest) {
+			len = exact_digits(negative ? -number : number, mantissa_bits < 52, p, &k);
+		}
+		len = prettify(p, len, k);
+		p[len] = '\0';
+		return (size_t) (p + len - buf);
+	}
+	return (size_t) (p + 3 - buf);
+}
+
+/*
+ * Write a double into the buffer, which needs room for NUMBER_CHARS.
+ * Returns the number of characters written.
+ */
+static size_t format_double(char *buf, double number) {
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return format_ieee(buf, number, (int) (bits >> 63), (int) (bits >> 52) & 0x7ff,
+			bits & (((uint64_t) 1 << 52) - 1), 52, 0x7ff, 1023);
+}
+
+/*
+ * Write a float into the buffer, with the shortest digits that read
+ * back as the same float. The buffer needs room for NUMBER_CHARS.
+ * Returns the number of characters written.
+ */
+static size_t format_float(char *buf, float number) {
+	uint32_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return format_ieee(buf, number, (int) (bits >> 31), (int) (bits >> 23) & 0xff,
+			bits & ((1u << 23) - 1), 23, 0xff, 127);
+}
+
+/*
+ * Check whether the given character is white space in the C locale.
+ */
+static int is_number_space(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Parse an integer from the start of the string, like strtoll in the
+ * C locale: leading white space and a sign are allowed, and parsing
+ * stops at the first character that is not a digit. Values out of
+ * range are clamped to it.
+ */
+static int64_t parse_int64(const char *str) {
+	uint64_t number = 0;
+	uint64_t limit = INT64_MAX;
+	int negative = 0;
+	while (is_number_space(*str)) {
+		++str;
+	}
+	if (*str == '-' || *str == '+') {
+		negative = *str++ == '-';
+		limit += negative;
+	}
+	for (; is_digit(*str); ++str) {
+		const unsigned digit = (unsigned) (*str - '0');
+		if (number > (limit - digit) / 10) {
+			number = limit;
+			break;
+		}
+		number = number * 10 + digit;
+	}
+	if (negative) {
+		return number == 0 ? 0 : -(int64_t) (number - 1) - 1;
+	}
+	return (int64_t) number;
+}
+
+/*
+ * A number in decimal notation, mantissa * 10^exponent.
+ */
+struct Decimal {
+	uint64_t mantissa;
+	int exponent;
+	int negative;
+};
+
+/*
+ * Scan a plain decimal number from the start of the string.
+ * Returns 1 if it was scanned exactly, or 0 if it has more than
+ * 19 significant digits or is not a plain decimal number (like hex,
+ * inf or nan), and needs to be parsed with strtod.
+ */
+static int scan_decimal(const char *str, struct Decimal *decimal) {
+	int digits = 0;
+	int any = 0;
+	decimal->mantissa = 0;
+	decimal->exponent = 0;
+	decimal->negative = 0;
+	while (is_number_space(*str)) {
+		++str;
+	}
+	if (*str == '-' || *str == '+') {
+		decimal->negative = *str++ == '-';
+	}
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+		return 0;
+	}
+	for (; is_digit(*str); ++str, any = 1) {
+		if (digits == 19) {
+			return 0;
+		}
+		decimal->mantissa = decimal->mantissa * 10 + (unsigned) (*str - '0');
+		digits += decimal->mantissa != 0;
+	}
+	if (*str == '.') {
+		for (++str; is_digit(*str); ++str, any = 1) {
+			if (digits == 19) {
+				return 0;
+			}
+			decimal->mantissa = decimal->mantissa * 10 + (unsigned) (*str - '0');
+			digits += decimal->mantissa != 0;
+			--decimal->exponent;
+		}
+	}
+	if (!any) {
+		/* Not a number, or inf or nan */
+		return 0;
+	}
+	if ((*str == 'e' || *str == 'E')
+			&& (is_digit(str[1]) || ((str[1] == '-' || str[1] == '+') && is_digit(str[2])))) {
+		int exponent = 0;
+		int negative = 0;
+		++str;
+		if (*str == '-' || *str == '+') {
+			negative = *str++ == '-';
+		}
+		for (; is_digit(*str); ++str) {
+			if (exponent < 100000) {
+				exponent = exponent * 10 + (*str - '0');
+			}
+		}
+		decimal->exponent += negative ? -exponent : exponent;
+	}
+	return 1;
+}
+
+/*
+ * Parse a number with strtod or strtof, replacing the '.' with the
+ * decimal point of the current locale first if needed.
+ */
+static double parse_number_slow(const char *str, int single) {
+	const char *point = localeconv()->decimal_point;
+	char buf[128];
+	char *copy = buf;
+	double result;
+	size_t len;
+	size_t i;
+	if ((point[0] == '.' && point[1] == '\0') || point[0] == '\0' || point[1] != '\0') {
+		return single ? strtof(str, NULL) : strtod(str, NULL);
+	}
+	/* Copy as much as strtod could take as a number */
+	len = strspn(str, " \t\n\v\f\r+-.0123456789abcdefABCDEFinftyINFTYxXpP");
+	if (len >= sizeof(buf) && !(copy = memory_malloc(len + 1))) {
+		return single ? strtof(str, NULL) : strtod(str, NULL);
+	}
+	for (i = 0; i < len; ++i) {
+		copy[i] = str[i] == '.' ? point[0] : str[i];
+	}
+	copy[len] = '\0';
+	result = single ? strtof(copy, NULL) : strtod(copy, NULL);
+	if (copy != buf) {
+		memory_free(copy);
+	}
+	return result;
+}
+
+/*
+ * Parse a double from the start of the string, like strtod in the C locale.
+ */
+static double parse_double(const char *str) {
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	struct Decimal decimal;
+	/* Both the mantissa and the power of ten are exact, so is the result */
+	if (FLT_EVAL_METHOD == 0 && scan_decimal(str, &decimal)
+			&& decimal.mantissa <= (uint64_t) 1 << 53
+			&& decimal.exponent >= -22 && decimal.exponent <= 22) {
+		double result = (double) decimal.mantissa;
+		if (decimal.exponent < 0) {
+			result /= powers[-decimal.exponent];
+		} else {
+			result *= powers[decimal.exponent];
+		}
+		return decimal.negative ? -result : result;
+	}
+	return parse_number_slow(str, 0);
+}
+
+/*
+ * Parse a float from the start of the string, like strtof in the C locale.
+ * Going through a double would round twice, so this has its own fast path.
+ */
+static float parse_float(const char *str) {
+	static const float powers[] = {
+		1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+	};
+	struct Decimal decimal;
+	if (FLT_EVAL_METHOD == 0 && scan_decimal(str, &decimal)
+			&& decimal.mantissa <= (uint64_t) 1 << 24
+			&& decimal.exponent >= -10 && decimal.exponent <= 10) {
+		float result = (float) decimal.mantissa;
+		if (decimal.exponent < 0) {
+			result /= powers[-decimal.exponent];
+		} else {
+			result *= powers[decimal.exponent];
+		}
+		return decimal.negative ? -result : result;
+	}
+	return (float) parse_number_slow(str, 1);
+}
+
+/*
+ * Get the given value as a 64-bit integer.
+ * The value is parsed on first use and cached. Concurrent readers
+ * may both parse it, but they always store the same result.
+ */
+static int64_t value_int64(struct Value *value) {
+	int64_t result;
+	if (load_acquire(&value->cached) & CACHED_INT) {
+		return load_relaxed(&value->int_value);
+	}
+	result = parse_int64(value->str);
+	store_relaxed(&value->int_value, result);
+	fetch_or_release(&value->cached, CACHED_INT);
+	return result;
+}
+
+/*
+ * Get the given value as an integer, clamped to the range of an int.
+ */
+static int value_int(struct Value *value) {
+	const int64_t result = value_int64(value);
+	return result < INT_MIN ? INT_MIN : result > INT_MAX ? INT_MAX : (int) result;
+}
+
+/*
+ * Get the given value as a float.
+ * The value is parsed on first use and cached, like value_int64.
+ */
+static float value_float(struct Value *value) {
+	float result;
+	if (load_acquire(&value->cached) & CACHED_FLOAT) {
+		copy_relaxed(&result, &value->float_value);
+		return result;
+	}
+	result = parse_float(value->str);
+	copy_relaxed(&value->float_value, &result);
+	fetch_or_release(&value->cached, CACHED_FLOAT);
+	return result;
+}
+
+/*
+ * Get the given value as a double.
+ * The value is parsed on first use and cached, like value_int64.
+ */
+static double value_double(struct Value *value) {
+	double result;
+	if (load_acquire(&value->cached) & CACHED_DOUBLE) {
+		copy_relaxed(&result, &value->double_value);
+		return result;
+	}
+	result = parse_double(value->str);
+	copy_relaxed(&value->double_value, &result);
+	fetch_or_release(&value->cached, CACHED_DOUBLE);
+	return result;
+}
+
+/*
+ * Cache the given integer as the typed values of an unpublished value.
+ * Converting it rounds the same way as parsing its text, so cache
+ * the float and the double too.
+ */
+static void cache_int(struct Value *value, int64_t number) {
+	value->int_value = number;
+	value->float_value = (float) number;
+	value->double_value = (double) number;
+	value->cached = CACHED_INT | CACHED_FLOAT | CACHED_DOUBLE;
+}
+
+/*
+ * Cache the given float as the typed values of an unpublished value.
+ * Its text is the shortest that reads back as the float, which does not
+ * read back as the float converted to a double, so only the float is cached.
+ */
+static void cache_float(struct Value *value, float number) {
+	value->float_value = number;
+	value->cached = CACHED_FLOAT;
+}
+
+/*
+ * Cache the given double as the typed values of an unpublished value.
+ */
+static void cache_double(struct Value *value, double number) {
+	value->double_value = number;
+	value->cached = CACHED_DOUBLE;
+}
+
+/*
+ * Create a new pair for the given key, with room for an embedded value
+ * of the given length after it if value_len is not SIZE_MAX.
+ * The key is copied inline unless it is borrowed. The pair has no value yet.
+ * Returns the pair, or NULL if out of memory.
+ */
+static struct Pair *create_pair(Settings *settings, const char *key, size_t key_len,
+		int borrow_key, size_t value_len, size_t hash) {
+	const size_t key_size = INLINE_KEY_SIZE(key_len, borrow_key);
+	const size_t size = value_len == (size_t) -1
+		? sizeof(struct Pair) + key_size
+		: EMBEDDED_VALUE_OFFSET(key_size) + value_size(value_len);
+	unsigned units;
+	struct Pair *pair = storage_alloc(settings, size, &units);
+
+	if (pair) {
+		pair->units = units;
+		pair->key_len = key_len;
+		pair->hash = hash;
+		pair->value = NULL;
+		pair->flags = 0;
+		pair->position = 0;
+		if (borrow_key) {
+			pair->key = (char *) key;
+		} else {
+			pair->key = (char *) (pair + 1);
+			memcpy(pair->key, key, key_len);
+			pair->key[key_len] = '\0';
+		}
+	}
+
+	return pair;
+}
+
+/*
+ * Get the memory set aside for the embedded value of the given pair,
+ * whose inline key takes up the given number of bytes.
+ */
+static void *embedded_value(struct Pair *pair, size_t key_size) {
+	return (char *) pair + EMBEDDED_VALUE_OFFSET(key_size);
+}
+
+/*
+ * Check if the key of the given pair matches the given key of the given length.
+ * Returns 1 if the keys are the same, 0 otherwise.
+ */
+static int keys_match(const struct Pair *pair, const char *key, size_t len) {
+	return pair->key_len == len && memcmp(pair->key, key, len) == 0;
+}
+
+/* Starting value for hash_bytes */
+#define HASH_SEED 14695981039346656037ULL
+
+/*
+ * Add the given bytes to a hash (64-bit FNV-1a) started with HASH_SEED.
+ * Returns the updated hash.
+ */
+static unsigned long long hash_bytes(unsigned long long hash, const char *data, size_t len) {
+	const char *const end = data + len;
+	while (data < end) {
+		hash ^= (unsigned char) *data++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Calculate the hash of the given key (truncated to size_t).
+ */
+static size_t hash_key(const char *key, size_t len) {
+	return (size_t) hash_bytes(HASH_SEED, key, len);
+}
+
+/*
+ * Get the shard of sharded settings that keys with the given hash go to.
+ * The index of a shard uses the low bits of the hash, so this uses the high ones.
+ */
+static struct Shard *shard_for_hash(Settings *settings, size_t hash) {
+	return &settings->shards[(hash >> (sizeof(size_t) * CHAR_BIT / 2)) % settings->shard_count];
+}
+
+/*
+ * Get the shard of sharded settings that the given key of the given length goes to.
+ */
+static struct Shard *shard_for_key(Settings *settings, const char *key, size_t len) {
+	return shard_for_hash(settings, hash_key(key, len));
+}
+
+/*
+ * Take the lock of the given shard.
+ * Returns the settings of the shard.
+ */
+static Settings *lock_shard(struct Shard *shard) {
+#ifdef HAVE_SHARD_LOCKS
+	pthread_mutex_lock(&shard->lock);
+#endif
+	return shard->settings;
+}
+
+/*
+ * Release the lock of the given shard.
+ */
+static void unlock_shard(struct Shard *shard) {
+#ifdef HAVE_SHARD_LOCKS
+	pthread_mutex_unlock(&shard->lock);
+#else
+	(void) shard;
+#endif
+}
+
+/*
+ * Count the given number of operations of the given kind.
+ * This may be called from any thread, without a lock.
+ */
+static void count_op(Settings *settings, enum Stat stat, unsigned long long n) {
+	char here;
+	/* Thread stacks are far apart, so mix the high bits of the address in too */
+	const uint64_t mixed = (uint64_t) (uintptr_t) &here * 11400714819323198485ULL;
+	add_relaxed(&settings->stats[(mixed >> 32) % STAT_STRIPES].counts[stat], n);
+}
+
+#ifdef SETTINGS_TRACE
+/*
+ * Get the current time in nanoseconds, from an arbitrary starting point.
+ */
+static unsigned long long trace_now(void) {
+#ifdef HAVE_POSIX
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+	return (unsigned long long) ((double) clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * Record a call that took the given number of nanoseconds at the given point.
+ * This may be called from any thread, without a lock.
+ */
+static void trace_record(Settings *settings, SettingsTracePoint point, unsigned long long ns) {
+	SettingsTrace *trace = &settings->traces[point];
+	unsigned bucket = 0;
+	while (bucket + 1 < SETTINGS_TRACE_BUCKETS && ns >> (bucket + 1) != 0) {
+		++bucket;
+	}
+	add_relaxed(&trace->count, 1);
+	add_relaxed(&trace->total_ns, ns);
+	add_relaxed(&trace->buckets[bucket], 1);
+}
+
+/*
+ * Get the nanoseconds recorded so far at the given point, including the shards.
+ */
+static unsigned long long trace_total(Settings *settings, SettingsTracePoint point) {
+	unsigned long long total = load_relaxed(&settings->traces[point].total_ns);
+	size_t i;
+	for (i = 0; i < settings->shard_count; ++i) {
+		total += load_relaxed(&settings->shards[i].settings->traces[point].total_ns);
+	}
+	return total;
+}
+
+/*
+ * Add the latencies recorded at the given point of the given settings to the trace.
+ */
+static void add_trace(SettingsTrace *trace, Settings *settings, SettingsTracePoint point) {
+	SettingsTrace *from = &settings->traces[point];
+	size_t i;
+	trace->count += load_relaxed(&from->count);
+	trace->total_ns += load_relaxed(&from->total_ns);
+	for (i = 0; i < SETTINGS_TRACE_BUCKETS; ++i) {
+		trace->buckets[i] += load_relaxed(&from->buckets[i]);
+	}
+}
+#endif
+
+/*
+ * Mix the bits of a hash (with the finalizer of SplitMix64), so that
+ * every bit of the result depends on every bit of the hash.
+ */
+static uint64_t mix_hash(uint64_t hash) {
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+/*
+ * Map the high 32 bits of the given number onto the range from 0 to n - 1,
+ * with a multiplication rather than a division. n must fit in 32 bits.
+ */
+static size_t reduce_range(uint64_t x, size_t n) {
+	return (size_t) (((x >> 32) * (uint64_t) n) >> 32);
+}
+
+/*
+ * Get the slot of a frozen table for the given mixed hash, in a bucket with
+ * the given displacement.
+ */
+static size_t frozen_slot(uint64_t mixed, uint32_t displacement, size_t count) {
+	return reduce_range(mix_hash(mixed + displacement), count);
+}
+
+/*
+ * Find the pair for the given key and hash in a frozen table, and if slot
+ * is not NULL, the slot holding it. The key can only be in one slot.
+ * Returns the pair if it exists, NULL otherwise.
+ */
+static struct Pair *find_frozen(struct Frozen *frozen, const char *key, size_t len, size_t hash,
+		struct Pair ***slot) {
+	const uint64_t mixed = mix_hash(hash);
+	const uint32_t displacement = frozen->displacements[reduce_range(mixed, frozen->bucket_count)];
+	struct FrozenSlot *found = &frozen->slots[frozen_slot(mixed, displacement, frozen->count)];
+	if (found->hash == hash && found->pair != NULL && keys_match(found->pair, key, len)) {
+		if (slot != NULL) {
+			*slot = &found->pair;
+		}
+		return found->pair;
+	}
+	return NULL;
+}
+
+/*
+ * Find the pair for the given key and hash, and if slot is not NULL,
+ * the index slot holding it. Uses linear probing, skipping over tombstones.
+ * This is safe to call from readers while the writer changes the index,
+ * but the writer may clear or reuse the slot right after, so readers
+ * have to use the returned pair rather than load the slot again.
+ * Frozen settings have no index, and are looked up in their perfect hash.
+ * Returns the pair if it exists, NULL otherwise.
+ */
+static struct Pair *find_pair(Settings *settings, const char *key, size_t len, size_t hash,
+		struct Pair ***slot) {
+	struct Index *index = load_acquire(&settings->index);
+	if (index != NULL) {
+		const size_t mask = index->capacity - 1;
+		size_t i = hash & mask;
+		struct Pair *pair;
+		while ((pair = load_acquire(&index->slots[i])) != NULL) {
+			/* The hash is stored before the slot, so it is at least as new as this pair */
+			if (load_relaxed(&index->hashes[i]) == hash && pair != TOMBSTONE && keys_match(pair, key, len)) {
+				if (slot != NULL) {
+					*slot = &index->slots[i];
+				}
+				return pair;
+			}
+			i = (i + 1) & mask;
+		}
+	} else if (settings->frozen != NULL) {
+		return find_frozen(settings->frozen, key, len, hash, slot);
+	}
+	return NULL;
+}
+
+/*
+ * Find the index slot for the given key and hash, for the writer.
+ * Returns a pointer to the slot holding the pair if it exists, NULL otherwise.
+ */
+static struct Pair **find_slot(Settings *settings, const char *key, size_t len, size_t hash) {
+	struct Pair **slot;
+	return find_pair(settings, key, len, hash, &slot) != NULL ? slot : NULL;
+}
+
+/*
+ * Add up the generations of the layers of an overlay. This changes
+ * whenever a key gains or loses its value in any of them.
+ */
+static unsigned long layers_generation(Settings *settings) {
+	unsigned long generation = 0;
+	size_t i;
+	for (i = 0; i < settings->layer_count; ++i) {
+		generation += load_acquire(&settings->layers[i]->generation);
+	}
+	return generation;
+}
+
+/*
+ * Find the current value for the given key and hash in the layers of an
+ * overlay, topmost first. The pair that the key was found in is kept in
+ * the cache entry for its hash, and used again as long as no layer has
+ * gained or lost a key since. Filling an entry makes its sequence number
+ * odd, and a reader only uses what it loaded under the same even number,
+ * so the pair and its generation always go together. A reader that finds
+ * the entry being filled just skips the cache.
+ * Returns the value if a layer has one, NULL otherwise.
+ */
+static struct Value *find_in_layers(Settings *settings, const char *key, size_t len, size_t hash) {
+	struct OverlayEntry *entry = &settings->cache[hash & (settings->cache_size - 1)];
+	const unsigned long generation = layers_generation(settings);
+	unsigned long seq = load_acquire(&entry->seq);
+	struct Value *value;
+	struct Pair *pair;
+	size_t i;
+
+	if (!(seq & 1)) {
+		unsigned long entry_generation;
+		pair = load_relaxed(&entry->pair);
+		entry_generation = load_relaxed(&entry->generation);
+		/* Check the number again only after loading the entry */
+		acquire_fence();
+		/* A pair of the same generation has not been removed, so it is safe to look at */
+		if (entry_generation == generation && load_relaxed(&entry->seq) == seq
+				&& pair != NULL && pair->hash == hash && keys_match(pair, key, len)) {
+			return load_acquire(&pair->value);
+		}
+	}
+	for (i = 0; i < settings->layer_count; ++i) {
+		pair = find_pair(settings->layers[i], key, len, hash, NULL);
+		if (pair != NULL && (value = load_acquire(&pair->value)) != NULL) {
+			if (!(seq & 1) && compare_exchange(&entry->seq, &seq, seq + 1)) {
+				/* Readers that see the new pair or generation also see the odd number */
+				release_fence();
+				store_relaxed(&entry->pair, pair);
+				store_relaxed(&entry->generation, generation);
+				store_release(&entry->seq, seq + 2);
+			}
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the current value for the given key of the given length,
+ * falling back to the layers if the settings are an overlay.
+ * Returns the value if the key exists and has one, NULL otherwise.
+ */
+static struct Value *find_value_n(Settings *settings, const char *key, size_t len) {
+	TRACE_BEGIN(trace_start);
+	const size_t hash = hash_key(key, len);
+	struct Pair *pair = find_pair(settings, key, len, hash, NULL);
+	struct Value *value = pair != NULL ? load_acquire(&pair->value) : NULL;
+	if (value == NULL && settings->layers != NULL) {
+		value = find_in_layers(settings, key, len, hash);
+	}
+	count_op(settings, value != NULL ? STAT_GET_HIT : STAT_GET_MISS, 1);
+	TRACE_END(settings, SETTINGS_TRACE_GET, trace_start);
+	return value;
+}
+
+/*
+ * Find the current value for the given NUL-terminated key.
+ * Works like find_value_n, but also takes NULL settings or keys.
+ */
+static struct Value *find_value(Settings *settings, const char *key) {
+	if (settings != NULL && key != NULL) {
+		return find_value_n(settings, key, strlen(key));
+	}
+	return NULL;
+}
+
+/*
+ * Place the given pair into the first free slot of the given index.
+ * The index must have room for it. This publishes the pair to readers,
+ * so it must be fully set up first.
+ */
+static void index_insert(Settings *settings, struct Index *index, struct Pair *pair) {
+	const size_t mask = index->capacity - 1;
+	size_t i = pair->hash & mask;
+	while (index->slots[i] != NULL && index->slots[i] != TOMBSTONE) {
+		i = (i + 1) & mask;
+	}
+	if (index->slots[i] == NULL) {
+		++settings->used;
+	}
+	store_relaxed(&index->hashes[i], pair->hash);
+	store_release(&index->slots[i], pair);
+	++settings->count;
+}
+
+/*
+ * Allocate an index with the given number of slots, which are all free.
+ * Returns the index, or NULL if out of memory.
+ */
+static struct Index *index_create(size_t capacity) {
+	struct Index *index = memory_malloc(sizeof(struct Index)
+		+ capacity * (sizeof(struct Pair *) + sizeof(size_t)));
+	if (index != NULL) {
+		index->capacity = capacity;
+		index->hashes = (size_t *) (index->slots + capacity);
+		memset(index->slots, 0, capacity * sizeof(struct Pair *));
+	}
+	return index;
+}
+
+/*
+ * Rebuild the index with the given capacity, dropping any tombstones.
+ * The capacity must be a power of two with room for all the pairs.
+ * The new index is built on the side and then published as a whole.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int index_rebuild(Settings *settings, size_t capacity) {
+	struct Index *old_index = settings->index;
+	const size_t old_capacity = old_index != NULL ? old_index->capacity : 0;
+	struct Index *index;
+	size_t i;
+
+	if (settings->spare_index != NULL && settings->spare_index->capacity == capacity) {
+		/* Reuse the index that the last rebuild at this size replaced */
+		index = settings->spare_index;
+		settings->spare_index = NULL;
+		memset(index->slots, 0, capacity * sizeof(struct Pair *));
+	} else if (!(index = index_create(capacity))) {
+		return 0;
+	}
+
+	settings->count = 0;
+	settings->used = 0;
+	for (i = 0; i < old_capacity; ++i) {
+		if (old_index->slots[i] != NULL && old_index->slots[i] != TOMBSTONE) {
+			index_insert(settings, index, old_index->slots[i]);
+		}
+	}
+	store_release(&settings->index, index);
+	retire(settings, old_index, RETIRED_INDEX);
+
+	return 1;
+}
+
+/*
+ * Get the smallest index capacity that keeps the given number of pairs
+ * at most half full.
+ */
+static size_t index_capacity_for(size_t n) {
+	size_t capacity = INDEX_MIN_CAPACITY;
+	while (n * 2 > capacity) {
+		capacity *= 2;
+	}
+	return capacity;
+}
+
+/*
+ * Make sure the index has room for the given number of new pairs.
+ * The index is kept at most 3/4 full (counting tombstones), and
+ * is rebuilt when it would exceed that. If most of the used
+ * slots are tombstones, it is rebuilt at the same size.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int index_reserve(Settings *settings, size_t n) {
+	const struct Index *index = settings->index;
+	size_t capacity;
+
+	if (index != NULL && (settings->used + n) * 4 <= index->capacity * 3) {
+		return 1;
+	}
+
+	capacity = index_capacity_for(settings->count + n);
+	if (index != NULL && capacity < index->capacity) {
+		capacity = index->capacity;
+	}
+	return index_rebuild(settings, capacity);
+}
+
+/*
+ * Get the next pair in the list, starting from the given position,
+ * and move the position past it.
+ * Returns the pair, or NULL at the end of the list.
+ */
+static struct Pair *next_listed(Settings *settings, size_t *position) {
+	while (*position < settings->list_len) {
+		struct Pair *pair = settings->list[(*position)++].pair;
+		if (pair != NULL) {
+			return pair;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Move the pairs in the list over the holes left by removed ones.
+ */
+static void compact_list(Settings *settings) {
+	size_t i;
+	size_t len = 0;
+	for (i = 0; i < settings->list_len; ++i) {
+		struct Pair *pair = settings->list[i].pair;
+		if (pair != NULL) {
+			pair->position = len;
+			settings->list[len++] = settings->list[i];
+		}
+	}
+	settings->list_len = len;
+	++settings->compactions;
+}
+
+/*
+ * Give back the memory of the unused part of the list.
+ */
+static void list_shrink(Settings *settings) {
+	compact_list(settings);
+	if (settings->list_len == 0) {
+		memory_free(settings->list);
+		settings->list = NULL;
+		settings->list_capacity = 0;
+	} else if (settings->list_len < settings->list_capacity) {
+		struct ListEntry *list = memory_realloc(settings->list, settings->list_len * sizeof(struct ListEntry));
+		if (list != NULL) {
+			settings->list = list;
+			settings->list_capacity = settings->list_len;
+		}
+	}
+}
+
+/*
+ * Make sure the list has room for the given number of new pairs.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int list_reserve(Settings *settings, size_t n) {
+	struct ListEntry *list;
+	size_t capacity = settings->list_capacity;
+
+	if (settings->list_capacity - settings->list_len >= n) {
+		return 1;
+	}
+	if (settings->list_len - settings->listed >= n && settings->list_len - settings->listed >= settings->listed) {
+		/* At least half of the list is holes, so reuse them */
+		compact_list(settings);
+		return 1;
+	}
+
+	if (capacity == 0) {
+		capacity = INDEX_MIN_CAPACITY;
+	}
+	while (capacity - settings->list_len < n) {
+		capacity *= 2;
+	}
+	list = memory_realloc(settings->list, capacity * sizeof(struct ListEntry));
+	if (list == NULL) {
+		return 0;
+	}
+	settings->list = list;
+	settings->list_capacity = capacity;
+	return 1;
+}
+
+/*
+ * Find the first entry of the sorted array whose key is not less than the given one.
+ * Returns its position, or the number of entries if there is none.
+ */
+static size_t sorted_position(const Settings *settings, const char *key) {
+	size_t low = 0;
+	size_t high = settings->sorted_count;
+	while (low < high) {
+		const size_t mid = low + (high - low) / 2;
+		if (strcmp(settings->sorted[mid]->key, key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * Check if the sorted array should follow a pair that is being listed or
+ * unlinked. Each change moves part of the array, so after more than
+ * SORTED_MAX_CHANGES since it was last used (like when loading a file),
+ * it is left stale instead, and rebuilt in one go when it is used again.
+ * Returns 1 if it should be updated, or 0 if it is stale.
+ */
+static int keep_sorted(Settings *settings) {
+	if (!settings->sorted_stale && ++settings->sorted_changes > SORTED_MAX_CHANGES) {
+		settings->sorted_stale = 1;
+	}
+	return !settings->sorted_stale;
+}
+
+/*
+ * Insert a pair that has just been listed into the sorted array.
+ */
+static void sorted_insert(Settings *settings, struct Pair *pair) {
+	size_t i;
+
+	if (!keep_sorted(settings)) {
+		return;
+	}
+	if (settings->sorted_count == settings->sorted_capacity) {
+		const size_t capacity = settings->sorted_capacity * 2;
+		struct Pair **sorted = memory_realloc(settings->sorted, capacity * sizeof(struct Pair *));
+		if (sorted == NULL) {
+			/* Rebuild it when it is used instead */
+			settings->sorted_stale = 1;
+			return;
+		}
+		settings->sorted = sorted;
+		settings->sorted_capacity = capacity;
+	}
+
+	i = sorted_position(settings, pair->key);
+	memmove(&settings->sorted[i + 1], &settings->sorted[i], (settings->sorted_count - i) * sizeof(struct Pair *));
+	settings->sorted[i] = pair;
+	++settings->sorted_count;
+}
+
+/*
+ * Remove a pair that is being unlinked from the sorted array.
+ */
+static void sorted_remove(Settings *settings, const struct Pair *pair) {
+	size_t i;
+
+	if (!keep_sorted(settings)) {
+		return;
+	}
+	/* Keys with a NUL in them compare the same as their start, so look for the pair itself */
+	for (i = sorted_position(settings, pair->key); settings->sorted[i] != pair; ++i) {
+		/* It follows the keys that compare the same */
+	}
+	memmove(&settings->sorted[i], &settings->sorted[i + 1], (settings->sorted_count - i - 1) * sizeof(struct Pair *));
+	--settings->sorted_count;
+}
+
+/*
+ * Append the given pair to the end of the list.
+ * The list must have room for it (see list_reserve).
+ */
+static void append_pair(Settings *settings, struct Pair *pair) {
+	struct ListEntry *entry = &settings->list[settings->list_len];
+	sorted_insert(settings, pair);
+	entry->pair = pair;
+	entry->seq = ++settings->list_seq;
+	pair->position = settings->list_len++;
+	++settings->listed;
+}
+
+/*
+ * Remove the given pair from the list, leaving a hole.
+ */
+static void unlink_pair(Settings *settings, struct Pair *pair) {
+	sorted_remove(settings, pair);
+	settings->list[pair->position].pair = NULL;
+	--settings->listed;
+	if (settings->listed == 0) {
+		/* Nothing left to keep the place of */
+		settings->list_len = 0;
+		++settings->compactions;
+	}
+}
+
+/*
+ * Count a key gaining or losing its value, so that overlays stop using
+ * the pairs they cached. Readers must already see the change.
+ */
+static void next_generation(Settings *settings) {
+	store_release(&settings->generation, settings->generation + 1);
+}
+
+/*
+ * Check if the given watch covers the given key of the given length.
+ * Returns 1 if it does, 0 otherwise.
+ */
+static int watch_matches(const struct SettingsWatch *watch, const char *key, size_t len) {
+	return (watch->prefix ? len >= watch->len : len == watch->len)
+		&& memcmp(watch->pattern, key, watch->len) == 0;
+}
+
+/*
+ * Count a change to the given pair, and mark the watches that cover it.
+ * The callbacks are called later on by notify.
+ */
+static void note_change(Settings *settings, const struct Pair *pair) {
+	struct SettingsWatch *watch;
+	++settings->writes;
+	for (watch = settings->watches; watch != NULL; watch = watch->next) {
+		if (!watch->pending && watch_matches(watch, pair->key, pair->key_len)) {
+			watch->pending = 1;
+			settings->watch_pending = 1;
+		}
+	}
+}
+
+/*
+ * Call the callbacks of the watches marked since the last time, once each.
+ * This is done at the end of every public call that changes values, with
+ * the key it changed, or NULL if it may have changed several.
+ */
+static void notify(Settings *settings, const char *key) {
+	struct SettingsWatch *watch;
+	if (!settings->watch_pending) {
+		return;
+	}
+	settings->watch_pending = 0;
+	for (watch = settings->watches; watch != NULL; watch = watch->next) {
+		if (watch->pending) {
+			watch->pending = 0;
+			watch->callback(settings, key, watch->ctx);
+		}
+	}
+}
+
+/*
+ * Publish a new value for a pair that is already in the index,
+ * and retire the old one.
+ * A pair without a value (an interned key that is not set)
+ * is appended to the list, as if it had just been added.
+ */
+static void publish_value(Settings *settings, struct Pair *pair, struct Value *value) {
+	struct Value *old_value = pair->value;
+	store_release(&pair->value, value);
+	note_change(settings, pair);
+	if (old_value == NULL) {
+		append_pair(settings, pair);
+		next_generation(settings);
+	} else if (!(old_value->flags & VALUE_EMBEDDED)) {
+		/* An embedded value goes away along with its pair instead */
+		retire(settings, old_value, RETIRED_VALUE);
+	}
+}
+
+/*
+ * Remove the value of the pair in the given index slot, which must have one.
+ * An interned pair stays in the index without a value, and any other pair
+ * is replaced with a tombstone and retired.
+ */
+static void remove_pair(Settings *settings, struct Pair **slot) {
+	struct Pair *pair = *slot;
+	unlink_pair(settings, pair);
+	note_change(settings, pair);
+	if (pair->flags & PAIR_INTERNED) {
+		/* Keep the pair around for its handles, just without a value */
+		struct Value *value = pair->value;
+		store_release(&pair->value, NULL);
+		if (!(value->flags & VALUE_EMBEDDED)) {
+			retire(settings, value, RETIRED_VALUE);
+		}
+	} else {
+		struct Index *index = settings->index;
+		const size_t mask = index->capacity - 1;
+		size_t i = (size_t) (slot - index->slots);
+		if (index->slots[(i + 1) & mask] == NULL) {
+			/*
+			 * Probing stops at the next slot anyway, so this one can be
+			 * freed, along with the tombstones right before it. That keeps
+			 * churn on new keys from filling the index with tombstones.
+			 */
+			do {
+				store_release(&index->slots[i], NULL);
+				--settings->used;
+				i = (i - 1) & mask;
+			} while (index->slots[i] == TOMBSTONE);
+		} else {
+			/* Leave a tombstone so that probing continues past this slot */
+			store_release(slot, TOMBSTONE);
+		}
+		--settings->count;
+		retire(settings, pair, RETIRED_PAIR);
+	}
+	next_generation(settings);
+}
+
+/*
+ * Find the pair for the given key, or add a new one without a value.
+ * Returns the pair, or NULL if out of memory.
+ */
+static struct Pair *find_or_add_pair(Settings *settings, const char *key, size_t len, size_t hash) {
+	struct Pair **slot = find_slot(settings, key, len, hash);
+	struct Pair *pair;
+
+	if (slot != NULL) {
+		return *slot;
+	}
+	/* Make room in the index first */
+	if (!index_reserve(settings, 1)) {
+		return NULL;
+	}
+	pair = create_pair(settings, key, len, 0, (size_t) -1, hash);
+	if (pair != NULL) {
+		index_insert(settings, settings->index, pair);
+	}
+	return pair;
+}
+
+/*
+ * Cached typed values to store along with a new value.
+ */
+struct Typed {
+	enum { TYPED_NONE, TYPED_INT, TYPED_FLOAT, TYPED_DOUBLE } type;
+	int64_t int_value;
+	float float_value;
+	double double_value;
+};
+
+/*
+ * Set the value of the given key, adding the key if necessary.
+ *
+ * The value is borrowed if borrow is set, and copied otherwise; the
+ * key is borrowed along with it if a new pair is needed. If typed is
+ * not NULL, its number is cached in the value before it is published.
+ * The hash of the key must already be calculated.
+ * Returns the pair holding the value, or NULL on failure.
+ */
+static struct Pair *set_hashed_value(Settings *settings, const char *key, size_t key_len, size_t hash,
+		const char *str, size_t len, int borrow, const struct Typed *typed) {
+	TRACE_BEGIN(trace_start);
+	struct Pair **slot;
+	const size_t stored_len = borrow ? 0 : len;
+	struct Pair *pair = NULL;
+	struct Value *value;
+
+	if (settings->shards != NULL) {
+		/* Loaders add their keys through here, so pass them on to their shards */
+		struct Shard *shard = shard_for_hash(settings, hash);
+		pair = set_hashed_value(lock_shard(shard), key, key_len, hash, str, len, borrow, typed);
+		unlock_shard(shard);
+		return pair;
+	}
+
+	slot = find_slot(settings, key, key_len, hash);
+	if (!list_reserve(settings, 1)) {
+		return NULL;
+	}
+	if (slot == NULL) {
+		/* We have to create a new pair, so make room for it first */
+		if (!index_reserve(settings, 1)) {
+			return NULL;
+		}
+		pair = create_pair(settings, key, key_len, borrow, stored_len, hash);
+		if (pair == NULL) {
+			return NULL;
+		}
+		value = new_value(settings, embedded_value(pair, INLINE_KEY_SIZE(key_len, borrow)), str, stored_len);
+	} else {
+		value = new_value(settings, NULL, str, stored_len);
+		if (value == NULL) {
+			return NULL;
+		}
+	}
+
+	if (borrow) {
+		value->str = str;
+		value->len = len;
+	}
+	if (typed != NULL && typed->type == TYPED_INT) {
+		cache_int(value, typed->int_value);
+	} else if (typed != NULL && typed->type == TYPED_FLOAT) {
+		cache_float(value, typed->float_value);
+	} else if (typed != NULL && typed->type == TYPED_DOUBLE) {
+		cache_double(value, typed->double_value);
+	}
+
+	if (pair != NULL) {
+		pair->value = value;
+		index_insert(settings, settings->index, pair);
+		append_pair(settings, pair);
+		next_generation(settings);
+		note_change(settings, pair);
+		TRACE_END(settings, SETTINGS_TRACE_INSERT, trace_start);
+		return pair;
+	}
+	publish_value(settings, *slot, value);
+	TRACE_END(settings, SETTINGS_TRACE_INSERT, trace_start);
+	return *slot;
+}
+
+/*
+ * Set the value of the given key, adding the key if necessary.
+ * Works like set_hashed_value, but calculates the hash.
+ */
+static struct Pair *set_value(Settings *settings, const char *key, size_t key_len,
+		const char *str, size_t len, int borrow, const struct Typed *typed) {
+	return set_hashed_value(settings, key, key_len, hash_key(key, key_len), str, len, borrow, typed);
+}
+
+/*
+ * Set the value of the given key on its own, copying the value, and call
+ * the watches of the key. Neither needs to be NUL-terminated.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int set_key(Settings *settings, const char *key, size_t key_len, const char *str, size_t len,
+		const struct Typed *typed) {
+	TRACE_BEGIN(trace_start);
+	struct Pair *pair;
+	if (settings->shards != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, key_len);
+		const int result = set_key(lock_shard(shard), key, key_len, str, len, typed);
+		unlock_shard(shard);
+		return result;
+	}
+	if (settings->frozen != NULL) {
+		return 0;
+	}
+	pair = set_value(settings, key, key_len, str, len, 0, typed);
+	count_op(settings, STAT_SET, 1);
+	/* The stored key is NUL-terminated, even if the given one is not */
+	notify(settings, pair != NULL ? pair->key : NULL);
+	TRACE_END(settings, SETTINGS_TRACE_SET, trace_start);
+	return pair != NULL;
+}
+
+/*
+ * Set the value of a pair from a key handle. Works like set_key.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int set_pair_value(Settings *settings, struct Pair *pair, const char *str, size_t len,
+		const struct Typed *typed) {
+	TRACE_BEGIN(trace_start);
+	struct Value *value;
+	if (settings->shards != NULL) {
+		struct Shard *shard = shard_for_hash(settings, pair->hash);
+		const int result = set_pair_value(lock_shard(shard), pair, str, len, typed);
+		unlock_shard(shard);
+		return result;
+	}
+	if (settings->frozen != NULL) {
+		return 0;
+	}
+	if (!list_reserve(settings, 1) || !(value = new_value(settings, NULL, str, len))) {
+		return 0;
+	}
+	if (typed != NULL && typed->type == TYPED_INT) {
+		cache_int(value, typed->int_value);
+	} else if (typed != NULL && typed->type == TYPED_FLOAT) {
+		cache_float(value, typed->float_value);
+	} else if (typed != NULL && typed->type == TYPED_DOUBLE) {
+		cache_double(value, typed->double_value);
+	}
+	publish_value(settings, pair, value);
+	count_op(settings, STAT_SET, 1);
+	notify(settings, pair->key);
+	TRACE_END(settings, SETTINGS_TRACE_SET, trace_start);
+	return 1;
+}
+
+/*
+ * Parser core shared by all the text loaders.
+ *
+ * A handler is called with a context pointer (usually the settings) and
+ * the trimmed key and value of each line that has an equals sign. The
+ * spans are not NUL-terminated. It returns 1 to continue, or 0 to stop
+ * parsing (e.g. if out of memory).
+ */
+typedef int (*PairHandler)(void *ctx, const char *key, size_t key_len,
+		const char *value, size_t value_len);
+
+/*
+ * Parse the lines in the given buffer, passing each pair to the handler.
+ *
+ * If final is zero, the buffer is part of a stream, and parsing stops
+ * at the start of the last line if it does not end in a newline, since
+ * the rest of it may still be coming. Otherwise, the whole buffer is parsed.
+ * Sets consumed to the number of bytes parsed.
+ * Returns 1 on success, or 0 if the handler failed.
+ */
+static int parse_lines(void *ctx, const char *data, size_t size, int final,
+		PairHandler handler, size_t *consumed) {
+	const char *const end = data + size;
+	const char *line = data;
+	int result = 1;
+
+	while (line < end) {
+		const char *eq;
+		const char *eol = scan_line(line, end, &eq);
+		if (eol == end && !final) {
+			break; /* Incomplete line */
+		}
+		if (eq != NULL) {
+			const char *key = line;
+			const char *key_end = eq;
+			const char *value = eq + 1;
+			const char *value_end = eol;
+			/* Remove extraneous spaces */
+			trim_span(&key, &key_end);
+			trim_span(&value, &value_end);
+			if (!handler(ctx, key, key_end - key, value, value_end - value)) {
+				result = 0;
+				break;
+			}
+		}
+		line = eol < end ? eol + 1 : end;
+	}
+
+	*consumed = line - data;
+	return result;
+}
+
+/*
+ * A pair handler that copies the key and value into the settings.
+ */
+static int load_pair(void *ctx, const char *key, size_t key_len,
+		const char *value, size_t value_len) {
+	return set_value(ctx, key, key_len, value, value_len, 0, NULL) != NULL;
+}
+
+/* Initial size of the buffer for reading streams */
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+/* Largest stream buffer that is kept around for the next load */
+#define STREAM_BUFFER_KEEP (1024 * 1024)
+
+/* Reads up to size bytes from a stream, returning 0 at the end or on error */
+typedef size_t (*StreamReader)(void *stream, char *buf, size_t size);
+
+/*
+ * Parse the lines in the given buffer, passing each pair to the handler
+ * along with the given context. Works like parse_lines, but traces the
+ * parsing into the settings apart from the inserting.
+ */
+static int load_lines(Settings *settings, void *ctx, const char *data, size_t size, int final,
+		PairHandler handler, size_t *consumed) {
+	TRACE_PARSE_BEGIN(settings, trace_start);
+	const int result = parse_lines(ctx, data, size, final, handler, consumed);
+	TRACE_PARSE_END(settings, trace_start);
+	return result;
+}
+
+/*
+ * Read up to the given number of bytes from the stream, tracing the reading.
+ * Returns the number of bytes read, which is zero at the end of the stream.
+ */
+static size_t read_stream(Settings *settings, void *stream, StreamReader reader, char *buf, size_t size) {
+	TRACE_BEGIN(trace_start);
+	const size_t n = reader(stream, buf, size);
+	TRACE_END(settings, SETTINGS_TRACE_READ, trace_start);
+	return n;
+}
+
+/*
+ * Load settings from a stream, reading it in large blocks, and pass
+ * each pair to the given handler along with the given context.
+ * Complete lines are parsed straight from the buffer, and the
+ * buffer is doubled if a single line does not fit in it. An incomplete
+ * line is not scanned again from its start after every read, so a long
+ * line arriving in short reads (like from a pipe) costs linear time. The buffer
+ * is kept in the settings afterwards, so that the next load can reuse it.
+ * Returns 1 on success, or 0 on failure.
+ */
+static int load_stream(Settings *settings, void *ctx, void *stream, StreamReader reader, PairHandler handler) {
+	size_t size = settings->stream_size;
+	size_t len = 0;
+	size_t scanned = 0; /* Bytes at the start of the buffer that hold no newline */
+	char *buf = settings->stream_buf;
+	int result = 1;
+
+	if (buf == NULL) {
+		size = STREAM_BUFFER_SIZE;
+		if (!(buf = memory_malloc(size))) {
+			return 0;
+		}
+	}
+
+	for (;;) {
+		size_t consumed;
+		size_t n;
+		if (len == size) {
+			/* The current line fills the whole buffer */
+			char *bigger = memory_realloc(buf, size * 2);
+			if (bigger == NULL) {
+				result = 0;
+				break;
+			}
+			buf = bigger;
+			size *= 2;
+		}
+		n = read_stream(settings, stream, reader, buf + len, size - len);
+		len += n;
+		if (n != 0) {
+			/* Only scan the new bytes until the incomplete line ends */
+			const char *eq;
+			if (scan_line(buf + scanned, buf + len, &eq) == buf + len) {
+				scanned = len;
+				continue;
+			}
+		}
+		if (!load_lines(settings, ctx, buf, len, n == 0, handler, &consumed)) {
+			result = 0;
+			break;
+		}
+		if (n == 0) {
+			break; /* End of stream */
+		}
+		/* Keep the incomplete line for the next round */
+		memmove(buf, buf + consumed, len - consumed);
+		len -= consumed;
+		scanned = len;
+	}
+
+	if (size > STREAM_BUFFER_KEEP) {
+		/* Do not hold on to the room for an unusually long line */
+		memory_free(buf);
+		buf = NULL;
+		size = 0;
+	}
+	settings->stream_buf = buf;
+	settings->stream_size = size;
+	return result;
+}
+
+/*
+ * Read from a standard C file.
+ */
+static size_t read_file(void *stream, char *buf, size_t size) {
+	return fread(buf, 1, size, (FILE *) stream);
+}
+
+#ifdef HAVE_POSIX
+/* A file descriptor being read by read_fd */
+struct FdStream {
+	int fd;
+	int error;
+};
+
+/*
+ * Read from a file descriptor, retrying if interrupted.
+ */
+static size_t read_fd(void *stream, char *buf, size_t size) {
+	struct FdStream *fd_stream = stream;
+	ssize_t n;
+	do {
+		n = read(fd_stream->fd, buf, size);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		fd_stream->error = 1;
+		return 0;
+	}
+	return (size_t) n;
+}
+#endif
+
+Settings *settings_create(void) {
+	Settings *settings = memory_malloc(sizeof(Settings));
+	if (settings) {
+		settings->list = NULL;
+		settings->list_len = 0;
+		settings->list_capacity = 0;
+		settings->listed = 0;
+		settings->list_seq = 0;
+		settings->compactions = 0;
+		settings->index = NULL;
+		settings->frozen = NULL;
+		settings->count = 0;
+		settings->used = 0;
+		settings->use_arena = 0;
+		settings->chunks = NULL;
+		memset(settings->free_lists, 0, sizeof(settings->free_lists));
+		settings->free_bytes = 0;
+		settings->storage_bytes = 0;
+		settings->spare_index = NULL;
+		settings->mappings = NULL;
+		settings->readers = NULL;
+		settings->retired = NULL;
+		settings->retired_count = 0;
+		settings->spare_retired = NULL;
+		settings->spare_count = 0;
+		/* Readers use 0 to mean that they are not reading */
+		settings->epoch = 1;
+		settings->refs = 1;
+		settings->sorted = NULL;
+		settings->sorted_count = 0;
+		settings->sorted_capacity = 0;
+		settings->sorted_changes = 0;
+		settings->sorted_stale = 1;
+		settings->writes = 0;
+		settings->reloaded.valid = 0;
+		settings->watches = NULL;
+		settings->watch_pending = 0;
+		settings->stream_buf = NULL;
+		settings->stream_size = 0;
+		settings->shards = NULL;
+		settings->shard_count = 0;
+		settings->generation = 0;
+		settings->layers = NULL;
+		settings->layer_count = 0;
+		settings->cache = NULL;
+		settings->cache_size = 0;
+		memset(settings->stats, 0, sizeof(settings->stats));
+#ifdef SETTINGS_TRACE
+		memset(settings->traces, 0, sizeof(settings->traces));
+#endif
+	}
+	return settings;
+}
+
+Settings *settings_create_with_arena(void) {
+	Settings *settings = settings_create();
+	if (settings) {
+		settings->use_arena = 1;
+	}
+	return settings;
+}
+
+Settings *settings_create_with_capacity(size_t capacity) {
+	Settings *settings = settings_create();
+	if (settings && !settings_reserve(settings, capacity)) {
+		settings_free(settings);
+		return NULL;
+	}
+	return settings;
+}
+
+Settings *settings_create_sharded(size_t shards) {
+#ifdef HAVE_SHARD_LOCKS
+	Settings *settings;
+
+	if (shards == 0 || !(settings = settings_create())) {
+		return NULL;
+	}
+	if (!(settings->shards = memory_malloc(shards * sizeof(struct Shard)))) {
+		settings_free(settings);
+		return NULL;
+	}
+	/* Count each shard as it is set up, so that freeing cleans up just those */
+	while (settings->shard_count < shards) {
+		struct Shard *shard = &settings->shards[settings->shard_count];
+		if (!(shard->settings = settings_create())) {
+			settings_free(settings);
+			return NULL;
+		}
+		if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+			settings_free(shard->settings);
+			settings_free(settings);
+			return NULL;
+		}
+		++settings->shard_count;
+	}
+	return settings;
+#else
+	/* Without locks, threads would corrupt the shards */
+	(void) shards;
+	return NULL;
+#endif
+}
+
+/*
+ * Add the given settings to the layers of an overlay, followed by its own
+ * layers if it is an overlay itself, so that lookups never go through
+ * more than one cache. Returns the number of keys added with them.
+ */
+static size_t add_layers(Settings *overlay, Settings *layer) {
+	size_t keys = layer->listed;
+	size_t i;
+	overlay->layers[overlay->layer_count++] = layer;
+	for (i = 0; i < layer->layer_count; ++i) {
+		overlay->layers[overlay->layer_count++] = layer->layers[i];
+		keys += layer->layers[i]->listed;
+	}
+	return keys;
+}
+
+Settings *settings_create_overlay(Settings *parent, Settings *child) {
+	Settings *settings;
+	size_t keys;
+
+	if (parent == NULL || child == NULL || parent->shards != NULL || child->shards != NULL
+			|| !(settings = settings_create())) {
+		return NULL;
+	}
+	settings->layers = memory_malloc((2 + child->layer_count + parent->layer_count) * sizeof(Settings *));
+	if (settings->layers == NULL) {
+		settings_free(settings);
+		return NULL;
+	}
+	keys = add_layers(settings, child);
+	keys += add_layers(settings, parent);
+
+	/* Room for about every key of the layers, without growing huge for big ones */
+	settings->cache_size = OVERLAY_CACHE_MIN;
+	while (settings->cache_size < keys && settings->cache_size < OVERLAY_CACHE_MAX) {
+		settings->cache_size *= 2;
+	}
+	if (!(settings->cache = memory_malloc(settings->cache_size * sizeof(struct OverlayEntry)))) {
+		settings_free(settings);
+		return NULL;
+	}
+	memset(settings->cache, 0, settings->cache_size * sizeof(struct OverlayEntry));
+	return settings;
+}
+
+int settings_reserve(Settings *settings, size_t capacity) {
+	if (settings == NULL) {
+		return 0;
+	}
+	if (settings->shards != NULL) {
+		/* The keys spread evenly, so give each shard its share */
+		const size_t share = capacity / settings->shard_count + 1;
+		int result = 1;
+		size_t i;
+		for (i = 0; i < settings->shard_count; ++i) {
+			result &= settings_reserve(lock_shard(&settings->shards[i]), share);
+			unlock_shard(&settings->shards[i]);
+		}
+		return result;
+	}
+	if (settings->frozen != NULL) {
+		return 0; /* Nothing can be added */
+	}
+	if (capacity <= settings->count) {
+		return 1; /* Already has room */
+	}
+	return index_reserve(settings, capacity - settings->count)
+		&& list_reserve(settings, capacity - settings->listed);
+}
+
+void settings_shrink(Settings *settings) {
+	size_t i;
+	for (i = 0; settings != NULL && i < settings->shard_count; ++i) {
+		settings_shrink(lock_shard(&settings->shards[i]));
+		unlock_shard(&settings->shards[i]);
+	}
+	/* Frozen settings were shrunk when frozen, and readers may be using all of it */
+	if (settings != NULL && settings->frozen == NULL) {
+		const struct Index *index = settings->index;
+		const size_t capacity = index_capacity_for(settings->count);
+		if (index != NULL && (capacity < index->capacity || settings->used > settings->count)) {
+			/* Failing to allocate the smaller index just keeps the current one */
+			index_rebuild(settings, capacity);
+		}
+		list_shrink(settings);
+		/* The sorted index is rebuilt on demand */
+		memory_free(settings->sorted);
+		settings->sorted = NULL;
+		settings->sorted_count = 0;
+		settings->sorted_capacity = 0;
+		settings->sorted_stale = 1;
+		memory_free(settings->stream_buf);
+		settings->stream_buf = NULL;
+		settings->stream_size = 0;
+		if (settings->retired != NULL) {
+			reclaim(settings);
+		}
+		release_free_lists(settings);
+	}
+}
+
+int settings_memory_usage(Settings *settings, SettingsMemoryUsage *usage) {
+	const struct Chunk *chunk;
+	const struct Index *index;
+	size_t i;
+
+	if (settings == NULL || usage == NULL) {
+		return 0;
+	}
+	usage->live = 0;
+	usage->retained = 0;
+	for (i = 0; i < settings->shard_count; ++i) {
+		SettingsMemoryUsage shard;
+		settings_memory_usage(lock_shard(&settings->shards[i]), &shard);
+		unlock_shard(&settings->shards[i]);
+		usage->live += shard.live;
+		usage->retained += shard.retained;
+	}
+	usage->live += sizeof(Settings) + settings->shard_count * sizeof(struct Shard);
+	usage->live += settings->layer_count * sizeof(Settings *) + settings->cache_size * sizeof(struct OverlayEntry);
+
+	/* Pairs and values, and what is kept around for new ones */
+	usage->live += settings->storage_bytes;
+	usage->retained += settings->free_bytes;
+	for (chunk = settings->chunks; chunk != NULL; chunk = chunk->next) {
+		usage->live += sizeof(struct Chunk) + chunk->used;
+		usage->retained += chunk->size - chunk->used;
+	}
+
+	/* The index and lists over them */
+	if ((index = settings->index) != NULL) {
+		usage->live += sizeof(struct Index) + index->capacity * (sizeof(struct Pair *) + sizeof(size_t));
+	}
+	if (settings->frozen != NULL) {
+		usage->live += settings->frozen->size;
+	}
+	usage->live += settings->list_capacity * sizeof(struct ListEntry);
+	usage->live += settings->sorted_capacity * sizeof(struct Pair *);
+
+	if ((index = settings->spare_index) != NULL) {
+		usage->retained += sizeof(struct Index) + index->capacity * (sizeof(struct Pair *) + sizeof(size_t));
+	}
+
+	usage->live += settings->retired_count * sizeof(struct Retired);
+	usage->retained += settings->spare_count * sizeof(struct Retired);
+	usage->retained += settings->stream_size;
+	return 1;
+}
+
+/*
+ * Add the sizes, probe lengths and counters of the given settings, not
+ * counting its shards, to the stats. The probe lengths, the number of keys
+ * in the index and the number of slots are added up separately, so that
+ * the averages can be taken over all the shards at the end.
+ */
+static void collect_stats(Settings *settings, SettingsStats *stats,
+		size_t *probes, size_t *indexed, size_t *slots) {
+	const struct Index *index = settings->index;
+	const struct Chunk *chunk;
+	struct Pair *pair;
+	size_t position;
+	size_t i;
+
+	for (position = 0; (pair = next_listed(settings, &position)) != NULL; ) {
+		++stats->keys;
+		stats->key_bytes += pair->key_len;
+		stats->value_bytes += pair->value->len;
+	}
+	stats->node_bytes += settings->storage_bytes;
+	for (chunk = settings->chunks; chunk != NULL; chunk = chunk->next) {
+		stats->node_bytes += chunk->used;
+	}
+	if (settings->frozen != NULL) {
+		/* Every key is found in the one slot it hashes to */
+		stats->node_bytes += settings->frozen->size - settings->frozen->table_size;
+		stats->index_bytes += settings->frozen->table_size;
+		*probes += settings->frozen->count;
+		*indexed += settings->frozen->count;
+		*slots += settings->frozen->count;
+		stats->max_probe = settings->frozen->count > 0 ? 1 : 0;
+	}
+
+	if (index != NULL) {
+		const size_t mask = index->capacity - 1;
+		stats->index_bytes += sizeof(struct Index) + index->capacity * (sizeof(struct Pair *) + sizeof(size_t));
+		*slots += index->capacity;
+		for (i = 0; i < index->capacity; ++i) {
+			if (index->slots[i] != NULL && index->slots[i] != TOMBSTONE) {
+				/* Slots from where the key's probing starts to where it is found */
+				const size_t probe = ((i - (index->hashes[i] & mask)) & mask) + 1;
+				*probes += probe;
+				++*indexed;
+				if (probe > stats->max_probe) {
+					stats->max_probe = probe;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < STAT_STRIPES; ++i) {
+		unsigned long long *counts = settings->stats[i].counts;
+		stats->get_hits += load_relaxed(&counts[STAT_GET_HIT]);
+		stats->get_misses += load_relaxed(&counts[STAT_GET_MISS]);
+		stats->sets += load_relaxed(&counts[STAT_SET]);
+		stats->removes += load_relaxed(&counts[STAT_REMOVE]);
+		stats->loads += load_relaxed(&counts[STAT_LOAD]);
+		stats->saves += load_relaxed(&counts[STAT_SAVE]);
+	}
+}
+
+int settings_stats(Settings *settings, SettingsStats *stats) {
+	size_t probes = 0;
+	size_t indexed = 0;
+	size_t slots = 0;
+	size_t i;
+
+	if (settings == NULL || stats == NULL) {
+		return 0;
+	}
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < settings->shard_count; ++i) {
+		collect_stats(lock_shard(&settings->shards[i]), stats, &probes, &indexed, &slots);
+		unlock_shard(&settings->shards[i]);
+	}
+	collect_stats(settings, stats, &probes, &indexed, &slots);
+	stats->load_factor = slots > 0 ? (double) indexed / slots : 0.0;
+	stats->average_probe = indexed > 0 ? (double) probes / indexed : 0.0;
+	return 1;
+}
+
+int settings_trace(Settings *settings, SettingsTraceCallback callback, void *context) {
+#ifdef SETTINGS_TRACE
+	static const char *const names[SETTINGS_TRACE_POINTS] = {
+		"load", "read", "parse", "insert", "get", "set", "remove", "save"
+	};
+	SettingsTrace trace;
+	size_t i;
+	int point;
+
+	if (settings == NULL || callback == NULL) {
+		return 0;
+	}
+	for (point = 0; point < SETTINGS_TRACE_POINTS; ++point) {
+		memset(&trace, 0, sizeof(trace));
+		trace.point = (SettingsTracePoint) point;
+		trace.name = names[point];
+		/* The counters are atomic, so the shards do not need to be locked */
+		for (i = 0; i < settings->shard_count; ++i) {
+			add_trace(&trace, settings->shards[i].settings, trace.point);
+		}
+		add_trace(&trace, settings, trace.point);
+		callback(&trace, context);
+	}
+	return 1;
+#else
+	(void) settings;
+	(void) callback;
+	(void) context;
+	return 0;
+#endif
+}
+
+/*
+ * Free all the pairs and values of the settings, along with the arena
+ * chunks and mapped files that they may be in, the retired allocations
+ * and the index. Nobody may be reading.
+ */
+static void free_pairs(Settings *settings) {
+	struct Index *index = settings->index;
+	size_t i;
+
+	while (settings->retired != NULL) {
+		struct Retired *next = settings->retired->next;
+		free_retired(settings, settings->retired->ptr, settings->retired->kind);
+		memory_free(settings->retired);
+		settings->retired = next;
+	}
+	settings->retired_count = 0;
+	/* Every pair is in the index, including interned keys without a value */
+	for (i = 0; index != NULL && i < index->capacity && !settings->use_arena; ++i) {
+		struct Pair *pair = index->slots[i];
+		if (pair != NULL && pair != TOMBSTONE) {
+			free_pair(settings, pair);
+		}
+	}
+	arena_free(settings->chunks);
+	settings->chunks = NULL;
+	while (settings->mappings != NULL) {
+		struct Mapping *next = settings->mappings->next;
+#ifdef HAVE_POSIX
+		if (settings->mappings->addr != NULL) {
+			munmap(settings->mappings->addr, settings->mappings->size);
+		}
+#endif
+		memory_free(settings->mappings->pairs);
+		memory_free(settings->mappings);
+		settings->mappings = next;
+	}
+	memory_free(index);
+	settings->index = NULL;
+	settings->count = 0;
+	settings->used = 0;
+}
+
+void settings_free(Settings *settings) {
+	if (settings != NULL) {
+		size_t i;
+		for (i = 0; i < settings->shard_count; ++i) {
+			settings_free(settings->shards[i].settings);
+#ifdef HAVE_SHARD_LOCKS
+			pthread_mutex_destroy(&settings->shards[i].lock);
+#endif
+		}
+		memory_free(settings->shards);
+		/* The layers of an overlay belong to the caller */
+		memory_free(settings->layers);
+		memory_free(settings->cache);
+		/* Nobody may be reading anymore, so everything can go */
+		free_pairs(settings);
+		memory_free(settings->frozen);
+		while (settings->readers != NULL) {
+			struct SettingsReader *next = settings->readers->next;
+			memory_free(settings->readers);
+			settings->readers = next;
+		}
+		while (settings->watches != NULL) {
+			struct SettingsWatch *next = settings->watches->next;
+			memory_free(settings->watches);
+			settings->watches = next;
+		}
+		release_free_lists(settings);
+		memory_free(settings->stream_buf);
+		memory_free(settings->sorted);
+		memory_free(settings->list);
+		memory_free(settings);
+	}
+}
+
+/*
+ * Create a reader of sharded settings, with a reader for each shard.
+ * The shards reclaim their own readers, but nothing reclaims those of
+ * the sharded settings themselves, so their list is kept under the lock
+ * of the first shard instead, and readers are unlinked when freed.
+ * Returns the reader, or NULL if out of memory.
+ */
+static SettingsReader *create_sharded_reader(Settings *settings) {
+	SettingsReader *reader = memory_malloc(sizeof(SettingsReader)
+		+ settings->shard_count * sizeof(SettingsReader *));
+	size_t i;
+
+	if (reader == NULL) {
+		return NULL;
+	}
+	reader->settings = settings;
+	reader->epoch = 0;
+	reader->dead = 0;
+	reader->shards = (SettingsReader **) (reader + 1);
+	for (i = 0; i < settings->shard_count; ++i) {
+		if (!(reader->shards[i] = settings_reader_create(settings->shards[i].settings))) {
+			while (i-- > 0) {
+				settings_reader_free(reader->shards[i]);
+			}
+			memory_free(reader);
+			return NULL;
+		}
+	}
+
+	lock_shard(&settings->shards[0]);
+	reader->next = settings->readers;
+	store_release(&settings->readers, reader);
+	unlock_shard(&settings->shards[0]);
+	return reader;
+}
+
+/*
+ * Free a reader of sharded settings, along with the readers of its shards.
+ */
+static void free_sharded_reader(SettingsReader *reader) {
+	Settings *settings = reader->settings;
+	SettingsReader **link;
+	size_t i;
+
+	for (i = 0; i < settings->shard_count; ++i) {
+		settings_reader_free(reader->shards[i]);
+	}
+	lock_shard(&settings->shards[0]);
+	for (link = &settings->readers; *link != reader; link = &(*link)->next) {
+		/* Find the link to the reader */
+	}
+	*link = reader->next;
+	unlock_shard(&settings->shards[0]);
+	memory_free(reader);
+}
+
+SettingsReader *settings_reader_create(Settings *settings) {
+	SettingsReader *reader;
+
+	if (settings == NULL) {
+		return NULL;
+	}
+	if (settings->shards != NULL) {
+		return create_sharded_reader(settings);
+	}
+
+	reader = memory_malloc(sizeof(SettingsReader));
+	if (reader) {
+		reader->settings = settings;
+		reader->epoch = 0;
+		reader->dead = 0;
+		reader->shards = NULL;
+		/* Push onto the list; other readers may be doing the same */
+		reader->next = load_acquire(&settings->readers);
+		while (!compare_exchange(&settings->readers, &reader->next, reader)) {
+			/* reader->next was updated to the current head, so try again */
+		}
+	}
+	return reader;
+}
+
+void settings_reader_free(SettingsReader *reader) {
+	if (reader != NULL && reader->shards != NULL) {
+		free_sharded_reader(reader);
+	} else if (reader != NULL) {
+		/* The writer unlinks and frees it, since it owns the list */
+		store_release(&reader->epoch, 0);
+		store_release(&reader->dead, 1);
+	}
+}
+
+void settings_read_begin(SettingsReader *reader) {
+	size_t i;
+	if (reader != NULL && reader->shards != NULL) {
+		/* One fence is enough to announce the epochs in all the shards */
+		for (i = 0; i < reader->settings->shard_count; ++i) {
+			SettingsReader *shard_reader = reader->shards[i];
+			store_relaxed(&shard_reader->epoch, load_acquire(&shard_reader->settings->epoch));
+		}
+		full_fence();
+	} else if (reader != NULL) {
+		store_relaxed(&reader->epoch, load_acquire(&reader->settings->epoch));
+		/* Announce the epoch before looking at anything */
+		full_fence();
+	}
+}
+
+void settings_read_end(SettingsReader *reader) {
+	size_t i;
+	if (reader != NULL && reader->shards != NULL) {
+		for (i = 0; i < reader->settings->shard_count; ++i) {
+			store_release(&reader->shards[i]->epoch, 0);
+		}
+	} else if (reader != NULL) {
+		store_release(&reader->epoch, 0);
+	}
+}
+
+SettingsSnapshot *settings_snapshot_create(Settings *initial) {
+	SettingsSnapshot *snapshot = memory_malloc(sizeof(SettingsSnapshot));
+	if (snapshot) {
+		snapshot->current = initial;
+		snapshot->generation = 0;
+		snapshot->acquiring[0] = 0;
+		snapshot->acquiring[1] = 0;
+	}
+	return snapshot;
+}
+
+void settings_snapshot_free(SettingsSnapshot *snapshot) {
+	if (snapshot != NULL) {
+		settings_snapshot_release(snapshot->current);
+		memory_free(snapshot);
+	}
+}
+
+int settings_snapshot_publish(SettingsSnapshot *snapshot, Settings *next) {
+	unsigned long generation;
+	Settings *old;
+
+	if (snapshot == NULL || next == NULL) {
+		return 0;
+	}
+
+	/* Swap in the new settings; readers pick them up from now on */
+	old = load_acquire(&snapshot->current);
+	while (!compare_exchange(&snapshot->current, &old, next)) {
+		/* old was updated to the current settings, so try again */
+	}
+
+	/*
+	 * Readers that may have loaded the old pointer must get their reference
+	 * first. Those are counted under the previous generation, and new ones
+	 * see the new generation, so the wait is over once those few are done.
+	 */
+	generation = snapshot->generation;
+	store_release(&snapshot->generation, generation + 1);
+	full_fence();
+	while (load_acquire(&snapshot->acquiring[generation & 1]) != 0) {
+		/* Spin; this only takes as long as a couple of atomic operations */
+	}
+	settings_snapshot_release(old);
+
+	return 1;
+}
+
+int settings_snapshot_load(SettingsSnapshot *snapshot, const char *path) {
+	Settings *next;
+
+	if (snapshot == NULL || path == NULL) {
+		return 0;
+	}
+
+	/* Build the new settings on the side, and only publish them if complete */
+	if (!(next = settings_create())) {
+		return 0;
+	}
+	if (!settings_load(next, path)) {
+		settings_free(next);
+		return 0;
+	}
+	return settings_snapshot_publish(snapshot, next);
+}
+
+Settings *settings_snapshot_acquire(SettingsSnapshot *snapshot) {
+	unsigned long generation;
+	Settings *settings;
+
+	if (snapshot == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		generation = load_acquire(&snapshot->generation);
+		fetch_add(&snapshot->acquiring[generation & 1], 1);
+		/* Either this sees a publish that started, or the publish sees the count */
+		full_fence();
+		if (load_acquire(&snapshot->generation) == generation) {
+			break;
+		}
+		/* A publish moved on meanwhile, and may not wait for this counter */
+		fetch_sub(&snapshot->acquiring[generation & 1], 1);
+	}
+	settings = load_acquire(&snapshot->current);
+	if (settings != NULL) {
+		fetch_add(&settings->refs, 1);
+	}
+	fetch_sub(&snapshot->acquiring[generation & 1], 1);
+
+	return settings;
+}
+
+void settings_snapshot_release(Settings *settings) {
+	if (settings != NULL && fetch_sub(&settings->refs, 1) == 1) {
+		/* That was the last reference */
+		settings_free(settings);
+	}
+}
+
+/* Rough size of a line in a typical file, for guessing the number of keys */
+#define ESTIMATED_LINE_SIZE 32
+
+/* Most keys to make room for up front, since long lines make the guess too high */
+#define ESTIMATED_KEYS_MAX 65536
+
+/*
+ * Guess the number of keys in an input of the given size. Beyond
+ * ESTIMATED_KEYS_MAX, the storage grows as usual instead, so that a big
+ * file of long values does not leave most of what was reserved unused.
+ */
+static size_t estimated_keys(size_t size) {
+	return size / ESTIMATED_LINE_SIZE < ESTIMATED_KEYS_MAX ? size / ESTIMATED_LINE_SIZE : ESTIMATED_KEYS_MAX;
+}
+
+/*
+ * Make room for the keys that a file of the given size probably holds,
+ * so that loading it does not have to grow the index step by step.
+ * This is only a hint, so running out of memory is not an error here.
+ */
+static void reserve_for_size(Settings *settings, size_t size) {
+	settings_reserve(settings, settings->count + estimated_keys(size));
+}
+
+int settings_load(Settings *settings, const char *path) {
+	TRACE_BEGIN(trace_start);
+	FILE *f;
+	int result;
+
+	/* Settings and path are required, and frozen settings cannot change */
+	if (settings == NULL || path == NULL || settings->frozen != NULL) {
+		return 0;
+	}
+
+	/* Attempt to open file; whitespace (including '\r') is trimmed anyway */
+	if (!(f = fopen(path, "rb"))) {
+		return 0;
+	}
+
+	/* Successfully opened, so guess its size and read any settings */
+	if (fseek(f, 0, SEEK_END) == 0) {
+		const long size = ftell(f);
+		if (size > 0) {
+			reserve_for_size(settings, size);
+		}
+		rewind(f);
+	}
+	result = load_stream(settings, settings, f, read_file, load_pair);
+	if (ferror(f)) {
+		result = 0;
+	}
+
+	fclose(f);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+}
+
+int settings_load_buffer(Settings *settings, const char *data, size_t len) {
+	TRACE_BEGIN(trace_start);
+	size_t consumed;
+	int result;
+
+	/* Settings and data are required, and frozen settings cannot change */
+	if (settings == NULL || (data == NULL && len > 0) || settings->frozen != NULL) {
+		return 0;
+	}
+
+	reserve_for_size(settings, len);
+	result = load_lines(settings, settings, data, len, 1, load_pair, &consumed);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+}
+
+int settings_load_fd(Settings *settings, int fd) {
+#ifdef HAVE_POSIX
+	TRACE_BEGIN(trace_start);
+	struct FdStream stream;
+	struct stat st;
+	int result;
+
+	/* Settings and a valid descriptor are required, and frozen settings cannot change */
+	if (settings == NULL || fd < 0 || settings->frozen != NULL) {
+		return 0;
+	}
+
+	/* Only regular files have a size to go by */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		reserve_for_size(settings, st.st_size);
+	}
+	stream.fd = fd;
+	stream.error = 0;
+	result = load_stream(settings, settings, &stream, read_fd, load_pair) && !stream.error;
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+#else
+	/* No file descriptors on this platform */
+	(void) settings;
+	(void) fd;
+	return 0;
+#endif
+}
+
+#ifdef HAVE_POSIX
+/*
+ * A pair handler that borrows the key and value from the latest mapping.
+ *
+ * Keys and values are terminated in place, so the pairs can point
+ * straight at the mapped bytes. A key always ends before its equals sign,
+ * and a value before its newline, so there is room for the terminator
+ * except for a value that runs to the end of the file, which is copied.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int borrow_pair(void *ctx, const char *key, size_t key_len,
+		const char *value, size_t value_len) {
+	Settings *settings = ctx;
+	const struct Mapping *mapping = settings->mappings;
+	const char *const end = (const char *) mapping->addr + mapping->size;
+
+	if (value + value_len == end) {
+		/* No room for the terminator */
+		return set_value(settings, key, key_len, value, value_len, 0, NULL) != NULL;
+	}
+
+	/* The mapping is writable, so cast away the const */
+	((char *) key)[key_len] = '\0';
+	((char *) value)[value_len] = '\0';
+
+	return set_value(settings, key, key_len, value, value_len, 1, NULL) != NULL;
+}
+#endif
+
+int settings_load_mmap(Settings *settings, const char *path) {
+#ifdef HAVE_POSIX
+	TRACE_BEGIN(trace_start);
+	struct Mapping *mapping;
+	size_t consumed;
+	struct stat st;
+	void *addr;
+	int result;
+	int fd;
+
+	/* Settings and path are required, and frozen settings cannot change */
+	if (settings == NULL || path == NULL || settings->frozen != NULL) {
+		return 0;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size == 0) {
+		/* Nothing to map */
+		close(fd);
+		count_op(settings, STAT_LOAD, 1);
+		TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+		return 1;
+	}
+
+	/* Map privately, so that writing terminators does not touch the file */
+	addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return 0;
+	}
+	posix_madvise(addr, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+	/* Keep the mapping until the settings are freed */
+	if (!(mapping = memory_malloc(sizeof(struct Mapping)))) {
+		munmap(addr, st.st_size);
+		return 0;
+	}
+	mapping->addr = addr;
+	mapping->size = st.st_size;
+	mapping->pairs = NULL;
+	mapping->next = settings->mappings;
+	settings->mappings = mapping;
+
+	reserve_for_size(settings, st.st_size);
+	result = load_lines(settings, settings, addr, st.st_size, 1, borrow_pair, &consumed);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+#else
+	/* No memory mapping on this platform, so just read the file */
+	return settings_load(settings, path);
+#endif
+}
+
+/* A file being read by settings_reload, hashed as it goes */
+struct HashedStream {
+	FILE *file;
+	unsigned long long hash;
+};
+
+/*
+ * Read from a standard C file, adding the bytes to the hash.
+ */
+static size_t read_hashed(void *stream, char *buf, size_t size) {
+	struct HashedStream *hashed = stream;
+	const size_t n = fread(buf, 1, size, hashed->file);
+	hashed->hash = hash_bytes(hashed->hash, buf, n);
+	return n;
+}
+
+/*
+ * Hash the rest of the given file without parsing it.
+ * Returns 1 on success, or 0 if reading fails.
+ */
+static int hash_file(struct HashedStream *stream) {
+	char buf[8192];
+	while (read_hashed(stream, buf, sizeof(buf)) > 0) {
+		/* Only the hash is needed */
+	}
+	return !ferror(stream->file);
+}
+
+/*
+ * Get the size and modification time of the given open file.
+ * Returns 1 on success, or 0 on failure.
+ */
+static int stat_file(FILE *f, struct Fingerprint *fingerprint) {
+#ifdef HAVE_POSIX
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0) {
+		return 0;
+	}
+	fingerprint->size = st.st_size;
+	fingerprint->mtime = st.st_mtime;
+	return 1;
+#else
+	long size;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+		return 0;
+	}
+	rewind(f);
+	fingerprint->size = size;
+	fingerprint->mtime = 0;
+	return 1;
+#endif
+}
+
+/* A line that settings_reload applies once the whole file has been read */
+struct ReloadChange {
+	size_t hash;
+	size_t offset; /* Of the key in the text, followed by the value */
+	size_t key_len;
+	size_t value_len;
+};
+
+/* The lines that settings_reload has found to change something so far */
+struct Reload {
+	Settings *settings;
+	struct ReloadChange *changes;
+	size_t count;
+	size_t capacity;
+	char *text;
+	size_t text_len;
+	size_t text_size;
+};
+
+/*
+ * Add a copy of the given key and value to the changes of a reload.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int add_reload_change(struct Reload *reload, const char *key, size_t key_len, size_t hash,
+		const char *value, size_t value_len) {
+	struct ReloadChange *change;
+	if (reload->count == reload->capacity) {
+		const size_t capacity = reload->capacity > 0 ? reload->capacity * 2 : 16;
+		struct ReloadChange *changes = memory_realloc(reload->changes, capacity * sizeof(struct ReloadChange));
+		if (changes == NULL) {
+			return 0;
+		}
+		reload->changes = changes;
+		reload->capacity = capacity;
+	}
+	if (reload->text_size - reload->text_len < key_len + value_len) {
+		size_t size = reload->text_size > 0 ? reload->text_size : 1024;
+		char *text;
+		while (size - reload->text_len < key_len + value_len) {
+			size *= 2;
+		}
+		if (!(text = memory_realloc(reload->text, size))) {
+			return 0;
+		}
+		reload->text = text;
+		reload->text_size = size;
+	}
+	change = &reload->changes[reload->count++];
+	change->hash = hash;
+	change->offset = reload->text_len;
+	change->key_len = key_len;
+	change->value_len = value_len;
+	memcpy(reload->text + reload->text_len, key, key_len);
+	memcpy(reload->text + reload->text_len + key_len, value, value_len);
+	reload->text_len += key_len + value_len;
+	return 1;
+}
+
+/*
+ * A pair handler that marks a key as seen if its value is the same as
+ * the current one, and keeps the line for later otherwise. Once a key has
+ * a line kept, all of its lines are kept, since only the last one counts.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int reload_pair(void *ctx, const char *key, size_t key_len,
+		const char *value, size_t value_len) {
+	struct Reload *reload = ctx;
+	const size_t hash = hash_key(key, key_len);
+	struct Pair **slot = find_slot(reload->settings, key, key_len, hash);
+
+	if (slot != NULL && !((*slot)->flags & PAIR_CHANGED) && (*slot)->value != NULL
+			&& (*slot)->value->len == value_len && memcmp((*slot)->value->str, value, value_len) == 0) {
+		(*slot)->flags |= PAIR_SEEN;
+		return 1;
+	}
+	if (!add_reload_change(reload, key, key_len, hash, value, value_len)) {
+		return 0;
+	}
+	if (slot != NULL) {
+		(*slot)->flags |= PAIR_CHANGED;
+	}
+	return 1;
+}
+
+/*
+ * Apply the lines kept by reload_pair, going backwards so that only the
+ * last line of each key is used, and only if it changes the value.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int apply_reload(struct Reload *reload) {
+	Settings *settings = reload->settings;
+	size_t i = reload->count;
+
+	while (i-- > 0) {
+		const struct ReloadChange *change = &reload->changes[i];
+		const char *key = reload->text + change->offset;
+		const char *value = key + change->key_len;
+		struct Pair **slot = find_slot(settings, key, change->key_len, change->hash);
+		struct Pair *pair;
+
+		if (slot != NULL && !((*slot)->flags & PAIR_CHANGED)) {
+			continue; /* A later line of the key is already applied */
+		}
+		if (slot != NULL && (*slot)->value != NULL && (*slot)->value->len == change->value_len
+				&& memcmp((*slot)->value->str, value, change->value_len) == 0) {
+			pair = *slot;
+		} else if (!(pair = set_hashed_value(settings, key, change->key_len, change->hash,
+				value, change->value_len, 0, NULL))) {
+			return 0;
+		}
+		pair->flags = (pair->flags & ~PAIR_CHANGED) | PAIR_SEEN;
+	}
+	return 1;
+}
+
+/*
+ * Clear the marks left by reload_pair and apply_reload, and if remove
+ * is set, remove the pairs that were not seen.
+ */
+static void finish_reload(Settings *settings, int remove) {
+	size_t position = 0;
+	struct Pair *pair;
+	while ((pair = next_listed(settings, &position)) != NULL) {
+		const unsigned seen = pair->flags & PAIR_SEEN;
+		pair->flags &= ~(PAIR_SEEN | PAIR_CHANGED);
+		if (!seen && remove) {
+			remove_pair(settings, find_slot(settings, pair->key, pair->key_len, pair->hash));
+		}
+	}
+}
+
+int settings_reload(Settings *settings, const char *path) {
+	TRACE_BEGIN(trace_start);
+	struct Fingerprint fingerprint;
+	struct HashedStream stream;
+	struct Reload reload = { NULL, NULL, 0, 0, NULL, 0, 0 };
+	int result;
+
+	/* Settings and path are required, the keys to diff must be in one table, and frozen settings cannot change */
+	if (settings == NULL || path == NULL || settings->shards != NULL || settings->frozen != NULL) {
+		return 0;
+	}
+
+	if (!(stream.file = fopen(path, "rb"))) {
+		return 0;
+	}
+	if (!stat_file(stream.file, &fingerprint)) {
+		fclose(stream.file);
+		return 0;
+	}
+
+	/* If nothing seems to have changed on either side, make sure by hashing */
+	stream.hash = HASH_SEED;
+	if (settings->reloaded.valid && settings->reloaded.writes == settings->writes
+			&& settings->reloaded.size == fingerprint.size && settings->reloaded.mtime == fingerprint.mtime) {
+		if (hash_file(&stream) && stream.hash == settings->reloaded.hash) {
+			fclose(stream.file);
+			count_op(settings, STAT_LOAD, 1);
+			TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+			return 1;
+		}
+		rewind(stream.file);
+		stream.hash = HASH_SEED;
+	}
+
+	if (fingerprint.size > 0) {
+		settings_reserve(settings, estimated_keys((size_t) fingerprint.size));
+	}
+	reload.settings = settings;
+	result = load_stream(settings, &reload, &stream, read_hashed, reload_pair) && !ferror(stream.file);
+	fclose(stream.file);
+	result = apply_reload(&reload) && result;
+	memory_free(reload.changes);
+	memory_free(reload.text);
+
+	/* Only a complete file can tell which keys are gone */
+	finish_reload(settings, result);
+	fingerprint.valid = result;
+	fingerprint.hash = stream.hash;
+	fingerprint.writes = settings->writes;
+	settings->reloaded = fingerprint;
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+}
+
+/* Most threads that a parallel load splits its input between */
+#ifdef HAVE_PARALLEL_LOAD
+	#define PARALLEL_MAX_THREADS 64
+#else
+	#define PARALLEL_MAX_THREADS 1
+#endif
+
+/* Smallest part of the input that is worth a thread of its own */
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+
+/* A pair parsed by a parallel load, before it is added to the settings */
+struct ParsedPair {
+	const char *key;
+	const char *value;
+	size_t key_len;
+	size_t value_len;
+	size_t hash;
+	struct Pair *pair; /* Built in the block of the chunk, if any */
+};
+
+/* A part of the input of a parallel load, and the pairs parsed from it */
+struct ParseChunk {
+	const char *data;
+	size_t size;
+	struct ParsedPair *pairs;
+	size_t count;
+	size_t capacity;
+	int build;   /* Whether to build the pairs too */
+	char *block; /* The pairs that were built */
+	int result;
+};
+
+/*
+ * A pair handler that collects the key and value into a chunk,
+ * along with the hash of the key.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int collect_pair(void *ctx, const char *key, size_t key_len,
+		const char *value, size_t value_len) {
+	struct ParseChunk *chunk = ctx;
+	struct ParsedPair *pair;
+
+	if (chunk->count == chunk->capacity) {
+		const size_t capacity = chunk->capacity > 0
+			? chunk->capacity * 2
+			: estimated_keys(chunk->size) + 16;
+		struct ParsedPair *pairs = memory_realloc(chunk->pairs, capacity * sizeof(struct ParsedPair));
+		if (pairs == NULL) {
+			return 0;
+		}
+		chunk->pairs = pairs;
+		chunk->capacity = capacity;
+	}
+
+	pair = &chunk->pairs[chunk->count++];
+	pair->key = key;
+	pair->value = value;
+	pair->key_len = key_len;
+	pair->value_len = value_len;
+	pair->hash = hash_key(key, key_len);
+	pair->pair = NULL;
+	return 1;
+}
+
+/*
+ * Get the bytes that a pair takes in a block of pairs,
+ * with its key inline and its value embedded.
+ */
+static size_t block_pair_size(size_t key_len, size_t value_len) {
+	return ALIGN_UP(EMBEDDED_VALUE_OFFSET(key_len + 1) + value_size(value_len));
+}
+
+/*
+ * Build the pairs parsed from a chunk in one block, with copies of their
+ * keys and values, so that adding them only has to place them. The pairs
+ * stay in the block until the settings are freed, like those of a binary
+ * file. Returns 1 on success, or 0 if out of memory.
+ */
+static int build_pairs(struct ParseChunk *chunk) {
+	size_t size = 0;
+	char *memory;
+	size_t i;
+
+	for (i = 0; i < chunk->count; ++i) {
+		size += block_pair_size(chunk->pairs[i].key_len, chunk->pairs[i].value_len);
+	}
+	if (size == 0) {
+		return 1;
+	}
+	if (!(chunk->block = memory_malloc(size))) {
+		return 0;
+	}
+
+	for (i = 0, memory = chunk->block; i < chunk->count; ++i) {
+		struct ParsedPair *parsed = &chunk->pairs[i];
+		struct Pair *pair = (struct Pair *) memory;
+		pair->key = (char *) (pair + 1);
+		memcpy(pair->key, parsed->key, parsed->key_len);
+		pair->key[parsed->key_len] = '\0';
+		pair->key_len = parsed->key_len;
+		pair->hash = parsed->hash;
+		pair->flags = PAIR_IN_BLOCK;
+		pair->units = 0;
+		pair->position = 0;
+		/* The memory is given, so the settings are not needed */
+		pair->value = new_value(NULL, embedded_value(pair, parsed->key_len + 1), parsed->value, parsed->value_len);
+		parsed->pair = pair;
+		memory += block_pair_size(parsed->key_len, parsed->value_len);
+	}
+	return 1;
+}
+
+/*
+ * Parse all the lines of a chunk, and build their pairs if asked to.
+ * This may run on a thread of its own, so it only touches the chunk,
+ * and never the settings.
+ */
+static void *parse_chunk(void *arg) {
+	struct ParseChunk *chunk = arg;
+	size_t consumed;
+	chunk->result = parse_lines(chunk, chunk->data, chunk->size, 1, collect_pair, &consumed)
+		&& (!chunk->build || build_pairs(chunk));
+	return NULL;
+}
+
+/*
+ * Get the number of threads to parse the given amount of input with,
+ * given the number asked for (where 0 means one per processor).
+ */
+static size_t parallel_threads(unsigned threads, size_t size) {
+	size_t n = threads;
+#if defined(HAVE_PARALLEL_LOAD) && defined(_SC_NPROCESSORS_ONLN)
+	if (n == 0) {
+		const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		n = processors > 0 ? (size_t) processors : 1;
+	}
+#endif
+	if (n > size / PARALLEL_MIN_CHUNK) {
+		n = size / PARALLEL_MIN_CHUNK;
+	}
+	if (n > PARALLEL_MAX_THREADS) {
+		n = PARALLEL_MAX_THREADS;
+	}
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Add a pair built by build_pairs to the settings. If the key is already
+ * there (because it appears twice), the embedded value of the new pair is
+ * published for the old one instead, and stays in the block too.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int add_built_pair(Settings *settings, struct Pair *pair) {
+	struct Pair **slot = find_slot(settings, pair->key, pair->key_len, pair->hash);
+	if (!list_reserve(settings, 1)) {
+		return 0;
+	}
+	if (slot != NULL) {
+		publish_value(settings, *slot, pair->value);
+		return 1;
+	}
+	if (!index_reserve(settings, 1)) {
+		return 0;
+	}
+	index_insert(settings, settings->index, pair);
+	append_pair(settings, pair);
+	next_generation(settings);
+	note_change(settings, pair);
+	return 1;
+}
+
+/*
+ * Keep the block of pairs built for a chunk until the settings are freed.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int keep_block(Settings *settings, char *block) {
+	struct Mapping *mapping = memory_malloc(sizeof(struct Mapping));
+	if (mapping == NULL) {
+		return 0;
+	}
+	mapping->addr = NULL;
+	mapping->size = 0;
+	mapping->pairs = block;
+	mapping->next = settings->mappings;
+	settings->mappings = mapping;
+	return 1;
+}
+
+/*
+ * Load the given buffer by splitting it into chunks at line boundaries
+ * and parsing them on the given number of threads. The pairs are then
+ * added in file order, so a key that appears twice gets the later
+ * value, just like loading it sequentially. Nothing is added unless
+ * every chunk has been parsed.
+ *
+ * When loading into empty settings, the threads also build the pairs,
+ * so that only placing them in the index and list is left for the end.
+ * Otherwise every pair is set as usual, so that loading the same file
+ * again does not keep a block around for values that get replaced.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int load_parallel(Settings *settings, const char *data, size_t size, unsigned threads) {
+	TRACE_BEGIN(trace_start);
+	struct ParseChunk chunks[PARALLEL_MAX_THREADS];
+#ifdef HAVE_PARALLEL_LOAD
+	pthread_t ids[PARALLEL_MAX_THREADS];
+	int started[PARALLEL_MAX_THREADS];
+#endif
+	const char *const end = data + size;
+	const char *start = data;
+	const size_t n = parallel_threads(threads, size);
+	const int build = settings->count == 0 && settings->shards == NULL;
+	size_t total = 0;
+	int result = 1;
+	size_t i;
+	size_t j;
+
+	/* Split after the first newline following each even share */
+	for (i = 0; i < n; ++i) {
+		const char *stop = end;
+		if (i + 1 < n) {
+			stop = data + size / n * (i + 1);
+			if (stop < start) {
+				stop = start;
+			}
+			stop = memchr(stop, '\n', end - stop);
+			stop = stop != NULL ? stop + 1 : end;
+		}
+		chunks[i].data = start;
+		chunks[i].size = stop - start;
+		chunks[i].pairs = NULL;
+		chunks[i].count = 0;
+		chunks[i].capacity = 0;
+		chunks[i].build = build;
+		chunks[i].block = NULL;
+		chunks[i].result = 1;
+		start = stop;
+	}
+
+	/* The calling thread takes the first chunk; any thread that fails to start is made up for later */
+#ifdef HAVE_PARALLEL_LOAD
+	for (i = 1; i < n; ++i) {
+		started[i] = pthread_create(&ids[i], NULL, parse_chunk, &chunks[i]) == 0;
+	}
+#endif
+	parse_chunk(&chunks[0]);
+	for (i = 1; i < n; ++i) {
+#ifdef HAVE_PARALLEL_LOAD
+		if (started[i]) {
+			pthread_join(ids[i], NULL);
+			continue;
+		}
+#endif
+		parse_chunk(&chunks[i]);
+	}
+
+	for (i = 0; i < n; ++i) {
+		result &= chunks[i].result;
+		total += chunks[i].count;
+	}
+	TRACE_END(settings, SETTINGS_TRACE_PARSE, trace_start);
+
+	/* Hand the blocks over to the settings first, since their pairs are about to be added */
+	for (i = 0; i < n && result; ++i) {
+		if (chunks[i].block != NULL) {
+			if (!keep_block(settings, chunks[i].block)) {
+				result = 0;
+				break;
+			}
+			chunks[i].block = NULL;
+		}
+	}
+
+	/* Add the pairs in order, prefetching the index slots of those coming up */
+	if (result) {
+		settings_reserve(settings, settings->count + total);
+	}
+	for (i = 0; i < n && result; ++i) {
+		const struct ParsedPair *pairs = chunks[i].pairs;
+		for (j = 0; j < chunks[i].count; ++j) {
+			const struct Index *index = settings->index;
+			if (index != NULL && j + BATCH_SIZE < chunks[i].count) {
+				prefetch(&index->hashes[pairs[j + BATCH_SIZE].hash & (index->capacity - 1)]);
+			}
+			if (pairs[j].pair != NULL
+					? !add_built_pair(settings, pairs[j].pair)
+					: !set_hashed_value(settings, pairs[j].key, pairs[j].key_len, pairs[j].hash,
+						pairs[j].value, pairs[j].value_len, 0, NULL)) {
+				result = 0;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < n; ++i) {
+		memory_free(chunks[i].block);
+		memory_free(chunks[i].pairs);
+	}
+	return result;
+}
+
+int settings_load_buffer_parallel(Settings *settings, const char *data, size_t len, unsigned threads) {
+	TRACE_BEGIN(trace_start);
+	int result;
+
+	/* Settings and data are required, and frozen settings cannot change */
+	if (settings == NULL || (data == NULL && len > 0) || settings->frozen != NULL) {
+		return 0;
+	}
+
+	result = load_parallel(settings, data, len, threads);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+}
+
+int settings_load_parallel(Settings *settings, const char *path, unsigned threads) {
+#ifdef HAVE_POSIX
+	TRACE_BEGIN(trace_start);
+	struct stat st;
+	void *addr;
+	int result;
+	int fd;
+
+	/* Settings and path are required, and frozen settings cannot change */
+	if (settings == NULL || path == NULL || settings->frozen != NULL) {
+		return 0;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return 0;
+	}
+	if (st.st_size == 0) {
+		/* Nothing to map */
+		close(fd);
+		count_op(settings, STAT_LOAD, 1);
+		TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+		return 1;
+	}
+
+	/* The values are copied, so the mapping is only needed while loading */
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return 0;
+	}
+	posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED);
+
+	result = load_parallel(settings, addr, st.st_size, threads);
+	munmap(addr, st.st_size);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+#else
+	/* No memory mapping on this platform, so just read the file */
+	(void) threads;
+	return settings_load(settings, path);
+#endif
+}
+
+/* Size of the buffer that settings_save collects its output in */
+#define SAVE_BUFFER_SIZE (1024 * 1024)
+
+/* Output of settings_save, collected in a buffer and written in blocks */
+struct SaveBuffer {
+#ifdef HAVE_POSIX
+	int fd;
+#else
+	FILE *file;
+#endif
+	char *data;
+	size_t len;
+	int error;
+};
+
+/*
+ * Write the given bytes straight to the output file.
+ * Sets the error flag on failure.
+ */
+static void save_write(struct SaveBuffer *buf, const char *data, size_t len) {
+#ifdef HAVE_POSIX
+	while (len > 0 && !buf->error) {
+		const ssize_t n = write(buf->fd, data, len);
+		if (n < 0 && errno != EINTR) {
+			buf->error = 1;
+		} else if (n > 0) {
+			data += n;
+			len -= n;
+		}
+	}
+#else
+	if (len > 0 && fwrite(data, 1, len, buf->file) != len) {
+		buf->error = 1;
+	}
+#endif
+}
+
+/*
+ * Write out and empty the buffer.
+ */
+static void save_flush(struct SaveBuffer *buf) {
+	save_write(buf, buf->data, buf->len);
+	buf->len = 0;
+}
+
+/*
+ * Append the given bytes to the buffer, flushing it when full.
+ * Anything that would not fit in an empty buffer is written directly.
+ */
+static void save_append(struct SaveBuffer *buf, const char *data, size_t len) {
+	if (SAVE_BUFFER_SIZE - buf->len < len) {
+		save_flush(buf);
+		if (len >= SAVE_BUFFER_SIZE) {
+			save_write(buf, data, len);
+			return;
+		}
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+/*
+ * Write the given key and value into the buffer as one line.
+ */
+static void save_line(struct SaveBuffer *buf, const char *key, size_t key_len, const char *value, size_t len) {
+	save_append(buf, key, key_len);
+	save_append(buf, " = ", 3);
+	save_append(buf, value, len);
+	save_append(buf, "\n", 1);
+}
+
+/*
+ * Write one key and value per line into the buffer, and flush it.
+ * Returns 1 on success, or 0 if writing failed.
+ */
+static int save_pairs(Settings *settings, struct SaveBuffer *buf) {
+	size_t position = 0;
+	struct Pair *pair;
+	if (settings->layers != NULL) {
+		/* Write out what the overlay looks like, the same way as iterating it */
+		SettingsIter iter;
+		settings_iter_begin(settings, &iter);
+		while (!buf->error && settings_iter_next(&iter)) {
+			save_line(buf, iter.key, iter.key_len, iter.value, iter.value_len);
+		}
+		save_flush(buf);
+		return !buf->error;
+	}
+	if (settings->shards != NULL) {
+		/* Write out one shard after the other */
+		size_t i;
+		for (i = 0; i < settings->shard_count && !buf->error; ++i) {
+			save_pairs(lock_shard(&settings->shards[i]), buf);
+			unlock_shard(&settings->shards[i]);
+		}
+		return !buf->error;
+	}
+	while (!buf->error && (pair = next_listed(settings, &position)) != NULL) {
+		save_line(buf, pair->key, pair->key_len, pair->value->str, pair->value->len);
+	}
+	save_flush(buf);
+	return !buf->error;
+}
+
+/* Writes the contents of a saved file, returning 1 on success */
+typedef int (*SaveWriter)(Settings *settings, struct SaveBuffer *buf);
+
+/* Most names to try for the temporary file of a save */
+#define SAVE_ATTEMPTS 100
+
+/* Number of saves so far, for naming their temporary files */
+static unsigned long save_count;
+
+/*
+ * Save the settings into the given path using the given writer.
+ * Returns 1 on success, or 0 on failure.
+ */
+static int save_file(Settings *settings, const char *path, SaveWriter writer) {
+	struct SaveBuffer buf;
+	char *temp_path;
+	int result;
+
+	/*
+	 * Write into a temporary file next to the target, and rename it over
+	 * the target only once it is complete. That way, a crash halfway
+	 * through leaves the old file intact instead of a truncated one.
+	 */
+	if (!(temp_path = memory_malloc(strlen(path) + 64))) {
+		return 0;
+	}
+	if (!(buf.data = memory_malloc(SAVE_BUFFER_SIZE))) {
+		memory_free(temp_path);
+		return 0;
+	}
+	buf.len = 0;
+	buf.error = 0;
+
+#ifdef HAVE_POSIX
+	{
+		const char *slash = strrchr(path, '/');
+		int attempts = 0;
+		struct stat st;
+		int dir_fd;
+
+		/*
+		 * Make the name unique to this process and call, so that savers do
+		 * not collide, and only ever create a new file, rather than follow
+		 * whatever was left or planted under that name. Leftovers from a
+		 * crash just make it try the next name.
+		 */
+		do {
+			sprintf(temp_path, "%s.%ld.%lu.tmp", path, (long) getpid(), fetch_add(&save_count, 1));
+			buf.fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		} while (buf.fd < 0 && errno == EEXIST && ++attempts < SAVE_ATTEMPTS);
+		result = buf.fd >= 0;
+		if (result) {
+			/* Keep the permissions of the file being replaced */
+			if (stat(path, &st) == 0) {
+				fchmod(buf.fd, st.st_mode & 07777);
+			}
+			result = writer(settings, &buf);
+			result = fsync(buf.fd) == 0 && result;
+			result = close(buf.fd) == 0 && result;
+			result = result && rename(temp_path, path) == 0;
+			if (!result) {
+				unlink(temp_path);
+			}
+		}
+
+		/* Make the rename itself durable; this is only best effort */
+		if (result) {
+			if (slash != NULL) {
+				const size_t dir_len = slash == path ? 1 : (size_t) (slash - path);
+				memcpy(temp_path, path, dir_len);
+				temp_path[dir_len] = '\0';
+			} else {
+				strcpy(temp_path, ".");
+			}
+			if ((dir_fd = open(temp_path, O_RDONLY)) >= 0) {
+				fsync(dir_fd);
+				close(dir_fd);
+			}
+		}
+	}
+#else
+	sprintf(temp_path, "%s.%lu.tmp", path, fetch_add(&save_count, 1));
+	buf.file = fopen(temp_path, "wb");
+	result = buf.file != NULL;
+	if (result) {
+		int kept = 0;
+		result = writer(settings, &buf);
+		result = fflush(buf.file) == 0 && result;
+		result = fclose(buf.file) == 0 && result;
+		/* Only a complete file may replace the old one */
+#ifdef _WIN32
+		result = result && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+		if (result && rename(temp_path, path) != 0) {
+			/* Renaming over an existing file fails on some platforms, so make way for it */
+			kept = remove(path) == 0;
+			result = kept && rename(temp_path, path) == 0;
+		}
+#endif
+		/* Once the old file is gone, the new one is all that is left of the settings */
+		if (!result && !kept) {
+			remove(temp_path);
+		}
+	}
+#endif
+
+	memory_free(buf.data);
+	memory_free(temp_path);
+	return result;
+}
+
+int settings_save(Settings *settings, const char *path) {
+	TRACE_BEGIN(trace_start);
+	int result;
+
+	/* Settings and path are mandatory */
+	if (settings == NULL || path == NULL) {
+		return 0;
+	}
+
+	result = save_file(settings, path, save_pairs);
+	count_op(settings, STAT_SAVE, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_SAVE, trace_start);
+	return result;
+}
+
+/*
+ * Binary snapshot format, written by settings_save_binary.
+ *
+ * The file starts with a header, followed by one entry per pair (in list
+ * order), an open-addressing hash table of entry numbers, and a pool of
+ * NUL-terminated keys and values. Entries hold the hash of the key and
+ * its pre-parsed values. The file ends with a checksum of everything
+ * before it, since the loader trusts the stored hashes, table and values.
+ * Everything is in the byte order of the machine that wrote the file,
+ * which is recorded in the header.
+ */
+#define BINARY_MAGIC "SETTINGS"
+#define BINARY_VERSION 3
+#define BINARY_BYTE_ORDER 0x01020304u
+
+struct BinaryHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t hash_bits;  /* Bits in the stored hashes */
+	uint32_t reserved;
+	uint64_t file_size;
+	uint64_t count;      /* Number of entries */
+	uint64_t table_size; /* Number of hash table slots (a power of two) */
+	uint64_t strings_size;
+};
+
+struct BinaryEntry {
+	uint64_t hash;
+	uint64_t key_offset;   /* Offsets into the string pool */
+	uint64_t value_offset;
+	uint32_t key_len;
+	uint32_t value_len;
+	double double_value;
+	int64_t int_value;
+	float float_value;
+	uint32_t reserved;
+};
+
+#define CHECKSUM_LANES 4
+#define CHECKSUM_BLOCK (CHECKSUM_LANES * sizeof(uint64_t))
+
+/*
+ * Running checksum of a binary file. The bytes are taken a word at a time
+ * in independent lanes, so that checking a file costs about as much as
+ * reading it.
+ */
+struct BinaryChecksum {
+	uint64_t lanes[CHECKSUM_LANES];
+	unsigned char pending[CHECKSUM_BLOCK]; /* Bytes that do not fill a block yet */
+	size_t pending_len;
+	uint64_t size;
+};
+
+static void checksum_init(struct BinaryChecksum *checksum) {
+	size_t i;
+	for (i = 0; i < CHECKSUM_LANES; ++i) {
+		checksum->lanes[i] = HASH_SEED + i;
+	}
+	checksum->pending_len = 0;
+	checksum->size = 0;
+}
+
+/*
+ * Mix one block of bytes into the lanes. Each step is a bijection of
+ * both the lane and the word, so any single changed word is caught.
+ */
+static void checksum_block(uint64_t *lanes, const unsigned char *data) {
+	uint64_t word;
+	size_t i;
+	for (i = 0; i < CHECKSUM_LANES; ++i) {
+		memcpy(&word, data + i * sizeof(uint64_t), sizeof(uint64_t));
+		lanes[i] += word * 0xc2b2ae3d27d4eb4fULL;
+		lanes[i] = ((lanes[i] << 31) | (lanes[i] >> 33)) * 0x9e3779b185ebca87ULL;
+	}
+}
+
+static void checksum_add(struct BinaryChecksum *checksum, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	size_t n;
+
+	checksum->size += len;
+	if (checksum->pending_len > 0) {
+		n = CHECKSUM_BLOCK - checksum->pending_len < len ? CHECKSUM_BLOCK - checksum->pending_len : len;
+		memcpy(checksum->pending + checksum->pending_len, bytes, n);
+		checksum->pending_len += n;
+		bytes += n;
+		len -= n;
+		if (checksum->pending_len < CHECKSUM_BLOCK) {
+			return;
+		}
+		checksum_block(checksum->lanes, checksum->pending);
+		checksum->pending_len = 0;
+	}
+	for (; len >= CHECKSUM_BLOCK; bytes += CHECKSUM_BLOCK, len -= CHECKSUM_BLOCK) {
+		checksum_block(checksum->lanes, bytes);
+	}
+	memcpy(checksum->pending, bytes, len);
+	checksum->pending_len = len;
+}
+
+static uint64_t checksum_end(const struct BinaryChecksum *checksum) {
+	uint64_t hash = checksum->size;
+	size_t i;
+	for (i = 0; i < CHECKSUM_LANES; ++i) {
+		hash = mix_hash(hash ^ checksum->lanes[i]);
+	}
+	return mix_hash(hash_bytes(hash, (const char *) checksum->pending, checksum->pending_len));
+}
+
+/*
+ * Append the given bytes to the buffer, and to the checksum of the file.
+ */
+static void binary_append(struct SaveBuffer *buf, struct BinaryChecksum *checksum, const void *data, size_t len) {
+	checksum_add(checksum, data, len);
+	save_append(buf, data, len);
+}
+
+/*
+ * Write the settings in the binary format into the buffer, and flush it.
+ * Returns 1 on success, or 0 on failure.
+ */
+static int save_binary(Settings *settings, struct SaveBuffer *buf) {
+	struct BinaryHeader header;
+	struct BinaryEntry entry;
+	struct BinaryChecksum checksum;
+	struct Pair *pair;
+	uint64_t sum;
+	uint32_t *table;
+	uint64_t offset = 0;
+	size_t count = 0;
+	size_t table_size = INDEX_MIN_CAPACITY;
+	size_t position;
+	size_t i;
+
+	/* Count the pairs and the size of the string pool */
+	for (position = 0; (pair = next_listed(settings, &position)) != NULL; ) {
+		const size_t key_len = pair->key_len;
+		if (key_len > UINT32_MAX || pair->value->len > UINT32_MAX || count == UINT32_MAX - 1) {
+			return 0; /* Too large for the format */
+		}
+		offset += key_len + 1 + pair->value->len + 1;
+		++count;
+	}
+	while (count * 2 > table_size) {
+		table_size *= 2;
+	}
+
+	/* Build the hash table, probing the same way as the index */
+	if (!(table = memory_malloc(table_size * sizeof(uint32_t)))) {
+		return 0;
+	}
+	memset(table, 0, table_size * sizeof(uint32_t));
+	for (position = 0, i = 0; (pair = next_listed(settings, &position)) != NULL; ++i) {
+		size_t slot = pair->hash & (table_size - 1);
+		while (table[slot] != 0) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		table[slot] = (uint32_t) (i + 1); /* 0 marks an empty slot */
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+	header.version = BINARY_VERSION;
+	header.byte_order = BINARY_BYTE_ORDER;
+	header.hash_bits = sizeof(size_t) * CHAR_BIT;
+	header.count = count;
+	header.table_size = table_size;
+	header.strings_size = offset;
+	header.file_size = sizeof(header) + count * sizeof(entry) + table_size * sizeof(uint32_t) + offset + sizeof(sum);
+	checksum_init(&checksum);
+	binary_append(buf, &checksum, &header, sizeof(header));
+
+	/* Entries, with the values parsed up front */
+	offset = 0;
+	memset(&entry, 0, sizeof(entry));
+	for (position = 0; (pair = next_listed(settings, &position)) != NULL; ) {
+		entry.hash = pair->hash;
+		entry.key_len = (uint32_t) pair->key_len;
+		entry.value_len = (uint32_t) pair->value->len;
+		entry.key_offset = offset;
+		entry.value_offset = offset + entry.key_len + 1;
+		entry.int_value = value_int64(pair->value);
+		entry.float_value = value_float(pair->value);
+		entry.double_value = value_double(pair->value);
+		offset = entry.value_offset + entry.value_len + 1;
+		binary_append(buf, &checksum, &entry, sizeof(entry));
+	}
+
+	binary_append(buf, &checksum, table, table_size * sizeof(uint32_t));
+	memory_free(table);
+
+	/* String pool */
+	for (position = 0; (pair = next_listed(settings, &position)) != NULL; ) {
+		binary_append(buf, &checksum, pair->key, pair->key_len + 1);
+		binary_append(buf, &checksum, pair->value->str, pair->value->len);
+		binary_append(buf, &checksum, "", 1);
+	}
+
+	sum = checksum_end(&checksum);
+	save_append(buf, (const char *) &sum, sizeof(sum));
+	save_flush(buf);
+	return !buf->error;
+}
+
+int settings_save_binary(Settings *settings, const char *path) {
+	TRACE_BEGIN(trace_start);
+	int result;
+
+	/* Settings and path are mandatory, and the table does not span shards or layers */
+	if (settings == NULL || path == NULL || settings->shards != NULL || settings->layers != NULL) {
+		return 0;
+	}
+
+	result = save_file(settings, path, save_binary);
+	count_op(settings, STAT_SAVE, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_SAVE, trace_start);
+	return result;
+}
+
+#ifdef HAVE_POSIX
+/*
+ * Check that the header of a mapped binary file is valid, that the file
+ * is exactly as large as the header describes, and that its checksum
+ * matches. Returns 1 if the file is valid, 0 otherwise.
+ */
+static int check_binary_header(const struct BinaryHeader *header, size_t size) {
+	struct BinaryChecksum checksum;
+	uint64_t remaining, sum;
+
+	if (size < sizeof(struct BinaryHeader)
+			|| memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != BINARY_VERSION
+			|| header->byte_order != BINARY_BYTE_ORDER
+			|| header->file_size != size) {
+		return 0;
+	}
+
+	/* Check the sizes one by one, so that nothing can overflow */
+	remaining = size - sizeof(struct BinaryHeader);
+	if (header->count >= UINT32_MAX || header->count > remaining / sizeof(struct BinaryEntry)) {
+		return 0;
+	}
+	remaining -= header->count * sizeof(struct BinaryEntry);
+	if (header->table_size == 0 || (header->table_size & (header->table_size - 1)) != 0
+			|| header->table_size < header->count * 2
+			|| header->table_size > remaining / sizeof(uint32_t)) {
+		return 0;
+	}
+	remaining -= header->table_size * sizeof(uint32_t);
+	if (remaining < sizeof(uint64_t) || header->strings_size != remaining - sizeof(uint64_t)) {
+		return 0;
+	}
+
+	/* Nothing is trusted until the checksum matches */
+	checksum_init(&checksum);
+	checksum_add(&checksum, header, size - sizeof(uint64_t));
+	memcpy(&sum, (const char *) header + size - sizeof(uint64_t), sizeof(sum));
+	return checksum_end(&checksum) == sum;
+}
+
+/*
+ * Check that the given string lies within the string pool,
+ * and is terminated right after its length.
+ * Returns 1 if the string is valid, 0 otherwise.
+ */
+static int check_binary_string(const char *strings, uint64_t strings_size, uint64_t offset, uint32_t len) {
+	return offset < strings_size && len < strings_size - offset && strings[offset + len] == '\0';
+}
+
+/*
+ * Set up the pairs for the entries of a binary file in one block,
+ * pointing straight at the string pool, and link them into the list.
+ * If the settings are empty, the stored hash table becomes the index
+ * as is. Otherwise, each pair is merged in as if it was set.
+ * Returns 1 on success, or 0 on failure (e.g. if the file is invalid).
+ */
+static int load_binary(Settings *settings, struct Mapping *mapping) {
+	const struct BinaryHeader *header = mapping->addr;
+	const struct BinaryEntry *entries = (const struct BinaryEntry *) (header + 1);
+	const uint32_t *table = (const uint32_t *) (entries + header->count);
+	const char *strings = (const char *) (table + header->table_size);
+	const size_t stride = ALIGN_UP(EMBEDDED_VALUE_OFFSET(0) + value_size(0));
+	const size_t count = header->count;
+	/* Stored hashes can only be used if they are at least as wide as ours */
+	const int use_hashes = header->hash_bits >= sizeof(size_t) * CHAR_BIT;
+	struct Index *old_index;
+	struct Index *index;
+	char *block = NULL;
+	int valid = 1;
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (!check_binary_string(strings, header->strings_size, entries[i].key_offset, entries[i].key_len)
+				|| !check_binary_string(strings, header->strings_size,
+					entries[i].value_offset, entries[i].value_len)) {
+			return 0;
+		}
+	}
+
+	if (settings->count > 0 || !use_hashes || settings->use_arena || settings->shards != NULL) {
+		/* Merge into the existing pairs, borrowing the strings */
+		for (i = 0; i < count; ++i) {
+			if (!set_value(settings, strings + entries[i].key_offset, entries[i].key_len,
+					strings + entries[i].value_offset, entries[i].value_len, 1, NULL)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	/* One block for all the pairs, each with its embedded value */
+	if (!list_reserve(settings, count)) {
+		return 0;
+	}
+	if (count > 0 && !(block = memory_malloc(count * stride))) {
+		return 0;
+	}
+	if (!(index = index_create(header->table_size))) {
+		memory_free(block);
+		return 0;
+	}
+
+	/* Place the pairs into the index, making sure that each is there once */
+	for (i = 0; i < count; ++i) {
+		((struct Pair *) (block + i * stride))->value = NULL;
+	}
+	for (i = 0; i < header->table_size; ++i) {
+		const uint32_t n = table[i];
+		struct Pair *pair = NULL;
+		if (n > 0) {
+			pair = n <= count ? (struct Pair *) (block + (n - 1) * stride) : NULL;
+			if (pair == NULL || pair->value != NULL) {
+				/* Out of range, or in the table twice */
+				valid = 0;
+				break;
+			}
+			pair->value = embedded_value(pair, 0);
+		}
+		index->slots[i] = pair;
+	}
+	for (i = 0; i < count && valid; ++i) {
+		/* Every pair must be in the table */
+		valid = ((struct Pair *) (block + i * stride))->value != NULL;
+	}
+	if (!valid) {
+		memory_free(block);
+		memory_free(index);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct Pair *pair = (struct Pair *) (block + i * stride);
+		struct Value *value = pair->value;
+		pair->key = (char *) strings + entries[i].key_offset;
+		pair->key_len = entries[i].key_len;
+		pair->hash = (size_t) entries[i].hash;
+		pair->flags = PAIR_IN_BLOCK;
+		value->str = strings + entries[i].value_offset;
+		value->len = entries[i].value_len;
+		value->flags = VALUE_EMBEDDED;
+		value->int_value = entries[i].int_value;
+		value->float_value = entries[i].float_value;
+		value->double_value = entries[i].double_value;
+		value->cached = CACHED_INT | CACHED_FLOAT | CACHED_DOUBLE;
+		append_pair(settings, pair);
+		note_change(settings, pair);
+	}
+	for (i = 0; i < header->table_size; ++i) {
+		if (index->slots[i] != NULL) {
+			index->hashes[i] = index->slots[i]->hash;
+		}
+	}
+
+	/* Publish the new index, and let go of the old one (which only has tombstones) */
+	mapping->pairs = count > 0 ? block : NULL;
+	settings->count = count;
+	settings->used = count;
+	old_index = settings->index;
+	store_release(&settings->index, index);
+	retire(settings, old_index, RETIRED_INDEX);
+	next_generation(settings);
+
+	return 1;
+}
+#endif
+
+int settings_load_binary(Settings *settings, const char *path) {
+#ifdef HAVE_POSIX
+	TRACE_BEGIN(trace_start);
+	struct Mapping *mapping;
+	struct stat st;
+	void *addr;
+	int result;
+	int fd;
+
+	/* Settings and path are required, and frozen settings cannot change */
+	if (settings == NULL || path == NULL || settings->frozen != NULL) {
+		return 0;
+	}
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct BinaryHeader)) {
+		close(fd);
+		return 0;
+	}
+
+	/* The strings are only read, so the mapping can be shared with the page cache */
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return 0;
+	}
+	if (!check_binary_header(addr, st.st_size)
+			|| !(mapping = memory_malloc(sizeof(struct Mapping)))) {
+		munmap(addr, st.st_size);
+		return 0;
+	}
+	mapping->addr = addr;
+	mapping->size = st.st_size;
+	mapping->pairs = NULL;
+
+	/* Keep the mapping until the settings are freed, since pairs borrow from it */
+	mapping->next = settings->mappings;
+	settings->mappings = mapping;
+
+	result = load_binary(settings, mapping);
+	count_op(settings, STAT_LOAD, result != 0);
+	TRACE_END(settings, SETTINGS_TRACE_LOAD, trace_start);
+	notify(settings, NULL);
+	return result;
+#else
+	/* No memory mapping on this platform */
+	(void) settings;
+	(void) path;
+	return 0;
+#endif
+}
+
+/*
+ * Pick the displacements of a frozen table for the pairs of the given list,
+ * and put the pairs into their slots.
+ *
+ * The largest buckets are placed first, while most slots are still free.
+ * Each bucket tries displacements in turn until its keys land in free
+ * slots that are all different. A try succeeds with about the chance that
+ * a slot is free, so even the last key takes count tries on average.
+ * Returns 1 on success, or 0 if out of memory or if two keys have the same hash.
+ */
+static int place_frozen(struct Frozen *frozen, const struct ListEntry *list) {
+	const size_t count = frozen->count;
+	const size_t buckets = frozen->bucket_count;
+	const uint64_t limit = (uint64_t) count * 64 + 1024 < UINT32_MAX ? (uint64_t) count * 64 + 1024 : UINT32_MAX;
+	uint64_t *mixed;
+	size_t *order;   /* The keys sorted by bucket */
+	size_t *starts;  /* Where the keys of each bucket start in order */
+	size_t *by_size; /* The buckets sorted by size, largest first */
+	size_t *sizes;   /* Number of buckets of each size, then where they start in by_size */
+	size_t *placed;  /* Slot of each key in order */
+	unsigned char *taken; /* One bit for each slot, so that it stays in the cache */
+	int result = 1;
+	size_t i;
+	size_t j;
+
+	mixed = memory_malloc(count * sizeof(uint64_t) + (3 * count + 2 * buckets + 4) * sizeof(size_t) + count / CHAR_BIT + 1);
+	if (mixed == NULL) {
+		return 0;
+	}
+	order = (size_t *) (mixed + count);
+	starts = order + count;
+	by_size = starts + buckets + 2;
+	sizes = by_size + buckets;
+	placed = sizes + count + 2;
+	taken = (unsigned char *) (placed + count);
+	memset(starts, 0, (buckets + 2) * sizeof(size_t));
+	memset(sizes, 0, (count + 2) * sizeof(size_t));
+	memset(taken, 0, count / CHAR_BIT + 1);
+
+	/* Sort the keys by bucket, counting the keys of bucket b in starts[b + 2] first */
+	for (i = 0; i < count; ++i) {
+		mixed[i] = mix_hash(list[i].pair->hash);
+		++starts[reduce_range(mixed[i], buckets) + 2];
+	}
+	for (i = 2; i < buckets + 2; ++i) {
+		starts[i] += starts[i - 1];
+	}
+	for (i = 0; i < count; ++i) {
+		order[starts[reduce_range(mixed[i], buckets) + 1]++] = i;
+	}
+
+	/* Sort the buckets by size, largest first */
+	for (i = 0; i < buckets; ++i) {
+		++sizes[count - (starts[i + 1] - starts[i]) + 1];
+	}
+	for (i = 1; i < count + 2; ++i) {
+		sizes[i] += sizes[i - 1];
+	}
+	for (i = 0; i < buckets; ++i) {
+		by_size[sizes[count - (starts[i + 1] - starts[i])]++] = i;
+	}
+
+	for (i = 0; i < buckets && result; ++i) {
+		const size_t bucket = by_size[i];
+		const size_t first = starts[bucket];
+		const size_t last = starts[bucket + 1];
+		uint64_t displacement = 0;
+		size_t k;
+
+		/* Keys with the same hash always land in the same slot */
+		for (j = first; j < last && result; ++j) {
+			for (k = j + 1; k < last; ++k) {
+				if (mixed[order[j]] == mixed[order[k]]) {
+					result = 0;
+					break;
+				}
+			}
+		}
+		while (result) {
+			for (j = first; j < last; ++j) {
+				const size_t slot = frozen_slot(mixed[order[j]], (uint32_t) displacement, count);
+				if (taken[slot / CHAR_BIT] & (1u << (slot % CHAR_BIT))) {
+					break;
+				}
+				taken[slot / CHAR_BIT] |= (unsigned char) (1u << (slot % CHAR_BIT));
+				placed[j] = slot;
+			}
+			if (j == last) {
+				break;
+			}
+			/* Give back the slots of this try */
+			while (j > first) {
+				--j;
+				taken[placed[j] / CHAR_BIT] &= (unsigned char) ~(1u << (placed[j] % CHAR_BIT));
+			}
+			if (++displacement > limit) {
+				result = 0;
+			}
+		}
+		frozen->displacements[bucket] = (uint32_t) displacement;
+	}
+
+	for (i = 0; i < count && result; ++i) {
+		frozen->slots[placed[i]].hash = list[order[i]].pair->hash;
+		frozen->slots[placed[i]].pair = list[order[i]].pair;
+	}
+	memory_free(mixed);
+	return result;
+}
+
+/*
+ * Compare two pairs by their keys, for sorting with qsort.
+ */
+static int compare_pairs(const void *a, const void *b) {
+	return strcmp((*(struct Pair *const *) a)->key, (*(struct Pair *const *) b)->key);
+}
+
+/*
+ * Get the bytes that a copy of the given pair takes in the block of a
+ * frozen table, with its key inline and its value embedded.
+ */
+static size_t frozen_pair_size(const struct Pair *pair) {
+	return block_pair_size(pair->key_len, pair->value->len);
+}
+
+/*
+ * Copy the given pair and its value into the given memory of a frozen
+ * block. Every typed value is cached, so readers never write to the copy.
+ * Returns the copy.
+ */
+static struct Pair *copy_frozen_pair(Settings *settings, void *memory, const struct Pair *from) {
+	const struct Value *from_value = from->value;
+	struct Pair *pair = memory;
+	struct Value *value;
+
+	pair->key = (char *) (pair + 1);
+	memcpy(pair->key, from->key, from->key_len);
+	pair->key[from->key_len] = '\0';
+	pair->key_len = from->key_len;
+	pair->hash = from->hash;
+	pair->flags = PAIR_IN_BLOCK;
+	pair->units = 0;
+	pair->position = from->position;
+
+	value = new_value(settings, embedded_value(pair, from->key_len + 1), from_value->str, from_value->len);
+	value->cached = from_value->cached;
+	value->int_value = from_value->int_value;
+	value->float_value = from_value->float_value;
+	value->double_value = from_value->double_value;
+	value_int64(value);
+	value_float(value);
+	value_double(value);
+	pair->value = value;
+	return pair;
+}
+
+int settings_freeze(Settings *settings) {
+	struct Frozen *frozen;
+	struct Pair **sorted;
+	char *block;
+	size_t table_size;
+	size_t size;
+	size_t count;
+	size_t buckets;
+	size_t i;
+
+	if (settings == NULL || settings->shards != NULL) {
+		return 0;
+	}
+	if (settings->frozen != NULL) {
+		return 1; /* Already frozen */
+	}
+
+	/* The slots point into the list while placing, and the copies keep its positions */
+	compact_list(settings);
+	count = settings->list_len;
+	if (count >= UINT32_MAX) {
+		return 0;
+	}
+	buckets = count / FROZEN_BUCKET_SIZE + 1;
+	table_size = ALIGN_UP(sizeof(struct Frozen) + (count + 1) * sizeof(struct FrozenSlot) + buckets * sizeof(uint32_t));
+	size = table_size;
+	for (i = 0; i < count; ++i) {
+		size += frozen_pair_size(settings->list[i].pair);
+	}
+	if (!(frozen = memory_malloc(size))) {
+		return 0;
+	}
+	/* Readers cannot sort the keys for settings_foreach_prefix later on, so it is done here */
+	if (!(sorted = memory_malloc((count > 0 ? count : 1) * sizeof(struct Pair *)))) {
+		memory_free(frozen);
+		return 0;
+	}
+	frozen->count = count;
+	frozen->bucket_count = buckets;
+	frozen->displacements = (uint32_t *) &frozen->slots[count + 1];
+	frozen->table_size = table_size;
+	frozen->size = size;
+	/* Without pairs, the only slot stays empty */
+	frozen->slots[0].hash = 0;
+	frozen->slots[0].pair = NULL;
+	memset(frozen->displacements, 0, buckets * sizeof(uint32_t));
+	if (!place_frozen(frozen, settings->list)) {
+		memory_free(sorted);
+		memory_free(frozen);
+		return 0;
+	}
+
+	/* Copy the pairs into the block in slot order, and point the list at the copies */
+	block = (char *) frozen + table_size;
+	for (i = 0; i < count; ++i) {
+		struct Pair *pair = copy_frozen_pair(settings, block, frozen->slots[i].pair);
+		block += frozen_pair_size(pair);
+		settings->list[pair->position].pair = pair;
+		frozen->slots[i].pair = pair;
+		sorted[i] = pair;
+	}
+	qsort(sorted, count, sizeof(struct Pair *), compare_pairs);
+
+	/* Let go of everything the pairs were in before, since nothing can be changed anymore */
+	free_pairs(settings);
+	release_free_lists(settings);
+	list_shrink(settings);
+	memory_free(settings->sorted);
+	settings->sorted = sorted;
+	settings->sorted_count = count;
+	settings->sorted_capacity = count > 0 ? count : 1;
+	settings->sorted_stale = 0;
+	memory_free(settings->stream_buf);
+	settings->stream_buf = NULL;
+	settings->stream_size = 0;
+	settings->count = count;
+	settings->used = count;
+	settings->frozen = frozen;
+	next_generation(settings);
+	return 1;
+}
+
+const char *settings_get_string(Settings *settings, const char *key, const char *default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const char *const result = settings_get_string(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = find_value(settings, key);
+	if (value != NULL) {
+		return value->str;
+	}
+	return default_value;
+}
+
+const char *settings_get_string_n(Settings *settings, const char *key, size_t key_len,
+		const char *default_value, size_t *value_len) {
+	struct Value *value = NULL;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, key_len);
+		const char *const result = settings_get_string_n(lock_shard(shard), key, key_len, default_value, value_len);
+		unlock_shard(shard);
+		return result;
+	}
+	if (settings != NULL && key != NULL) {
+		value = find_value_n(settings, key, key_len);
+	}
+	if (value != NULL) {
+		if (value_len != NULL) {
+			*value_len = value->len;
+		}
+		return value->str;
+	}
+	if (value_len != NULL) {
+		*value_len = default_value != NULL ? strlen(default_value) : 0;
+	}
+	return default_value;
+}
+
+int settings_get_int(Settings *settings, const char *key, int default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const int result = settings_get_int(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = find_value(settings, key);
+	if (value != NULL) {
+		return value_int(value);
+	}
+	return default_value;
+}
+
+float settings_get_float(Settings *settings, const char *key, float default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const float result = settings_get_float(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = find_value(settings, key);
+	if (value != NULL) {
+		return value_float(value);
+	}
+	return default_value;
+}
+
+double settings_get_double(Settings *settings, const char *key, double default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const double result = settings_get_double(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = find_value(settings, key);
+	if (value != NULL) {
+		return value_double(value);
+	}
+	return default_value;
+}
+
+int64_t settings_get_int64(Settings *settings, const char *key, int64_t default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const int64_t result = settings_get_int64(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = find_value(settings, key);
+	if (value != NULL) {
+		return value_int64(value);
+	}
+	return default_value;
+}
+
+int settings_set_string(Settings *settings, const char *key, const char *value) {
+	if (settings == NULL || key == NULL || value == NULL) {
+		/* Settings, key, and value are mandatory */
+		return 0;
+	}
+	return set_key(settings, key, strlen(key), value, strlen(value), NULL);
+}
+
+int settings_set_string_n(Settings *settings, const char *key, size_t key_len,
+		const char *value, size_t value_len) {
+	if (settings == NULL || key == NULL || value == NULL) {
+		/* Settings, key, and value are mandatory */
+		return 0;
+	}
+	return set_key(settings, key, key_len, value, value_len, NULL);
+}
+
+int settings_set_int(Settings *settings, const char *key, int value) {
+	struct Typed typed;
+
+	/* Convert int to string */
+	char value_str[INT64_CHARS];
+	const size_t len = format_int64(value_str, value);
+
+	/* Save the string, and keep the int so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_INT;
+	typed.int_value = value;
+	return set_key(settings, key, strlen(key), value_str, len, &typed);
+}
+
+int settings_set_float(Settings *settings, const char *key, float value) {
+	struct Typed typed;
+
+	/* Convert float to string */
+	char value_str[NUMBER_CHARS];
+	const size_t len = format_float(value_str, value);
+
+	/* Save the string, and keep the float so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_FLOAT;
+	typed.float_value = value;
+	return set_key(settings, key, strlen(key), value_str, len, &typed);
+}
+
+int settings_set_double(Settings *settings, const char *key, double value) {
+	struct Typed typed;
+
+	/* Convert double to string */
+	char value_str[NUMBER_CHARS];
+	const size_t len = format_double(value_str, value);
+
+	/* Save the string, and keep the double so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_DOUBLE;
+	typed.double_value = value;
+	return set_key(settings, key, strlen(key), value_str, len, &typed);
+}
+
+int settings_set_int64(Settings *settings, const char *key, int64_t value) {
+	struct Typed typed;
+
+	/* Convert integer to string */
+	char value_str[INT64_CHARS];
+	const size_t len = format_int64(value_str, value);
+
+	/* Save the string, and keep the integer so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_INT;
+	typed.int_value = value;
+	return set_key(settings, key, strlen(key), value_str, len, &typed);
+}
+
+/*
+ * Calculate the lengths and hashes of a batch of keys, and prefetch
+ * the index slots and hashes where probing for them starts.
+ */
+static void hash_batch(Settings *settings, const char *const keys[], size_t n,
+		size_t lens[], size_t hashes[]) {
+	const struct Index *index = load_acquire(&settings->index);
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		lens[i] = strlen(keys[i]);
+		hashes[i] = hash_key(keys[i], lens[i]);
+		if (index != NULL) {
+			prefetch(&index->slots[hashes[i] & (index->capacity - 1)]);
+			prefetch(&index->hashes[hashes[i] & (index->capacity - 1)]);
+		}
+	}
+}
+
+size_t settings_get_many(Settings *settings, const char *const keys[], size_t n, const char *out[]) {
+	size_t lens[BATCH_SIZE];
+	size_t hashes[BATCH_SIZE];
+	size_t found = 0;
+	size_t i;
+	size_t j;
+
+	if (out == NULL) {
+		return 0;
+	}
+	if (settings == NULL || keys == NULL) {
+		for (i = 0; i < n; ++i) {
+			out[i] = NULL;
+		}
+		return 0;
+	}
+	if (settings->shards != NULL) {
+		/* The keys may be in different shards, so take them one at a time */
+		for (i = 0; i < n; ++i) {
+			out[i] = keys[i] != NULL ? settings_get_string(settings, keys[i], NULL) : NULL;
+			found += out[i] != NULL;
+		}
+		return found;
+	}
+
+	for (i = 0; i < n; i += BATCH_SIZE) {
+		const size_t batch = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		size_t valid = 0;
+		size_t hits = 0;
+		/* Missing keys are NULL, and just not found */
+		for (j = 0; j < batch; ++j) {
+			valid += keys[i + j] != NULL;
+		}
+		if (valid < batch) {
+			for (j = 0; j < batch; ++j) {
+				struct Value *value = find_value(settings, keys[i + j]);
+				out[i + j] = value != NULL ? value->str : NULL;
+				found += value != NULL;
+			}
+			continue;
+		}
+
+		/* Hash the whole batch first, so that the slots are loading meanwhile */
+		hash_batch(settings, keys + i, batch, lens, hashes);
+		for (j = 0; j < batch; ++j) {
+			struct Pair *pair = find_pair(settings, keys[i + j], lens[j], hashes[j], NULL);
+			struct Value *value = pair != NULL ? load_acquire(&pair->value) : NULL;
+			if (value == NULL && settings->layers != NULL) {
+				value = find_in_layers(settings, keys[i + j], lens[j], hashes[j]);
+			}
+			out[i + j] = value != NULL ? value->str : NULL;
+			hits += value != NULL;
+		}
+		count_op(settings, STAT_GET_HIT, hits);
+		count_op(settings, STAT_GET_MISS, batch - hits);
+		found += hits;
+	}
+
+	return found;
+}
+
+int settings_set_many(Settings *settings, const char *const keys[], const char *const values[], size_t n) {
+	size_t lens[BATCH_SIZE];
+	size_t hashes[BATCH_SIZE];
+	size_t i;
+	size_t j;
+
+	/* Settings, keys, and values are mandatory, and frozen settings cannot change */
+	if (settings == NULL || (n > 0 && (keys == NULL || values == NULL)) || settings->frozen != NULL) {
+		return 0;
+	}
+	for (i = 0; i < n; ++i) {
+		if (keys[i] == NULL || values[i] == NULL) {
+			return 0;
+		}
+	}
+	if (settings->shards != NULL) {
+		/* The keys may be in different shards, so take them one at a time */
+		for (i = 0; i < n; ++i) {
+			if (!settings_set_string(settings, keys[i], values[i])) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	/* Make room for all of them at once, in case they are all new */
+	if (!index_reserve(settings, n) || !list_reserve(settings, n)) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i += BATCH_SIZE) {
+		const size_t batch = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		hash_batch(settings, keys + i, batch, lens, hashes);
+		for (j = 0; j < batch; ++j) {
+			const char *value = values[i + j];
+			if (!set_hashed_value(settings, keys[i + j], lens[j], hashes[j],
+					value, strlen(value), 0, NULL)) {
+				count_op(settings, STAT_SET, i + j);
+				notify(settings, NULL);
+				return 0;
+			}
+		}
+	}
+	count_op(settings, STAT_SET, n);
 
-	/* Save the string */
-	return settings_set_string(settings, key, value_str);
+	notify(settings, NULL);
+	return 1;
 }
 
 int settings_remove(Settings *settings, const char *key) {
-	struct Pair *pair = find_pair(settings, key);
+	TRACE_BEGIN(trace_start);
+	struct Pair **slot = NULL;
 
-	if (pair != NULL) {
-		/* Update prev of the next pair */
-		if (pair->next != NULL) {
-			pair->next->prev = pair->prev;
-		} else {
-			/* No next pair, so this must be the last */
-			settings->last = pair->prev;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_key(settings, key, strlen(key));
+		const int result = settings_remove(lock_shard(shard), key);
+		unlock_shard(shard);
+		return result;
+	}
+
+	if (settings != NULL && key != NULL && settings->frozen == NULL) {
+		const size_t len = strlen(key);
+		slot = find_slot(settings, key, len, hash_key(key, len));
+	}
+
+	if (slot != NULL && (*slot)->value != NULL) {
+		remove_pair(settings, slot);
+		count_op(settings, STAT_REMOVE, 1);
+		notify(settings, key);
+		TRACE_END(settings, SETTINGS_TRACE_REMOVE, trace_start);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Check if the given pair of a layer of an overlay is hidden by a value
+ * for its key in the overlay itself or in one of the layers above.
+ */
+static int overlay_shadows(Settings *settings, size_t layer, const struct Pair *pair) {
+	struct Pair *found = find_pair(settings, pair->key, pair->key_len, pair->hash, NULL);
+	size_t i;
+	for (i = 0; (found == NULL || load_acquire(&found->value) == NULL) && i < layer; ++i) {
+		found = find_pair(settings->layers[i], pair->key, pair->key_len, pair->hash, NULL);
+	}
+	return found != NULL && load_acquire(&found->value) != NULL;
+}
+
+/*
+ * Get the settings that an iterator is going through at the moment,
+ * which is the current shard of sharded settings, or the current layer
+ * of an overlay after its own keys.
+ */
+static Settings *iter_settings(const SettingsIter *iter) {
+	Settings *settings = iter->settings;
+	if (settings != NULL && settings->shards != NULL) {
+		return settings->shards[iter->shard].settings;
+	}
+	return settings != NULL && iter->layer > 0 ? settings->layers[iter->layer - 1] : settings;
+}
+
+void settings_iter_begin(Settings *settings, SettingsIter *iter) {
+	if (iter != NULL) {
+		iter->key = NULL;
+		iter->key_len = 0;
+		iter->value = NULL;
+		iter->value_len = 0;
+		iter->settings = settings;
+		iter->position = 0;
+		iter->seq = 0;
+		iter->shard = 0;
+		iter->layer = 0;
+		iter->compactions = settings != NULL ? iter_settings(iter)->compactions : 0;
+	}
+}
+
+int settings_iter_next(SettingsIter *iter) {
+	Settings *settings;
+	struct Pair *pair;
+
+	if (iter == NULL || iter->settings == NULL) {
+		return 0;
+	}
+
+	settings = iter_settings(iter);
+
+	if (iter->compactions != settings->compactions) {
+		/* The list has moved, so find the first entry after the one visited last */
+		size_t low = 0;
+		size_t high = settings->list_len;
+		while (low < high) {
+			const size_t mid = low + (high - low) / 2;
+			if (settings->list[mid].seq <= iter->seq) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		iter->position = low;
+		iter->compactions = settings->compactions;
+	}
+
+	for (;;) {
+		pair = next_listed(settings, &iter->position);
+		if (pair != NULL) {
+			/* Keys of a layer that are set higher up were visited already */
+			if (iter->layer == 0 || !overlay_shadows(iter->settings, iter->layer - 1, pair)) {
+				break;
+			}
+			continue;
 		}
-		/* Update next of the prev pair */
-		if (pair->prev != NULL) {
-			pair->prev->next = pair->next;
+		if (iter->settings->shards != NULL && iter->shard + 1 < iter->settings->shard_count) {
+			/* Carry on with the next shard */
+			++iter->shard;
+		} else if (iter->layer < iter->settings->layer_count) {
+			/* Carry on with the next layer */
+			++iter->layer;
 		} else {
-			/* No previous pair, so this must be the first one */
-			settings->first = pair->next;
+			break;
+		}
+		settings = iter_settings(iter);
+		iter->position = 0;
+		iter->seq = 0;
+		iter->compactions = settings->compactions;
+	}
+	if (pair == NULL) {
+		iter->key = NULL;
+		iter->key_len = 0;
+		iter->value = NULL;
+		iter->value_len = 0;
+		return 0;
+	}
+
+	iter->seq = settings->list[iter->position - 1].seq;
+	iter->key = pair->key;
+	iter->key_len = pair->key_len;
+	iter->value = pair->value->str;
+	iter->value_len = pair->value->len;
+	return 1;
+}
+
+/*
+ * Rebuild the sorted array of pairs if it is stale, and start counting
+ * the changes that it follows one by one again. Frozen settings sorted
+ * theirs when freezing, and never rebuild it, since any number of
+ * threads may be reading it.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int sort_pairs(Settings *settings) {
+	const size_t count = settings->listed;
+	size_t position = 0;
+	struct Pair **sorted;
+	struct Pair *pair;
+
+	if (!settings->sorted_stale) {
+		if (settings->frozen == NULL) {
+			settings->sorted_changes = 0;
 		}
-		memory_free(pair);
 		return 1;
 	}
 
-	return 0;
+	sorted = memory_realloc(settings->sorted, (count > 0 ? count : 1) * sizeof(struct Pair *));
+	if (sorted == NULL) {
+		return 0;
+	}
+	settings->sorted = sorted;
+	settings->sorted_count = count;
+	settings->sorted_capacity = count > 0 ? count : 1;
+	settings->sorted_changes = 0;
+	while ((pair = next_listed(settings, &position)) != NULL) {
+		*sorted++ = pair;
+	}
+	qsort(settings->sorted, count, sizeof(struct Pair *), compare_pairs);
+	settings->sorted_stale = 0;
+	return 1;
+}
+
+/* A callback of settings_foreach_prefix, passed on shard by shard or layer by layer */
+struct ShardCallback {
+	SettingsCallback callback;
+	void *ctx;
+	int stopped;
+	Settings *overlay; /* The overlay whose layer is being visited, if any */
+	size_t layer;
+};
+
+/*
+ * Call the callback of a sharded settings_foreach_prefix, and remember
+ * if it asked to stop, so that the other shards are skipped.
+ */
+static int call_shard_callback(const char *key, const char *value, void *ctx) {
+	struct ShardCallback *shard_callback = ctx;
+	shard_callback->stopped = !shard_callback->callback(key, value, shard_callback->ctx);
+	return !shard_callback->stopped;
+}
+
+/*
+ * Call the callback of settings_foreach_prefix on an overlay for a key of
+ * one of its layers, unless the key is set higher up and was visited already.
+ */
+static int call_layer_callback(const char *key, const char *value, void *ctx) {
+	struct ShardCallback *shard_callback = ctx;
+	const size_t len = strlen(key);
+	const size_t hash = hash_key(key, len);
+	struct Pair *pair = find_pair(shard_callback->overlay->layers[shard_callback->layer], key, len, hash, NULL);
+	if (pair != NULL && overlay_shadows(shard_callback->overlay, shard_callback->layer, pair)) {
+		return 1;
+	}
+	return call_shard_callback(key, value, ctx);
+}
+
+/*
+ * Call the callback for each key of the settings' own table that starts
+ * with the prefix, in sorted order, until it asks to stop.
+ * Returns 1 on success, or 0 if out of memory.
+ */
+static int foreach_sorted(Settings *settings, const char *prefix, SettingsCallback callback, void *ctx) {
+	size_t prefix_len;
+	size_t low;
+
+	if (!sort_pairs(settings)) {
+		return 0;
+	}
+
+	/* All the keys with the prefix follow the first key that is not less than it */
+	low = sorted_position(settings, prefix);
+	prefix_len = strlen(prefix);
+	for (; low < settings->sorted_count; ++low) {
+		struct Pair *pair = settings->sorted[low];
+		if (strncmp(pair->key, prefix, prefix_len) != 0
+				|| !callback(pair->key, pair->value->str, ctx)) {
+			break;
+		}
+	}
+
+	return 1;
+}
+
+int settings_foreach_prefix(Settings *settings, const char *prefix, SettingsCallback callback, void *ctx) {
+	/* Settings, prefix, and callback are mandatory */
+	if (settings == NULL || prefix == NULL || callback == NULL) {
+		return 0;
+	}
+	if (settings->shards != NULL) {
+		/* Each shard is in order, but the shards are visited one after the other */
+		struct ShardCallback shard_callback;
+		int result = 1;
+		size_t i;
+		shard_callback.callback = callback;
+		shard_callback.ctx = ctx;
+		shard_callback.stopped = 0;
+		shard_callback.overlay = NULL;
+		for (i = 0; i < settings->shard_count && result && !shard_callback.stopped; ++i) {
+			result = settings_foreach_prefix(lock_shard(&settings->shards[i]), prefix, call_shard_callback, &shard_callback);
+			unlock_shard(&settings->shards[i]);
+		}
+		return result;
+	}
+	if (settings->layers != NULL) {
+		/* First its own keys, and then those of each layer that are not set higher up */
+		struct ShardCallback shard_callback;
+		int result;
+		size_t i;
+		shard_callback.callback = callback;
+		shard_callback.ctx = ctx;
+		shard_callback.stopped = 0;
+		shard_callback.overlay = settings;
+		result = foreach_sorted(settings, prefix, call_shard_callback, &shard_callback);
+		for (i = 0; i < settings->layer_count && result && !shard_callback.stopped; ++i) {
+			shard_callback.layer = i;
+			result = foreach_sorted(settings->layers[i], prefix, call_layer_callback, &shard_callback);
+		}
+		return result;
+	}
+	return foreach_sorted(settings, prefix, callback, ctx);
+}
+
+SettingsKey *settings_key_intern(Settings *settings, const char *key) {
+	struct Pair *pair;
+	size_t len;
+
+	if (settings == NULL || key == NULL) {
+		return NULL;
+	}
+
+	len = strlen(key);
+	if (settings->shards != NULL) {
+		/* The handle points into the shard, and remembers its hash for finding it again */
+		struct Shard *shard = shard_for_hash(settings, hash_key(key, len));
+		SettingsKey *handle = settings_key_intern(lock_shard(shard), key);
+		unlock_shard(shard);
+		return handle;
+	}
+	if (settings->frozen != NULL) {
+		/* Only keys that are there can be interned, and the pair is left as it is */
+		return (SettingsKey *) find_pair(settings, key, len, hash_key(key, len), NULL);
+	}
+	pair = find_or_add_pair(settings, key, len, hash_key(key, len));
+	if (pair != NULL) {
+		pair->flags |= PAIR_INTERNED;
+	}
+	return (SettingsKey *) pair;
+}
+
+/*
+ * Get the current value for the given key handle, or NULL if not set.
+ * A key of an overlay without a value of its own is looked up in the layers.
+ */
+static struct Value *key_value(Settings *settings, SettingsKey *key) {
+	if (settings != NULL && key != NULL) {
+		TRACE_BEGIN(trace_start);
+		struct Pair *pair = (struct Pair *) key;
+		struct Value *value = load_acquire(&pair->value);
+		if (value == NULL && settings->layers != NULL) {
+			value = find_in_layers(settings, pair->key, pair->key_len, pair->hash);
+		}
+		count_op(settings, value != NULL ? STAT_GET_HIT : STAT_GET_MISS, 1);
+		TRACE_END(settings, SETTINGS_TRACE_GET, trace_start);
+		return value;
+	}
+	return NULL;
+}
+
+const char *settings_get_string_k(Settings *settings, SettingsKey *key, const char *default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_hash(settings, ((struct Pair *) key)->hash);
+		const char *const result = settings_get_string_k(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = key_value(settings, key);
+	if (value != NULL) {
+		return value->str;
+	}
+	return default_value;
+}
+
+int settings_get_int_k(Settings *settings, SettingsKey *key, int default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_hash(settings, ((struct Pair *) key)->hash);
+		const int result = settings_get_int_k(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = key_value(settings, key);
+	if (value != NULL) {
+		return value_int(value);
+	}
+	return default_value;
+}
+
+float settings_get_float_k(Settings *settings, SettingsKey *key, float default_value) {
+	struct Value *value;
+	if (settings != NULL && settings->shards != NULL && key != NULL) {
+		struct Shard *shard = shard_for_hash(settings, ((struct Pair *) key)->hash);
+		const float result = settings_get_float_k(lock_shard(shard), key, default_value);
+		unlock_shard(shard);
+		return result;
+	}
+	value = key_value(settings, key);
+	if (value != NULL) {
+		return value_float(value);
+	}
+	return default_value;
+}
+
+int settings_set_string_k(Settings *settings, SettingsKey *key, const char *value) {
+	if (settings == NULL || key == NULL || value == NULL) {
+		return 0;
+	}
+	return set_pair_value(settings, (struct Pair *) key, value, strlen(value), NULL);
+}
+
+int settings_set_int_k(Settings *settings, SettingsKey *key, int value) {
+	struct Typed typed;
+
+	/* Convert int to string */
+	char value_str[INT64_CHARS];
+	const size_t len = format_int64(value_str, value);
+
+	/* Save the string, and keep the int so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_INT;
+	typed.int_value = value;
+	return set_pair_value(settings, (struct Pair *) key, value_str, len, &typed);
+}
+
+int settings_set_float_k(Settings *settings, SettingsKey *key, float value) {
+	struct Typed typed;
+
+	/* Convert float to string */
+	char value_str[NUMBER_CHARS];
+	const size_t len = format_float(value_str, value);
+
+	/* Save the string, and keep the float so it does not need parsing */
+	if (settings == NULL || key == NULL) {
+		return 0;
+	}
+	typed.type = TYPED_FLOAT;
+	typed.float_value = value;
+	return set_pair_value(settings, (struct Pair *) key, value_str, len, &typed);
+}
+
+SettingsWatch *settings_watch(Settings *settings, const char *pattern,
+		SettingsWatchCallback callback, void *ctx) {
+	struct SettingsWatch *watch;
+	size_t len;
+
+	/* Settings, pattern, and callback are mandatory; shards change on their own */
+	if (settings == NULL || pattern == NULL || callback == NULL || settings->shards != NULL) {
+		return NULL;
+	}
+
+	len = strlen(pattern);
+	if (!(watch = memory_malloc(sizeof(struct SettingsWatch) + len + 1))) {
+		return NULL;
+	}
+	watch->callback = callback;
+	watch->ctx = ctx;
+	watch->prefix = len > 0 && pattern[len - 1] == '*';
+	watch->pending = 0;
+	watch->len = watch->prefix ? len - 1 : len;
+	memcpy(watch->pattern, pattern, len + 1);
+	watch->next = settings->watches;
+	settings->watches = watch;
+	return watch;
+}
+
+void settings_unwatch(Settings *settings, SettingsWatch *watch) {
+	struct SettingsWatch **link;
+
+	if (settings == NULL) {
+		return;
+	}
+
+	for (link = &settings->watches; *link != NULL; link = &(*link)->next) {
+		if (*link == watch) {
+			*link = watch->next;
+			memory_free(watch);
+			return;
+		}
+	}
 }
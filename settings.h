@@ -1,8 +1,163 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct Settings Settings;
 
+/*
+ * A handle to a key in a settings object.
+ *
+ * Handles are created with settings_key_intern, and can be used in place of
+ * key strings with the *_k functions, which skip hashing and comparing keys.
+ */
+typedef struct SettingsKey SettingsKey;
+
+/*
+ * A thread that reads from a settings object while another thread writes.
+ *
+ * Any number of threads may call the settings_get_* functions while one
+ * thread at a time sets, removes or loads values. Lookups never take a
+ * lock, and always see either the old or the new value of a key. Each
+ * reading thread needs its own reader, and does its lookups between
+ * settings_read_begin and settings_read_end. Strings returned in a read
+ * section stay valid until it ends; the writer frees replaced values once
+ * every reader has left the sections that may have seen them.
+ *
+ * Without any readers, replaced values are freed right away as before.
+ */
+typedef struct SettingsReader SettingsReader;
+
+/*
+ * Memory used by a settings object, as reported by settings_memory_usage.
+ */
+typedef struct SettingsMemoryUsage {
+	size_t live;     /* Bytes in use */
+	size_t retained; /* Bytes kept for reuse */
+} SettingsMemoryUsage;
+
+/*
+ * Statistics about a settings object, as reported by settings_stats.
+ *
+ * The counters start at 0 when the settings are created. Lookups count
+ * as hits or misses whether they were made through keys, handles or
+ * settings_get_many. Sets count every key, and loads and saves count
+ * the calls that succeeded.
+ */
+typedef struct SettingsStats {
+	size_t keys;          /* Keys with a value */
+	size_t key_bytes;     /* Bytes in those keys, not counting terminators */
+	size_t value_bytes;   /* Bytes in their values, likewise */
+	size_t node_bytes;    /* Bytes of the allocations holding pairs and values */
+	size_t index_bytes;   /* Bytes of the hash index */
+	double load_factor;   /* Share of the index slots holding a key */
+	double average_probe; /* Slots looked at to find a key, on average */
+	size_t max_probe;     /* Slots looked at to find a key, at most */
+	unsigned long long get_hits;
+	unsigned long long get_misses;
+	unsigned long long sets;
+	unsigned long long removes;
+	unsigned long long loads;
+	unsigned long long saves;
+} SettingsStats;
+
+/*
+ * Points of the settings that are timed when built with SETTINGS_TRACE.
+ * Loads are timed as a whole and split into reading the input, parsing
+ * it and inserting the pairs, where parsing does not include inserting.
+ */
+typedef enum SettingsTracePoint {
+	SETTINGS_TRACE_LOAD,
+	SETTINGS_TRACE_READ,
+	SETTINGS_TRACE_PARSE,
+	SETTINGS_TRACE_INSERT,
+	SETTINGS_TRACE_GET,
+	SETTINGS_TRACE_SET,
+	SETTINGS_TRACE_REMOVE,
+	SETTINGS_TRACE_SAVE,
+	SETTINGS_TRACE_POINTS
+} SettingsTracePoint;
+
+/* Number of buckets in a latency histogram */
+#define SETTINGS_TRACE_BUCKETS 32
+
+/*
+ * The latencies recorded at one trace point, as reported by settings_trace.
+ * Bucket i counts the calls that took at least 2^i but less than 2^(i+1)
+ * nanoseconds, except that the first also counts those under a nanosecond
+ * and the last everything above.
+ */
+typedef struct SettingsTrace {
+	SettingsTracePoint point;
+	const char *name;           /* Lowercase name of the point, like "get" */
+	unsigned long long count;    /* Calls timed */
+	unsigned long long total_ns; /* Nanoseconds they took together */
+	unsigned long long buckets[SETTINGS_TRACE_BUCKETS];
+} SettingsTrace;
+
+/* Function called by settings_trace for each trace point */
+typedef void (*SettingsTraceCallback)(const SettingsTrace *trace, void *context);
+
+/*
+ * A cursor for going through all the keys and values in the settings.
+ *
+ * Start it with settings_iter_begin, and call settings_iter_next until
+ * it returns 0. Each call sets the key and value fields (and their
+ * lengths) to the next pair in insertion order; the strings stay valid
+ * until that pair is changed. Iterating does not allocate any memory.
+ *
+ * Keys may be removed while iterating, including the current one. Keys
+ * that are removed before being reached are not visited, while keys that
+ * are added are visited at the end. The other fields are private.
+ */
+typedef struct SettingsIter {
+	const char *key;
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+	Settings *settings;
+	size_t position;
+	size_t seq;
+	unsigned long compactions;
+	size_t shard;
+	size_t layer;
+} SettingsIter;
+
+/*
+ * A function called for each visited key and value, along with a context
+ * pointer given by the caller. Returns 1 to continue, or 0 to stop.
+ */
+typedef int (*SettingsCallback)(const char *key, const char *value, void *ctx);
+
+/*
+ * A watch on a key or a prefix of keys, added with settings_watch.
+ *
+ * The callback of a watch is called after a call that changes any of the
+ * watched keys returns, once per call, however many keys it changed.
+ */
+typedef struct SettingsWatch SettingsWatch;
+
+/*
+ * A function called when watched keys have changed, along with a context
+ * pointer given by the caller. The key is the one that changed if it was
+ * changed on its own, or NULL if it was part of a load, a reload or a
+ * batch (which may have changed several of them).
+ */
+typedef void (*SettingsWatchCallback)(Settings *settings, const char *key, void *ctx);
+
+/*
+ * A published version of the settings that can be replaced atomically.
+ *
+ * A new settings object is built and loaded on the side, and then
+ * published with settings_snapshot_publish. Readers take a reference to
+ * whichever version is current with settings_snapshot_acquire, without
+ * locking, and always see a complete version rather than one that is
+ * halfway through being loaded. An old version is freed once the last
+ * reader releases it. Published settings should not be modified anymore.
+ */
+typedef struct SettingsSnapshot SettingsSnapshot;
+
 /*
  * Create a new settings object.
  *
@@ -10,14 +165,254 @@ typedef struct Settings Settings;
  */
 extern Settings *settings_create(void);
 
+/*
+ * Create a new settings object that uses an arena allocator.
+ *
+ * Pairs and their strings are carved out of large chunks of memory,
+ * instead of being allocated one by one. Memory of removed or replaced
+ * values is not reused; all of it is released at once by settings_free.
+ * This suits settings that are loaded once and mostly read afterwards.
+ *
+ * Returns a pointer to the allocated settings object, or NULL if out of memory.
+ */
+extern Settings *settings_create_with_arena(void);
+
+/*
+ * Create a new settings object with room for the given number of keys.
+ *
+ * Works like settings_create, but the storage for the keys is allocated
+ * up front, so that adding that many keys does not have to grow it.
+ *
+ * Returns a pointer to the allocated settings object, or NULL if out of memory.
+ */
+extern Settings *settings_create_with_capacity(size_t capacity);
+
+/*
+ * Create a new settings object that spreads its keys over several shards.
+ *
+ * Keys are split by hash between the given number of independent tables,
+ * each with a lock of its own, so that any number of threads can get,
+ * set and remove keys at the same time, and calls on keys in different
+ * shards do not wait for each other. Loading, saving and iterating are
+ * still done by one thread at a time, without other threads changing
+ * keys meanwhile. A string returned by settings_get_string may be freed
+ * as soon as another thread sets or removes that key, so threads that
+ * read while others write need a SettingsReader of the sharded settings,
+ * and keep such strings only until the end of the read section.
+ *
+ * All the functions work the same, except that iterating, saving and
+ * settings_foreach_prefix go through one shard after the other rather
+ * than in insertion or sorted order, and that settings_save_binary,
+ * settings_reload and settings_watch are not supported and always fail.
+ *
+ * The locks need POSIX threads, so on other systems sharded settings are
+ * not available, and NULL is always returned.
+ *
+ * Returns a pointer to the allocated settings object, or NULL if out of
+ * memory, if shards is 0 or if sharding is not available.
+ */
+extern Settings *settings_create_sharded(size_t shards);
+
+/*
+ * Create a new settings object that lays its own keys over a child and
+ * a parent, such as user settings over project ones over defaults.
+ *
+ * Getting a key returns its own value if it has one, and otherwise the
+ * child's, and otherwise the parent's, without copying anything from them.
+ * Setting and removing keys only changes the overlay's own, so creating
+ * it is cheap and it only grows with what it overrides. Either layer may
+ * be an overlay itself. Keys found in a layer are cached by hash, and the
+ * cache is checked against counters that each layer bumps when one of its
+ * keys gains or loses a value, so changing a value in place costs nothing.
+ *
+ * The layers are not copied and must outlive the overlay. Readers of the
+ * overlay need a SettingsReader on any layer that is being changed
+ * meanwhile; frozen layers, such as defaults loaded with
+ * settings_load_binary and frozen, need none, and the pages of such a
+ * file are shared with other processes using the same one.
+ *
+ * Iterating and saving go through the overlay's own keys and then those
+ * of each layer that are not set higher up, and settings_foreach_prefix
+ * does the same. settings_save_binary always fails on an overlay, while
+ * settings_stats, settings_memory_usage, settings_reload and
+ * settings_watch only cover its own keys.
+ *
+ * Returns a pointer to the allocated settings object, or NULL if out of
+ * memory or if either layer is NULL or sharded.
+ */
+extern Settings *settings_create_overlay(Settings *parent, Settings *child);
+
+/*
+ * Make room for the given number of keys in total.
+ *
+ * Adding keys up to that number will not have to grow the storage.
+ * The loaders do this by themselves, based on the size of the input.
+ * Returns 1 on success, or 0 on failure (e.g. if out of memory).
+ */
+extern int settings_reserve(Settings *settings, size_t capacity);
+
+/*
+ * Give back memory that the settings are not using.
+ *
+ * After removing many keys, this shrinks the storage to fit the keys
+ * that are left, and frees any replaced values that readers are done with.
+ * The buffer that loading keeps for reading the next file is freed too,
+ * along with the removed pairs and values kept for reuse.
+ */
+extern void settings_shrink(Settings *settings);
+
+/*
+ * Make the settings read-only, for settings that no longer change.
+ *
+ * All the pairs are copied into a single block, with their numbers parsed
+ * ahead, and a minimal perfect hash is built over the keys in place of
+ * the index. Looking up a key then hashes it once and compares it with the
+ * one pair in its slot. The keys are sorted for settings_foreach_prefix
+ * right away too. Since nothing changes and nothing is cached anymore,
+ * any number of threads can read without a SettingsReader.
+ *
+ * Afterwards, every call that would change the settings fails, while
+ * getting, iterating in the same order and saving work just as
+ * before. Files loaded with settings_load_mmap or settings_load_binary are
+ * unmapped, since the block has copies of their strings. Key handles from
+ * before freezing must not be used afterwards (intern them again, see
+ * settings_key_intern), and freezing must not overlap with readers.
+ *
+ * Returns 1 on success (or if already frozen), or 0 if out of memory, if
+ * the settings are sharded, or if two keys have the same hash, which is
+ * only likely where size_t has 32 bits.
+ */
+extern int settings_freeze(Settings *settings);
+
+/*
+ * Get the memory used by the settings, in bytes.
+ *
+ * Live memory holds the keys and values, and the index and lists over
+ * them. Retained memory is kept around for reuse: removed pairs and values
+ * waiting to be recycled, the unused part of arena chunks, and the buffer
+ * kept for reading files. settings_shrink gives most of it back. Files
+ * loaded with settings_load_mmap or settings_load_binary are not counted.
+ * Returns 1 on success, or 0 if settings or usage is NULL.
+ */
+extern int settings_memory_usage(Settings *settings, SettingsMemoryUsage *usage);
+
+/*
+ * Get statistics about the sizes and the use of the settings.
+ *
+ * The counters are kept in stripes, which threads pick by the address of
+ * their stack, and are updated with relaxed atomics, so counting does not
+ * make readers contend. Going over the keys must not overlap with a writer,
+ * like saving. Values of files loaded with settings_load_mmap and
+ * settings_load_binary are not counted in node_bytes.
+ * Returns 1 on success, or 0 if settings or stats is NULL.
+ */
+extern int settings_stats(Settings *settings, SettingsStats *stats);
+
+/*
+ * Report the latencies recorded for the settings, calling the callback
+ * once for each trace point in order, with the shards added up.
+ *
+ * Latencies are only recorded when the library is built with
+ * SETTINGS_TRACE defined; otherwise the timing compiles to nothing and
+ * this reports nothing. Recording takes a clock reading at the start and
+ * end of each timed call and updates the histogram with relaxed atomics.
+ * Returns 1 on success, or 0 if settings or callback is NULL or the
+ * library was built without SETTINGS_TRACE.
+ */
+extern int settings_trace(Settings *settings, SettingsTraceCallback callback, void *context);
+
 /*
  * Free the given settings object.
  *
  * This goes through all the key/value pairs in the settings
- * and frees them as well. 
+ * and frees them as well, along with the settings object itself.
+ * Any readers are freed too, so no thread may be reading anymore.
  */
 extern void settings_free(Settings *settings);
 
+/*
+ * Register a new reader for the given settings.
+ *
+ * This may be called from the reading thread itself, even while
+ * other threads are reading or writing. A reader of sharded settings
+ * covers all their shards, whichever threads write to them.
+ * Returns the reader, or NULL on failure (e.g. if out of memory).
+ */
+extern SettingsReader *settings_reader_create(Settings *settings);
+
+/*
+ * Free the given reader.
+ *
+ * The reader must not be in a read section. Its memory is released
+ * by the writer thread later on, or by settings_free.
+ */
+extern void settings_reader_free(SettingsReader *reader);
+
+/*
+ * Start a read section.
+ *
+ * Values looked up until settings_read_end are not freed by the writer,
+ * even if they are replaced or removed in the meantime. Read sections
+ * should be short, since the writer holds on to old values until then.
+ */
+extern void settings_read_begin(SettingsReader *reader);
+
+/*
+ * End a read section started with settings_read_begin.
+ */
+extern void settings_read_end(SettingsReader *reader);
+
+/*
+ * Create a new snapshot holding the given settings.
+ *
+ * The snapshot takes ownership of the settings, which may be NULL
+ * if nothing has been published yet.
+ * Returns the snapshot, or NULL if out of memory.
+ */
+extern SettingsSnapshot *settings_snapshot_create(Settings *initial);
+
+/*
+ * Free the given snapshot.
+ *
+ * The current settings are released, and freed unless a reader
+ * still holds them. No thread may be acquiring anymore.
+ */
+extern void settings_snapshot_free(SettingsSnapshot *snapshot);
+
+/*
+ * Publish the given settings as the current version.
+ *
+ * The snapshot takes ownership of the settings. Readers that acquire
+ * after this see the new version, while the old one is released.
+ * Only one thread at a time may publish.
+ * Returns 1 on success, or 0 on failure (e.g. if next is NULL).
+ */
+extern int settings_snapshot_publish(SettingsSnapshot *snapshot, Settings *next);
+
+/*
+ * Load the given path into new settings, and publish them.
+ *
+ * The current version stays in place if loading fails.
+ * Returns 1 on success, or 0 on failure (e.g. if the path does not exist).
+ */
+extern int settings_snapshot_load(SettingsSnapshot *snapshot, const char *path);
+
+/*
+ * Get the current version of the settings, and hold on to it.
+ *
+ * The settings stay valid until released with settings_snapshot_release,
+ * even if a new version is published in the meantime.
+ * Returns the settings, or NULL if nothing has been published yet.
+ */
+extern Settings *settings_snapshot_acquire(SettingsSnapshot *snapshot);
+
+/*
+ * Release settings acquired with settings_snapshot_acquire.
+ *
+ * The settings are freed if this was the last reference to them.
+ */
+extern void settings_snapshot_release(Settings *settings);
+
 /*
  * Load settings from the given path.
  *
@@ -37,6 +432,94 @@ extern void settings_free(Settings *settings);
  */
 extern int settings_load(Settings *settings, const char *path);
 
+/*
+ * Load settings from the given buffer in memory.
+ *
+ * Works like settings_load, but parses the first len bytes of data instead
+ * of a file. The data does not need to be NUL-terminated, and it is not
+ * referenced after the call returns.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if out of memory).
+ */
+extern int settings_load_buffer(Settings *settings, const char *data, size_t len);
+
+/*
+ * Load settings from the given file descriptor.
+ *
+ * Works like settings_load, but reads from an already open descriptor
+ * (such as a pipe or a socket) until the end of the stream. The data is
+ * read in large blocks and parsed as it arrives. The descriptor is not
+ * closed. Only available on POSIX systems; elsewhere this always fails.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if reading fails).
+ */
+extern int settings_load_fd(Settings *settings, int fd);
+
+/*
+ * Load settings from the given path by mapping the file into memory.
+ *
+ * Works like settings_load, but the file is mapped privately instead of
+ * being read line by line, and the loaded keys and values point straight
+ * into the mapping rather than being copied. They are only copied when a
+ * new value is set. The mapping is kept until the settings are freed, so
+ * loading the same path repeatedly keeps every mapping alive until then.
+ *
+ * On platforms without memory mapping, this is the same as settings_load.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if the path does not exist).
+ */
+extern int settings_load_mmap(Settings *settings, const char *path);
+
+/*
+ * Load settings from the given path, parsing it on several threads.
+ *
+ * Works like settings_load, but the file is mapped into memory and split
+ * into parts at line boundaries, which are parsed on the given number of
+ * threads (or one per processor if it is 0). The parsed pairs are added
+ * in file order afterwards, so a key that appears more than once gets
+ * its last value, the same as with settings_load. If parsing fails,
+ * nothing is added. Small files are parsed on fewer threads, and on
+ * platforms without threads or memory mapping, this is the same as
+ * settings_load.
+ *
+ * When the settings are empty, the threads also copy the keys and values
+ * into their pairs, so only placing the pairs in the index is left for
+ * the end. That part still runs on one thread, and takes about 40% of
+ * the time of loading on one thread, which limits how much more threads
+ * can help.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if the path does not exist).
+ */
+extern int settings_load_parallel(Settings *settings, const char *path, unsigned threads);
+
+/*
+ * Load settings from the given buffer in memory, parsing it on several threads.
+ *
+ * Works like settings_load_parallel, but parses the first len bytes of
+ * data instead of a file, like settings_load_buffer.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if out of memory).
+ */
+extern int settings_load_buffer_parallel(Settings *settings, const char *data, size_t len, unsigned threads);
+
+/*
+ * Bring the given settings in line with the file in the given path.
+ *
+ * Works like settings_load, but only keys whose values differ from the
+ * file are set, so unchanged values (and their parsed numbers) are kept
+ * as they are. A key that is in the file more than once is compared by
+ * its last line only. Changes are applied and keys that are not in the
+ * file are removed once the whole file has been read; if reading fails
+ * halfway, the changes read so far are applied, but nothing is removed.
+ *
+ * If the file has the same size, modification time and contents as when
+ * it was last reloaded, and no values have been set or removed since,
+ * the file is only hashed and not parsed at all.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if the path does not exist).
+ */
+extern int settings_reload(Settings *settings, const char *path);
+
 /*
  * Save the given settings into the given path.
  *
@@ -44,10 +527,41 @@ extern int settings_load(Settings *settings, const char *path);
  * in the given settings object will be saved into it. There will be one
  * key/value pair per line, separated by an equals sign.
  *
+ * The output is written into a temporary file in the same directory,
+ * which is then synced and renamed over the given path. If saving fails
+ * halfway through, the previous file is left as it was.
+ *
  * Returns 1 on success, or 0 on failure.
  */
 extern int settings_save(Settings *settings, const char *path);
 
+/*
+ * Save the given settings into the given path in a binary format.
+ *
+ * The file holds a ready-made hash table, the keys and values, and the
+ * values already parsed as numbers, so that settings_load_binary can use
+ * it without parsing. It is saved the same way as with settings_save.
+ * The format is versioned, and only meant to be read on machines with
+ * the same byte order; the text format remains the portable one.
+ *
+ * Returns 1 on success, or 0 on failure.
+ */
+extern int settings_save_binary(Settings *settings, const char *path);
+
+/*
+ * Load settings saved with settings_save_binary from the given path.
+ *
+ * The file is mapped into memory, and the keys and values point straight
+ * into the mapping, which is kept until the settings are freed. Loading
+ * into empty settings takes the hash table from the file as is, with one
+ * allocation for all the pairs. Otherwise, the pairs are merged into the
+ * existing ones like with settings_load. Only available on POSIX systems;
+ * elsewhere this always fails.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if the file is not valid).
+ */
+extern int settings_load_binary(Settings *settings, const char *path);
+
 /*
  * Get a string from the settings.
  *
@@ -56,11 +570,23 @@ extern int settings_save(Settings *settings, const char *path);
  */
 extern const char *settings_get_string(Settings *settings, const char *key, const char *default_value);
 
+/*
+ * Get a string from the settings, using a key of the given length.
+ *
+ * Works like settings_get_string, but the key does not need to be
+ * NUL-terminated, and if value_len is not NULL, it is set to the length
+ * of the returned string (which is always NUL-terminated), so neither
+ * needs a strlen.
+ */
+extern const char *settings_get_string_n(Settings *settings, const char *key, size_t key_len, const char *default_value, size_t *value_len);
+
 /*
  * Get an integer from the settings.
  *
  * Finds the value in the settings corresponding to the given key and returns it.
  * If the key does not exist, then the given default value is returned.
+ * Numbers are parsed the same way in every locale, and values outside the
+ * range of an int are clamped to it.
  */
 extern int settings_get_int(Settings *settings, const char *key, int default_value);
 
@@ -72,6 +598,20 @@ extern int settings_get_int(Settings *settings, const char *key, int default_val
  */
 extern float settings_get_float(Settings *settings, const char *key, float default_value);
 
+/*
+ * Get a double from the settings.
+ *
+ * Works like settings_get_float, but with double precision.
+ */
+extern double settings_get_double(Settings *settings, const char *key, double default_value);
+
+/*
+ * Get a 64-bit integer from the settings.
+ *
+ * Works like settings_get_int, but without clamping the value to the range of an int.
+ */
+extern int64_t settings_get_int64(Settings *settings, const char *key, int64_t default_value);
+
 /*
  * Add a string value to the settings.
  *
@@ -81,6 +621,14 @@ extern float settings_get_float(Settings *settings, const char *key, float defau
  */
 extern int settings_set_string(Settings *settings, const char *key, const char *value);
 
+/*
+ * Add a string value of the given length to the settings, using a key of the given length.
+ *
+ * Works like settings_set_string, but neither the key nor the value needs
+ * to be NUL-terminated. The stored copies are.
+ */
+extern int settings_set_string_n(Settings *settings, const char *key, size_t key_len, const char *value, size_t value_len);
+
 /*
  * Add an integer value to the settings.
  *
@@ -94,18 +642,163 @@ extern int settings_set_int(Settings *settings, const char *key, int value);
  * Add a float value to the settings.
  *
  * If the given key already exists, it will be replaced.
- * The key must be non-NULL.
+ * The key must be non-NULL. The value is stored as the shortest text that
+ * reads back as the same float, with a '.' in every locale.
  * Returns 1 if the value was added successfully, 0 otherwise.
  */
 extern int settings_set_float(Settings *settings, const char *key, float value);
 
+/*
+ * Add a double value to the settings.
+ *
+ * Works like settings_set_float, but with double precision.
+ */
+extern int settings_set_double(Settings *settings, const char *key, double value);
+
+/*
+ * Add a 64-bit integer value to the settings.
+ *
+ * Works like settings_set_int.
+ */
+extern int settings_set_int64(Settings *settings, const char *key, int64_t value);
+
+/*
+ * Get many strings from the settings at once.
+ *
+ * Looks up each of the n keys, and stores its value in the same
+ * position in out, or NULL if the key does not exist (or is NULL).
+ * The keys are hashed in batches, and the lookups overlap, so this
+ * is faster than calling settings_get_string for each key.
+ * Returns the number of keys that were found.
+ */
+extern size_t settings_get_many(Settings *settings, const char *const keys[], size_t n, const char *out[]);
+
+/*
+ * Add many string values to the settings at once.
+ *
+ * Works like calling settings_set_string with each of the n keys and
+ * the value in the same position, but room for all of them is made
+ * up front. All the keys and values must be non-NULL. If out of memory
+ * halfway through, the values before that point stay set.
+ * Returns 1 if all the values were added successfully, 0 otherwise.
+ */
+extern int settings_set_many(Settings *settings, const char *const keys[], const char *const values[], size_t n);
+
 /*
  * Remove the key from the settings.
  *
- * Performs a linear search and removes the given key
- * (and the value associated with it), if it exists.
+ * Looks up and removes the given key (and the value
+ * associated with it), if it exists.
  * Returns 1 if the key was removed successfully, 0 otherwise.
  */
 extern int settings_remove(Settings *settings, const char *key);
 
+/*
+ * Start iterating over the given settings with the given cursor.
+ */
+extern void settings_iter_begin(Settings *settings, SettingsIter *iter);
+
+/*
+ * Move the given cursor to the next key and value.
+ *
+ * Returns 1 if the cursor is at a key, or 0 if there are no more keys.
+ */
+extern int settings_iter_next(SettingsIter *iter);
+
+/*
+ * Call the given callback for every key that starts with the given prefix.
+ *
+ * The keys are visited in sorted (strcmp) order, along with their values
+ * and the given context pointer. An empty prefix visits every key. The
+ * callback returns 1 to continue, or 0 to stop early; it must not change
+ * the settings. Keys are kept in a sorted index that is built on first
+ * use, so a lookup only costs a binary search plus the matching keys.
+ * Afterwards, each key that is added or removed is inserted into or
+ * removed from the index in place. After more than a few dozen such
+ * changes between two calls (e.g. when loading a file), the index is
+ * sorted again from scratch on the next call instead, in O(n log n) time.
+ *
+ * Returns 1 on success, or 0 on failure (e.g. if out of memory).
+ */
+extern int settings_foreach_prefix(Settings *settings, const char *prefix, SettingsCallback callback, void *ctx);
+
+/*
+ * Get a handle to the given key.
+ *
+ * The key does not need to exist in the settings yet. The handle stays
+ * valid until the settings object is freed, even if the key is set,
+ * removed or loaded again in the meantime. The exception is freezing,
+ * which moves every key, so handles must be interned again afterwards;
+ * frozen settings only give handles to keys that have a value.
+ * Returns the handle, or NULL on failure (e.g. if out of memory).
+ */
+extern SettingsKey *settings_key_intern(Settings *settings, const char *key);
+
+/*
+ * Get a string from the settings using a key handle.
+ *
+ * Works like settings_get_string, but without looking the key up.
+ */
+extern const char *settings_get_string_k(Settings *settings, SettingsKey *key, const char *default_value);
+
+/*
+ * Get an integer from the settings using a key handle.
+ *
+ * Works like settings_get_int, but without looking the key up.
+ */
+extern int settings_get_int_k(Settings *settings, SettingsKey *key, int default_value);
+
+/*
+ * Get a float from the settings using a key handle.
+ *
+ * Works like settings_get_float, but without looking the key up.
+ */
+extern float settings_get_float_k(Settings *settings, SettingsKey *key, float default_value);
+
+/*
+ * Add a string value to the settings using a key handle.
+ *
+ * Works like settings_set_string, but without looking the key up.
+ * Returns 1 if the value was added successfully, 0 otherwise.
+ */
+extern int settings_set_string_k(Settings *settings, SettingsKey *key, const char *value);
+
+/*
+ * Add an integer value to the settings using a key handle.
+ *
+ * Works like settings_set_int, but without looking the key up.
+ * Returns 1 if the value was added successfully, 0 otherwise.
+ */
+extern int settings_set_int_k(Settings *settings, SettingsKey *key, int value);
+
+/*
+ * Add a float value to the settings using a key handle.
+ *
+ * Works like settings_set_float, but without looking the key up.
+ * Returns 1 if the value was added successfully, 0 otherwise.
+ */
+extern int settings_set_float_k(Settings *settings, SettingsKey *key, float value);
+
+/*
+ * Watch the given key for changes.
+ *
+ * A pattern that ends in an asterisk watches every key that starts with
+ * the rest of it (so "*" watches all keys), and any other pattern watches
+ * just that key. The callback is called after a key it watches has been
+ * set, removed, loaded or reloaded, and only if the value really changed
+ * in the case of settings_reload. A load, reload or batch that changes
+ * many watched keys calls it just once. The callback may read the
+ * settings, but must not change them or add or remove watches.
+ *
+ * Returns the watch, or NULL if out of memory.
+ */
+extern SettingsWatch *settings_watch(Settings *settings, const char *pattern,
+		SettingsWatchCallback callback, void *ctx);
+
+/*
+ * Remove the given watch, so that its callback is not called anymore.
+ * Watches that are not removed are freed along with the settings.
+ */
+extern void settings_unwatch(Settings *settings, SettingsWatch *watch);
+
 #endif /* SETTINGS_H */
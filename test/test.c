@@ -1,7 +1,19 @@
+/* For fileno */
+#define _POSIX_C_SOURCE 200809L
+
+#include <float.h>
+#include <limits.h>
 #include <string.h>
 #include "test.h"
 #include "settings.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+	#define HAVE_PTHREADS
+	#include <sched.h>
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
 /*
  * Creation tests
  */
@@ -21,6 +33,109 @@ static int test_settings_create_no_memory(void) {
 	return TEST_PASS;
 }
 
+static int test_settings_create_with_arena(void) {
+	Settings *settings = settings_create_with_arena();
+	char key[32];
+	char value[32];
+	int i;
+	test_assert(settings != NULL);
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(settings_set_string(settings, key, value));
+	}
+	test_assert(settings_set_string(settings, "key0", "a much longer value than before"));
+	test_assert(settings_remove(settings, "key1"));
+	for (i = 2; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(strncmp(value, settings_get_string(settings, key, "ERROR"), 64) == 0);
+	}
+	test_assert(strncmp("a much longer value than before", settings_get_string(settings, "key0", "ERROR"), 64) == 0);
+	test_assert(strncmp("ERROR", settings_get_string(settings, "key1", "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_create_with_arena_no_memory(void) {
+	Settings *settings;
+	test_malloc_disable();
+	test_assert(settings_create_with_arena() == NULL);
+	test_malloc_enable();
+	settings = settings_create_with_arena();
+	test_assert(settings != NULL);
+	test_malloc_disable();
+	test_assert(!settings_set_string(settings, "foo", "abc"));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_create_with_capacity(void) {
+	Settings *settings = settings_create_with_capacity(1000);
+	char key[32];
+	int i;
+	test_assert(settings != NULL);
+	/* Only the pairs themselves need allocating, one block per key */
+	test_malloc_fail_after(1000);
+	test_realloc_disable();
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_malloc_enable();
+	test_realloc_enable();
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == i);
+	}
+	settings_free(settings);
+
+	test_malloc_disable();
+	test_assert(settings_create_with_capacity(1000) == NULL);
+
+	return TEST_PASS;
+}
+
+static int test_settings_reserve_and_shrink(void) {
+	Settings *settings = settings_create();
+	char key[32];
+	int i;
+	test_assert(settings_reserve(settings, 10000));
+	test_assert(settings_reserve(settings, 10));
+	test_assert(!settings_reserve(NULL, 10));
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	for (i = 0; i < 9990; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_remove(settings, key));
+	}
+	settings_shrink(settings);
+	settings_shrink(NULL);
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == (i < 9990 ? -1 : i));
+	}
+	/* Shrunk settings still grow as needed */
+	test_assert(settings_set_int(settings, "foo", 123));
+	test_assert(settings_get_int(settings, "foo", -1) == 123);
+	test_assert(settings_get_int(settings, "key9999", -1) == 9999);
+	for (i = 0; i < 10; ++i) {
+		sprintf(key, "key%d", 9990 + i);
+		test_assert(settings_remove(settings, key));
+	}
+	test_assert(settings_remove(settings, "foo"));
+	settings_shrink(settings);
+	test_assert(settings_set_int(settings, "bar", 456));
+	test_assert(settings_get_int(settings, "bar", -1) == 456);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
 /*
  * String tests
  */
@@ -125,6 +240,55 @@ static int test_settings_string_missing_null(void) {
 	return TEST_PASS;
 }
 
+static int test_settings_string_many(void) {
+	Settings *settings = settings_create();
+	char key[32];
+	char value[32];
+	int i;
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(settings_set_string(settings, key, value));
+	}
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(strncmp(value, settings_get_string(settings, key, "ERROR"), 64) == 0);
+	}
+	test_assert(strncmp("ERROR", settings_get_string(settings, "key10000", "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_string_n(void) {
+	static const char buffer[] = "foobar=a\0b";
+	Settings *settings = settings_create();
+	size_t len = 0;
+
+	/* Neither the key nor the value is NUL-terminated */
+	test_assert(settings_set_string_n(settings, buffer, 3, buffer + 7, 3));
+	test_assert(settings_get_string_n(settings, "foo", 3, NULL, &len) != NULL);
+	test_assert(len == 3);
+	test_assert(memcmp("a\0b", settings_get_string_n(settings, "foo", 3, NULL, NULL), 4) == 0);
+	test_assert(strcmp("a", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_get_string_n(settings, "foobar", 6, NULL, &len) == NULL);
+	test_assert(len == 0);
+	test_assert(strcmp("ERROR", settings_get_string_n(settings, "fo", 2, "ERROR", &len)) == 0);
+	test_assert(len == 5);
+
+	/* Keys set either way are the same */
+	test_assert(settings_set_string(settings, "bar", "baz"));
+	test_assert(strcmp("baz", settings_get_string_n(settings, buffer + 3, 3, "ERROR", &len)) == 0);
+	test_assert(len == 3);
+	test_assert(!settings_set_string_n(settings, NULL, 0, "baz", 3));
+	test_assert(!settings_set_string_n(settings, "bar", 3, NULL, 0));
+	test_assert(settings_get_string_n(NULL, "bar", 3, NULL, NULL) == NULL);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
 /*
  * Integer tests
  */
@@ -200,6 +364,57 @@ static int test_settings_int_missing(void) {
 	return TEST_PASS;
 }
 
+static int test_settings_int_cached(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", "1264"));
+	test_assert(settings_get_int(settings, "foo", 9999) == 1264);
+	test_assert(settings_get_int(settings, "foo", 9999) == 1264);
+	test_assert(settings_set_string(settings, "foo", "456"));
+	test_assert(settings_get_int(settings, "foo", 9999) == 456);
+	test_assert(settings_get_float(settings, "foo", 9999.0f) == 456.0f);
+	test_assert(settings_set_int(settings, "foo", 789));
+	test_assert(settings_get_float(settings, "foo", 9999.0f) == 789.0f);
+	test_assert(strncmp("789", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_int_parse(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", "  -12abc"));
+	test_assert(settings_get_int(settings, "foo", 9999) == -12);
+	test_assert(settings_set_string(settings, "foo", "1e3"));
+	test_assert(settings_get_int(settings, "foo", 9999) == 1);
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_get_int(settings, "foo", 9999) == 0);
+	test_assert(settings_set_string(settings, "foo", "99999999999"));
+	test_assert(settings_get_int(settings, "foo", 9999) == INT_MAX);
+	test_assert(settings_set_string(settings, "foo", "-99999999999"));
+	test_assert(settings_get_int(settings, "foo", 9999) == INT_MIN);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_int64(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_int64(settings, "min", INT64_MIN));
+	test_assert(settings_set_int64(settings, "max", INT64_MAX));
+	test_assert(settings_get_int64(settings, "min", 0) == INT64_MIN);
+	test_assert(settings_get_int64(settings, "max", 0) == INT64_MAX);
+	test_assert(strcmp("-9223372036854775808", settings_get_string(settings, "min", "ERROR")) == 0);
+	test_assert(strcmp("9223372036854775807", settings_get_string(settings, "max", "ERROR")) == 0);
+	test_assert(settings_get_int(settings, "max", 0) == INT_MAX);
+	test_assert(settings_set_string(settings, "foo", "-9223372036854775809"));
+	test_assert(settings_get_int64(settings, "foo", 0) == INT64_MIN);
+	test_assert(settings_get_int64(settings, "bar", 42) == 42);
+	test_assert(!settings_set_int64(settings, NULL, 1));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
 /*
  * Float tests
  */
@@ -275,6 +490,91 @@ static int test_settings_float_missing(void) {
 	return TEST_PASS;
 }
 
+static int test_settings_float_cached(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", "123.1"));
+	test_assert(settings_get_float(settings, "foo", 9999.0f) == 123.1f);
+	test_assert(settings_get_int(settings, "foo", 9999) == 123);
+	test_assert(settings_set_string(settings, "foo", "456.2"));
+	test_assert(settings_get_float(settings, "foo", 9999.0f) == 456.2f);
+	test_assert(settings_set_float(settings, "foo", 0.0000001f));
+	test_assert(settings_get_float(settings, "foo", 9999.0f) == 0.0000001f);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_float_shortest(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_float(settings, "foo", 0.1f));
+	test_assert(strcmp("0.1", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_set_float(settings, "foo", 5.0f));
+	test_assert(strcmp("5.0", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_set_float(settings, "foo", 0.0000001f));
+	test_assert(strcmp("1e-7", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_set_float(settings, "foo", -1.5e30f));
+	test_assert(strcmp("-1.5e30", settings_get_string(settings, "foo", "ERROR")) == 0);
+
+	/* The text reads back as the same float */
+	test_assert(settings_set_string(settings, "bar", settings_get_string(settings, "foo", "ERROR")));
+	test_assert(settings_get_float(settings, "bar", 0.0f) == -1.5e30f);
+
+	/* Even where Grisu alone would write a digit too many */
+	test_assert(settings_set_float(settings, "foo", 41002688.0f));
+	test_assert(strcmp("41002690.0", settings_get_string(settings, "foo", "ERROR")) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Double tests
+ */
+
+static int test_settings_double_add(void) {
+	static const double values[] = { 0.1, -123.456, 1e-300, 5e-324, DBL_MAX, 1e21, 0.0 };
+	Settings *settings = settings_create();
+	size_t i;
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		test_assert(settings_set_double(settings, "foo", values[i]));
+		test_assert(settings_get_double(settings, "foo", 9999.0) == values[i]);
+
+		/* Parsing the text gives the same double */
+		test_assert(settings_set_string(settings, "bar", settings_get_string(settings, "foo", "ERROR")));
+		test_assert(settings_get_double(settings, "bar", 9999.0) == values[i]);
+	}
+	test_assert(settings_set_double(settings, "foo", 0.1));
+	test_assert(strcmp("0.1", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_set_double(settings, "foo", 1e100));
+	test_assert(strcmp("1e100", settings_get_string(settings, "foo", "ERROR")) == 0);
+
+	/* Numbers that Grisu alone would write with a digit too many */
+	test_assert(settings_set_double(settings, "foo", 0.0054039749820567326));
+	test_assert(strcmp("0.005403974982056733", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(settings_set_double(settings, "foo", -43666401.764313184));
+	test_assert(strcmp("-43666401.76431318", settings_get_string(settings, "foo", "ERROR")) == 0);
+	test_assert(!settings_set_double(settings, NULL, 0.1));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_double_parse(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", " -1.5e3x"));
+	test_assert(settings_get_double(settings, "foo", 9999.0) == -1500.0);
+	test_assert(settings_set_string(settings, "foo", "0.30000000000000004"));
+	test_assert(settings_get_double(settings, "foo", 9999.0) == 0.1 + 0.2);
+	test_assert(settings_set_string(settings, "foo", "123456789012345678901234567890"));
+	test_assert(settings_get_double(settings, "foo", 9999.0) == 123456789012345678901234567890.0);
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_get_double(settings, "foo", 9999.0) == 0.0);
+	test_assert(settings_get_double(settings, "bar", 9999.0) == 9999.0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
 /*
  * Test loading from file
  */
@@ -327,120 +627,2589 @@ static int test_settings_load_null_path(void) {
 }
 
 
-/*
- * Test saving to file
- */
-
-static int test_settings_save(void) {
+static int test_settings_load_long_line(void) {
 	Settings *settings = settings_create();
-	char config_path[] = "test_settings_save.txt";
-	char *expected_contents = "foo = abc def ghi\nbar = 54321\nbaz = 123.1\n";
-	char buf[1000] = {'\0'};
-	size_t bytes_read;
+	char config_path[] = "test_settings_load_long_line.txt";
+	static char long_value[200000];
+	int load_success;
 	FILE *f;
 
-	settings_set_string(settings, "foo", "abc def ghi");
-	settings_set_string(settings, "bar", "54321");
-	settings_set_string(settings, "baz", "123.1");
-	test_assert(settings_save(settings, config_path));
+	memset(long_value, 'x', sizeof(long_value) - 1);
+	long_value[sizeof(long_value) - 1] = '\0';
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "foo=abc\nlong = %s\nbar=def", long_value) > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_load(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(strncmp("def", settings_get_string(settings, "bar", "ERROR"), 64) == 0);
+	test_assert(strcmp(long_value, settings_get_string(settings, "long", "ERROR")) == 0);
 	settings_free(settings);
 
-	/* Check file */
-	test_assert((f = fopen(config_path, "rt")) != NULL);
-	bytes_read = fread(buf, 1, 1000, f);
+	return TEST_PASS;
+}
+
+static int test_settings_load_reuses_buffer(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_load_reuses_buffer.txt";
+	int load_success;
+	FILE *f;
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "no pairs here\n") > 0);
 	test_assert(fclose(f) == 0);
+	test_assert(settings_load(settings, config_path));
+	/* The read buffer of the first load is kept for the second one */
+	test_malloc_disable();
+	load_success = settings_load(settings, config_path);
+	test_malloc_enable();
+	test_assert(load_success);
+	/* Until the settings are shrunk */
+	settings_shrink(settings);
+	test_malloc_disable();
+	load_success = settings_load(settings, config_path);
+	test_malloc_enable();
 	test_assert(remove(config_path) == 0);
-	test_assert(bytes_read == strlen(expected_contents));
-	test_assert(strncmp(buf, expected_contents, 1000) == 0);
+	test_assert(!load_success);
+	settings_free(settings);
 
 	return TEST_PASS;
 }
 
-static int test_settings_save_empty(void) {
+static int test_settings_load_buffer(void) {
 	Settings *settings = settings_create();
-	char config_path[] = "test_settings_save_empty.txt";
-	char buf[1000];
-	size_t bytes_read;
+	const char data[] = "foo  bar  = abc def =   ghi   \n  bar =   54321 \nbaz =  123.1XXX";
+	test_assert(settings_load_buffer(settings, data, strlen(data) - 3));
+	test_assert(strncmp("abc def =   ghi", settings_get_string(settings, "foo  bar", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	test_assert(strncmp("123.1", settings_get_string(settings, "baz", "ERROR"), 64) == 0);
+	test_assert(settings_load_buffer(settings, NULL, 0));
+	test_assert(!settings_load_buffer(settings, NULL, 1));
+	test_assert(!settings_load_buffer(NULL, data, strlen(data)));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_load_buffer_parallel(void) {
+	Settings *parallel = settings_create();
+	Settings *sequential = settings_create();
+	const size_t size = 2 * 1024 * 1024;
+	SettingsIter a;
+	SettingsIter b;
+	size_t len = 0;
+	char *data;
+	int i;
+
+	/* Enough lines for several threads, with a key repeated at both ends */
+	test_assert((data = malloc(size)) != NULL);
+	len += sprintf(data + len, "dup = first\n");
+	for (i = 0; len + 64 < size; ++i) {
+		len += sprintf(data + len, "key%d = value %d\n", i, i);
+	}
+	len += sprintf(data + len, "dup = last");
+	test_assert(settings_load_buffer_parallel(parallel, data, len, 4));
+	test_assert(settings_load_buffer(sequential, data, len));
+
+	/* Same pairs in the same order as a sequential load */
+	test_assert(strncmp("last", settings_get_string(parallel, "dup", "ERROR"), 64) == 0);
+	settings_iter_begin(parallel, &a);
+	settings_iter_begin(sequential, &b);
+	while (settings_iter_next(&a)) {
+		test_assert(settings_iter_next(&b));
+		test_assert(strcmp(a.key, b.key) == 0);
+		test_assert(strcmp(a.value, b.value) == 0);
+	}
+	test_assert(!settings_iter_next(&b));
+
+	/* The loaded pairs change like any other, also when loading into them again */
+	test_assert(settings_set_string(parallel, "key1", "changed"));
+	test_assert(settings_remove(parallel, "key2"));
+	test_assert(settings_remove(parallel, "dup"));
+	test_assert(strncmp("changed", settings_get_string(parallel, "key1", "ERROR"), 64) == 0);
+	test_assert(strncmp("ERROR", settings_get_string(parallel, "key2", "ERROR"), 64) == 0);
+	test_assert(settings_load_buffer_parallel(parallel, data, len, 4));
+	test_assert(strncmp("value 1", settings_get_string(parallel, "key1", "ERROR"), 64) == 0);
+	test_assert(strncmp("value 2", settings_get_string(parallel, "key2", "ERROR"), 64) == 0);
+	test_assert(strncmp("last", settings_get_string(parallel, "dup", "ERROR"), 64) == 0);
+	free(data);
+	settings_free(parallel);
+	settings_free(sequential);
+
+	return TEST_PASS;
+}
+
+static int test_settings_load_parallel(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_load_parallel.txt";
+	int load_success;
 	FILE *f;
 
-	test_assert(settings_save(settings, config_path));
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "foo  bar  = abc def =   ghi   \n") > 0);
+	test_assert(fprintf(f, "  bar =   54321 \n") > 0);
+	test_assert(fprintf(f, "baz =  123.1") > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_load_parallel(settings, config_path, 0);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc def =   ghi", settings_get_string(settings, "foo  bar", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	test_assert(settings_get_float(settings, "baz", 9999.0f) == 123.1f);
+	test_assert(!settings_load_parallel(settings, "missing_file.txt", 0));
+	test_assert(!settings_load_parallel(NULL, config_path, 0));
+	test_assert(!settings_load_parallel(settings, NULL, 0));
+	test_assert(!settings_load_buffer_parallel(settings, NULL, 1, 0));
 	settings_free(settings);
 
-	/* Check file */
-	test_assert((f = fopen(config_path, "rt")) != NULL);
-	bytes_read = fread(buf, 1, 1000, f);
+	return TEST_PASS;
+}
+
+static int test_settings_load_fd(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_load_fd.txt";
+	int load_success;
+	FILE *f;
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "foo = abc\nbar = 54321\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert((f = fopen(config_path, "rb")) != NULL);
+	load_success = settings_load_fd(settings, fileno(f));
 	test_assert(fclose(f) == 0);
 	test_assert(remove(config_path) == 0);
-	test_assert(bytes_read == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	test_assert(!settings_load_fd(settings, -1));
+	test_assert(!settings_load_fd(NULL, 0));
+	settings_free(settings);
 
 	return TEST_PASS;
 }
 
-static int test_settings_save_file_fails_to_open(void) {
+#ifdef HAVE_PTHREADS
+/* Length of the long value and size of each write for test_settings_load_fd_short_reads */
+#define PIPE_VALUE_LENGTH (256 * 1024)
+#define PIPE_WRITE_SIZE 100
+
+/* A thread that writes a long line into a pipe in small pieces */
+struct PipeWriter {
+	int fd;
+	const char *data;
+	size_t size;
+	int errors;
+};
+
+static void *write_pipe(void *arg) {
+	struct PipeWriter *writer = arg;
+	size_t offset = 0;
+	while (offset < writer->size) {
+		size_t n = writer->size - offset;
+		ssize_t written;
+		if (n > PIPE_WRITE_SIZE) {
+			n = PIPE_WRITE_SIZE;
+		}
+		if ((written = write(writer->fd, writer->data + offset, n)) <= 0) {
+			writer->errors++;
+			break;
+		}
+		offset += written;
+	}
+	close(writer->fd);
+	return NULL;
+}
+#endif
+
+static int test_settings_load_fd_short_reads(void) {
+#ifdef HAVE_PTHREADS
 	Settings *settings = settings_create();
-	test_assert(!settings_save(settings, "<>:?*|\"/ ")); /* Make fopen fail */
+	const size_t size = PIPE_VALUE_LENGTH + 32;
+	char *data = malloc(size);
+	struct PipeWriter writer;
+	pthread_t thread;
+	int fds[2];
+	int load_success;
+	int len;
+
+	/* A long line that arrives in many short reads, between two short ones */
+	test_assert(data != NULL);
+	len = sprintf(data, "foo = abc\nlong = ");
+	memset(data + len, 'x', PIPE_VALUE_LENGTH);
+	len += PIPE_VALUE_LENGTH;
+	len += sprintf(data + len, "\nbar = 54321");
+	test_assert(pipe(fds) == 0);
+	writer.fd = fds[1];
+	writer.data = data;
+	writer.size = len;
+	writer.errors = 0;
+	test_assert(pthread_create(&thread, NULL, write_pipe, &writer) == 0);
+	load_success = settings_load_fd(settings, fds[0]);
+	test_assert(pthread_join(thread, NULL) == 0);
+	test_assert(close(fds[0]) == 0);
+	test_assert(writer.errors == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(strlen(settings_get_string(settings, "long", "")) == PIPE_VALUE_LENGTH);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
 	settings_free(settings);
+	free(data);
+#endif
 
 	return TEST_PASS;
 }
 
-static int test_settings_save_null_settings(void) {
-	test_assert(!settings_save(NULL, "test_config_save.txt"));
+static int test_settings_load_mmap(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_load_mmap.txt";
+	int load_success;
+	FILE *f;
+
+	test_assert(settings_set_string(settings, "bar", "old"));
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "foo  bar  = abc def =   ghi   \n") > 0);
+	test_assert(fprintf(f, "  bar =   54321 \n") > 0);
+	test_assert(fprintf(f, "no equals sign\n") > 0);
+	test_assert(fprintf(f, "baz =  123.1") > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_load_mmap(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc def =   ghi", settings_get_string(settings, "foo  bar", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	test_assert(settings_get_float(settings, "baz", 9999.0f) == 123.1f);
+	test_assert(strncmp("ERROR", settings_get_string(settings, "no equals sign", "ERROR"), 64) == 0);
+	/* Borrowed values are copied when replaced */
+	test_assert(settings_set_string(settings, "bar", "a longer value than before"));
+	test_assert(strncmp("a longer value than before", settings_get_string(settings, "bar", "ERROR"), 64) == 0);
+	test_assert(settings_remove(settings, "foo  bar"));
+	settings_free(settings);
 
 	return TEST_PASS;
 }
 
-static int test_settings_save_null_path(void) {
+static int test_settings_load_mmap_long_lines(void) {
 	Settings *settings = settings_create();
-	settings_set_string(settings, "foo", "abc def ghi");
-	settings_set_string(settings, "bar", "54321");
-	settings_set_string(settings, "bar", "123.1");
-	test_assert(!settings_save(settings, NULL));
+	char config_path[] = "test_settings_load_mmap_long_lines.txt";
+	char long_value[200];
+	int load_success;
+	FILE *f;
+
+	memset(long_value, 'x', sizeof(long_value) - 1);
+	long_value[sizeof(long_value) - 1] = '\0';
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a\nb = 1\n") > 0);
+	test_assert(fprintf(f, "a key that is longer than one vector block = %s\n", long_value) > 0);
+	test_assert(fprintf(f, "\r\n\n  c=2\r\n") > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_load_mmap(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(settings_get_int(settings, "b", 9999) == 1);
+	test_assert(settings_get_int(settings, "c", 9999) == 2);
+	test_assert(strncmp(long_value, settings_get_string(settings, "a key that is longer than one vector block", "ERROR"), 256) == 0);
 	settings_free(settings);
 
 	return TEST_PASS;
 }
 
-/*
- * Remove tests
- */
-
-static int test_settings_remove(void) {
+static int test_settings_load_mmap_missing_file(void) {
 	Settings *settings = settings_create();
-	test_assert(settings_set_int(settings, "foo", 123));
-	test_assert(settings_get_int(settings, "foo", 99999) == 123);
-	test_assert(settings_remove(settings, "foo"));
-	test_assert(settings_get_int(settings, "foo", 99999) == 99999);
+	test_assert(!settings_load_mmap(settings, "missing_file.txt"));
+	test_assert(!settings_load_mmap(NULL, "missing_file.txt"));
+	test_assert(!settings_load_mmap(settings, NULL));
 	settings_free(settings);
+
 	return TEST_PASS;
 }
 
-static int test_settings_remove_null_settings(void) {
-	test_assert(!settings_remove(NULL, "something"));
+static int test_settings_reload(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_reload.txt";
+	const char *unchanged;
+	int reload_success;
+	FILE *f;
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a = 1\nb = 2\nc = 3\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_reload(settings, config_path));
+	test_assert(settings_get_int(settings, "a", 9999) == 1);
+	unchanged = settings_get_string(settings, "a", "ERROR");
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a = 1\nb = changed\nd = 4\n") > 0);
+	test_assert(fclose(f) == 0);
+	reload_success = settings_reload(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(reload_success);
+	/* Unchanged values are left alone */
+	test_assert(settings_get_string(settings, "a", "ERROR") == unchanged);
+	test_assert(strncmp("changed", settings_get_string(settings, "b", "ERROR"), 64) == 0);
+	test_assert(strncmp("ERROR", settings_get_string(settings, "c", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "d", 9999) == 4);
+	settings_free(settings);
+
 	return TEST_PASS;
 }
 
-static int test_settings_remove_null_key(void) {
+static int test_settings_reload_unchanged(void) {
 	Settings *settings = settings_create();
-	test_assert(settings_set_string(settings, "foo", "bar"));
-	test_assert(!settings_remove(settings, NULL));
+	char config_path[] = "test_settings_reload_unchanged.txt";
+	int reload_success;
+	FILE *f;
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a = 1\nb = 2\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_reload(settings, config_path));
+	/* The same file is only hashed, which needs no memory */
+	test_malloc_disable();
+	reload_success = settings_reload(settings, config_path);
+	test_malloc_enable();
+	test_assert(reload_success);
+	test_assert(settings_get_int(settings, "b", 9999) == 2);
+	/* Changing the settings makes the file apply again */
+	test_assert(settings_set_int(settings, "b", 5));
+	test_assert(settings_set_int(settings, "e", 6));
+	reload_success = settings_reload(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(reload_success);
+	test_assert(settings_get_int(settings, "b", 9999) == 2);
+	test_assert(settings_get_int(settings, "e", 9999) == 9999);
 	settings_free(settings);
+
 	return TEST_PASS;
 }
 
-static int test_settings_remove_missing_key(void) {
+static int test_settings_reload_missing_file(void) {
 	Settings *settings = settings_create();
-	test_assert(settings_set_string(settings, "foo", "bar"));
-	test_assert(!settings_remove(settings, "something"));
+	test_assert(settings_set_int(settings, "a", 1));
+	test_assert(!settings_reload(settings, "missing_file.txt"));
+	test_assert(settings_get_int(settings, "a", 9999) == 1);
+	test_assert(!settings_reload(NULL, "missing_file.txt"));
+	test_assert(!settings_reload(settings, NULL));
 	settings_free(settings);
+
 	return TEST_PASS;
 }
 
-int main(void) {
+/*
+ * Test saving to file
+ */
+
+static int test_settings_save(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_save.txt";
+	char *expected_contents = "foo = abc def ghi\nbar = 54321\nbaz = 123.1\n";
+	char buf[1000] = {'\0'};
+	size_t bytes_read;
+	FILE *f;
+
+	settings_set_string(settings, "foo", "abc def ghi");
+	settings_set_string(settings, "bar", "54321");
+	settings_set_string(settings, "baz", "123.1");
+	test_assert(settings_save(settings, config_path));
+	settings_free(settings);
+
+	/* Check file */
+	test_assert((f = fopen(config_path, "rt")) != NULL);
+	bytes_read = fread(buf, 1, 1000, f);
+	test_assert(fclose(f) == 0);
+	test_assert(remove(config_path) == 0);
+	test_assert(bytes_read == strlen(expected_contents));
+	test_assert(strncmp(buf, expected_contents, 1000) == 0);
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_empty(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_save_empty.txt";
+	char buf[1000];
+	size_t bytes_read;
+	FILE *f;
+
+	test_assert(settings_save(settings, config_path));
+	settings_free(settings);
+
+	/* Check file */
+	test_assert((f = fopen(config_path, "rt")) != NULL);
+	bytes_read = fread(buf, 1, 1000, f);
+	test_assert(fclose(f) == 0);
+	test_assert(remove(config_path) == 0);
+	test_assert(bytes_read == 0);
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_replace(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_save_replace.txt";
+	char *long_value = malloc(3 * 1024 * 1024);
+	char buf[1000] = {'\0'};
+	size_t bytes_read;
+	FILE *f;
+
+	/* An existing file is replaced as a whole */
+	test_assert(long_value != NULL);
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "old = this line should go away\n") > 0);
+	test_assert(fclose(f) == 0);
+	settings_set_string(settings, "foo", "abc");
+	test_assert(settings_save(settings, config_path));
+	test_assert((f = fopen(config_path, "rt")) != NULL);
+	bytes_read = fread(buf, 1, 1000, f);
+	test_assert(fclose(f) == 0);
+	test_assert(bytes_read == strlen("foo = abc\n"));
+	test_assert(strncmp(buf, "foo = abc\n", 1000) == 0);
+
+	/* Values larger than the output buffer are written as well */
+	memset(long_value, 'x', 3 * 1024 * 1024 - 1);
+	long_value[3 * 1024 * 1024 - 1] = '\0';
+	settings_set_string(settings, "bar", long_value);
+	test_assert(settings_save(settings, config_path));
+	settings_free(settings);
+	settings = settings_create();
+	test_assert(settings_load(settings, config_path));
+	test_assert(remove(config_path) == 0);
+	test_assert(strcmp(long_value, settings_get_string(settings, "bar", "ERROR")) == 0);
+	test_assert(strcmp("abc", settings_get_string(settings, "foo", "ERROR")) == 0);
+	settings_free(settings);
+	free(long_value);
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of threads and saves each for test_settings_save_threads */
+#define SAVE_THREADS 4
+#define SAVE_ROUNDS 20
+
+/* A thread that saves the same settings to the same path, over and over */
+struct SaveThread {
+	Settings *settings;
+	const char *path;
+	int errors;
+};
+
+static void *save_repeatedly(void *arg) {
+	struct SaveThread *saver = arg;
+	int i;
+	for (i = 0; i < SAVE_ROUNDS; ++i) {
+		saver->errors += !settings_save(saver->settings, saver->path);
+	}
+	return NULL;
+}
+#endif
+
+static int test_settings_save_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_save_threads.txt";
+	struct SaveThread savers[SAVE_THREADS];
+	pthread_t threads[SAVE_THREADS];
+	char key[32];
+	int i;
+
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+
+	/* Savers do not write into each other's temporary files */
+	for (i = 0; i < SAVE_THREADS; ++i) {
+		savers[i].settings = settings;
+		savers[i].path = config_path;
+		savers[i].errors = 0;
+		test_assert(pthread_create(&threads[i], NULL, save_repeatedly, &savers[i]) == 0);
+	}
+	for (i = 0; i < SAVE_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+		test_assert(savers[i].errors == 0);
+	}
+	settings_free(settings);
+
+	settings = settings_create();
+	test_assert(settings_load(settings, config_path));
+	test_assert(remove(config_path) == 0);
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == i);
+	}
+	settings_free(settings);
+#endif
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_no_memory(void) {
+	Settings *settings = settings_create();
+	settings_set_string(settings, "foo", "abc");
+	test_malloc_disable();
+	test_assert(!settings_save(settings, "test_settings_save_no_memory.txt"));
+	test_malloc_fail_after(1);
+	test_assert(!settings_save(settings, "test_settings_save_no_memory.txt"));
+	test_malloc_enable();
+	settings_free(settings);
+	test_assert(fopen("test_settings_save_no_memory.txt", "rt") == NULL);
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_file_fails_to_open(void) {
+	Settings *settings = settings_create();
+	test_assert(!settings_save(settings, "<>:?*|\"/ ")); /* Make fopen fail */
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_null_settings(void) {
+	test_assert(!settings_save(NULL, "test_config_save.txt"));
+
+	return TEST_PASS;
+}
+
+static int test_settings_save_null_path(void) {
+	Settings *settings = settings_create();
+	settings_set_string(settings, "foo", "abc def ghi");
+	settings_set_string(settings, "bar", "54321");
+	settings_set_string(settings, "bar", "123.1");
+	test_assert(!settings_save(settings, NULL));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Binary format tests
+ */
+
+static int test_settings_binary(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_binary.bin";
+	char key[32];
+	char value[32];
+	int load_success;
+	int i;
+
+	test_assert(settings_set_string(settings, "foo", "abc def ghi"));
+	test_assert(settings_set_int(settings, "bar", 54321));
+	test_assert(settings_set_string(settings, "baz", "123.5"));
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(settings_set_string(settings, key, value));
+	}
+	test_assert(settings_save_binary(settings, config_path));
+	settings_free(settings);
+
+	settings = settings_create();
+	load_success = settings_load_binary(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(strncmp("abc def ghi", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	test_assert(settings_get_float(settings, "baz", 9999.0f) == 123.5f);
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		sprintf(value, "value%d", i);
+		test_assert(strncmp(value, settings_get_string(settings, key, "ERROR"), 64) == 0);
+	}
+	test_assert(strncmp("ERROR", settings_get_string(settings, "missing", "ERROR"), 64) == 0);
+
+	/* The loaded pairs can be changed like any others */
+	test_assert(settings_set_string(settings, "foo", "def"));
+	test_assert(settings_remove(settings, "bar"));
+	test_assert(settings_set_string(settings, "new", "ghi"));
+	for (i = 1000; i < 2000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(strncmp("def", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 9999);
+	test_assert(strncmp("value999", settings_get_string(settings, "key999", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "key1999", 0) == 1999);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_binary_merge(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_binary_merge.bin";
+	char text_path[] = "test_settings_binary_merge.txt";
+	char buf[1000] = {'\0'};
+	int load_success;
+	FILE *f;
+
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_set_string(settings, "bar", "def"));
+	test_assert(settings_save_binary(settings, config_path));
+	settings_free(settings);
+
+	/* Existing keys are kept, but replaced by those in the file */
+	settings = settings_create();
+	test_assert(settings_set_string(settings, "baz", "ghi"));
+	test_assert(settings_set_string(settings, "bar", "jkl"));
+	load_success = settings_load_binary(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(settings_save(settings, text_path));
+	settings_free(settings);
+
+	test_assert((f = fopen(text_path, "rt")) != NULL);
+	test_assert(fread(buf, 1, 1000, f) > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(remove(text_path) == 0);
+	test_assert(strncmp(buf, "baz = ghi\nbar = def\nfoo = abc\n", 1000) == 0);
+
+	return TEST_PASS;
+}
+
+static int test_settings_binary_invalid(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_binary_invalid.bin";
+	char buf[4096];
+	size_t size, i;
+	FILE *f;
+
+	/* A text file is not a binary file */
+	test_assert((f = fopen(config_path, "wb")) != NULL);
+	test_assert(fprintf(f, "foo = abc\nbar = def\nbaz = ghi\nsome more = stuff to fill a header\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(!settings_load_binary(settings, config_path));
+
+	/* Neither is a truncated one */
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_save_binary(settings, config_path));
+	test_assert((f = fopen(config_path, "rb")) != NULL);
+	size = fread(buf, 1, sizeof(buf), f);
+	test_assert(fclose(f) == 0);
+	test_assert((f = fopen(config_path, "wb")) != NULL);
+	test_assert(fwrite(buf, 1, size - 1, f) == size - 1);
+	test_assert(fclose(f) == 0);
+	settings_free(settings);
+	settings = settings_create();
+	test_assert(!settings_load_binary(settings, config_path));
+
+	/* Or one with a string that runs past its end (before the checksum) */
+	buf[size - 9] = 'x';
+	test_assert((f = fopen(config_path, "wb")) != NULL);
+	test_assert(fwrite(buf, 1, size, f) == size);
+	test_assert(fclose(f) == 0);
+	test_assert(!settings_load_binary(settings, config_path));
+
+	/* Or one with any byte changed, e.g. in a stored hash or value */
+	buf[size - 9] = '\0';
+	for (i = 0; i < size; i += 7) {
+		buf[i] ^= 0x10;
+		test_assert((f = fopen(config_path, "wb")) != NULL);
+		test_assert(fwrite(buf, 1, size, f) == size);
+		test_assert(fclose(f) == 0);
+		test_assert(!settings_load_binary(settings, config_path));
+		buf[i] ^= 0x10;
+	}
+
+	/* The file itself is still good */
+	test_assert((f = fopen(config_path, "wb")) != NULL);
+	test_assert(fwrite(buf, 1, size, f) == size);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_load_binary(settings, config_path));
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_free(settings);
+	settings = settings_create();
+	test_assert(remove(config_path) == 0);
+
+	test_assert(!settings_load_binary(settings, "missing_file.bin"));
+	test_assert(!settings_load_binary(NULL, "missing_file.bin"));
+	test_assert(!settings_load_binary(settings, NULL));
+	test_assert(!settings_save_binary(NULL, config_path));
+	test_assert(!settings_save_binary(settings, NULL));
+	test_assert(strncmp("ERROR", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Batch tests
+ */
+
+static int test_settings_get_many(void) {
+	Settings *settings = settings_create();
+	const char *keys[20];
+	const char *out[20];
+	char names[20][32];
+	int i;
+	for (i = 0; i < 20; ++i) {
+		sprintf(names[i], "key%d", i);
+		keys[i] = names[i];
+		if (i % 3 != 0) {
+			test_assert(settings_set_int(settings, names[i], i));
+		}
+	}
+	test_assert(settings_get_many(settings, keys, 20, out) == 13);
+	for (i = 0; i < 20; ++i) {
+		if (i % 3 != 0) {
+			test_assert(out[i] != NULL && atoi(out[i]) == i);
+		} else {
+			test_assert(out[i] == NULL);
+		}
+	}
+	/* A NULL key is just not found */
+	keys[1] = NULL;
+	test_assert(settings_get_many(settings, keys, 20, out) == 12);
+	test_assert(out[1] == NULL && atoi(out[2]) == 2);
+	test_assert(settings_get_many(NULL, keys, 20, out) == 0);
+	test_assert(out[2] == NULL);
+	test_assert(settings_get_many(settings, NULL, 20, out) == 0);
+	test_assert(settings_get_many(settings, keys, 20, NULL) == 0);
+	test_assert(settings_get_many(settings, keys, 0, out) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_set_many(void) {
+	Settings *settings = settings_create();
+	const char *keys[1000];
+	const char *values[1000];
+	static char names[1000][32];
+	int i;
+	for (i = 0; i < 1000; ++i) {
+		sprintf(names[i], "key%d", i);
+		keys[i] = names[i];
+		values[i] = names[i] + 3;
+	}
+	test_assert(settings_set_string(settings, "key5", "old"));
+	test_assert(settings_set_many(settings, keys, values, 1000));
+	for (i = 0; i < 1000; ++i) {
+		test_assert(settings_get_int(settings, names[i], -1) == i);
+	}
+	test_assert(settings_set_many(settings, keys, values, 0));
+	test_assert(!settings_set_many(NULL, keys, values, 1000));
+	test_assert(!settings_set_many(settings, NULL, values, 1000));
+	test_assert(!settings_set_many(settings, keys, NULL, 1000));
+	values[999] = NULL;
+	test_assert(!settings_set_many(settings, keys, values, 1000));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_set_many_no_memory(void) {
+	Settings *settings = settings_create();
+	const char *keys[] = { "foo", "bar" };
+	const char *values[] = { "abc", "def" };
+	test_malloc_disable();
+	test_realloc_disable();
+	test_assert(!settings_set_many(settings, keys, values, 2));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Remove tests
+ */
+
+static int test_settings_remove(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_int(settings, "foo", 123));
+	test_assert(settings_get_int(settings, "foo", 99999) == 123);
+	test_assert(settings_remove(settings, "foo"));
+	test_assert(settings_get_int(settings, "foo", 99999) == 99999);
+	settings_free(settings);
+	return TEST_PASS;
+}
+
+static int test_settings_remove_null_settings(void) {
+	test_assert(!settings_remove(NULL, "something"));
+	return TEST_PASS;
+}
+
+static int test_settings_remove_null_key(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", "bar"));
+	test_assert(!settings_remove(settings, NULL));
+	settings_free(settings);
+	return TEST_PASS;
+}
+
+static int test_settings_remove_missing_key(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_set_string(settings, "foo", "bar"));
+	test_assert(!settings_remove(settings, "something"));
+	settings_free(settings);
+	return TEST_PASS;
+}
+
+static int test_settings_remove_many(void) {
+	Settings *settings = settings_create();
+	char key[32];
+	int i;
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	/* Remove and re-add so that the index fills up with tombstones */
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i % 1000);
+		test_assert(settings_remove(settings, key));
+		test_assert(settings_get_int(settings, key, -1) == -1);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == 9000 + i);
+	}
+	settings_free(settings);
+	return TEST_PASS;
+}
+
+static int test_settings_remove_recycles(void) {
+	Settings *settings = settings_create();
+	char key[32];
+	int i;
+	int round;
+	test_assert(settings_set_string(settings, "keep", "value"));
+
+	/* The first round fills the free lists, and the second one must not allocate */
+	for (round = 0; round < 2; ++round) {
+		if (round == 1) {
+			test_malloc_disable();
+			test_realloc_disable();
+		}
+		for (i = 0; i < 1000; ++i) {
+			sprintf(key, "temp%04d", i);
+			test_assert(settings_set_string(settings, key, "value"));
+			test_assert(settings_set_int(settings, key, 1000 + i));
+			test_assert(settings_get_int(settings, key, -1) == 1000 + i);
+			test_assert(settings_remove(settings, key));
+		}
+		test_malloc_enable();
+		test_realloc_enable();
+	}
+	test_assert(strncmp("value", settings_get_string(settings, "keep", "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_memory_usage(void) {
+	Settings *settings = settings_create();
+	SettingsMemoryUsage empty, full, removed, shrunk;
+	char key[32];
+	int i;
+	test_assert(settings_memory_usage(settings, &empty));
+	test_assert(empty.live >= sizeof(void *));
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(settings_memory_usage(settings, &full));
+	test_assert(full.live > empty.live + 1000 * 8);
+
+	/* Removed pairs are kept for reuse, until the settings are shrunk */
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_remove(settings, key));
+	}
+	test_assert(settings_memory_usage(settings, &removed));
+	test_assert(removed.live < full.live);
+	test_assert(removed.retained > full.retained);
+	settings_shrink(settings);
+	test_assert(settings_memory_usage(settings, &shrunk));
+	test_assert(shrunk.live <= removed.live);
+	test_assert(shrunk.retained == 0);
+	test_assert(!settings_memory_usage(NULL, &shrunk));
+	test_assert(!settings_memory_usage(settings, NULL));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_stats(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_stats.txt";
+	const char *keys[] = { "a", "b", "missing" };
+	const char *out[3];
+	SettingsStats stats;
+	SettingsKey *handle;
+	test_assert(settings_stats(settings, &stats));
+	test_assert(stats.keys == 0 && stats.get_hits == 0 && stats.sets == 0);
+	test_assert(stats.average_probe == 0.0);
+
+	test_assert(settings_set_string(settings, "a", "1"));
+	test_assert(settings_set_int(settings, "b", 23));
+	test_assert(settings_get_int(settings, "a", -1) == 1);
+	test_assert(settings_get_int(settings, "c", -1) == -1);
+	test_assert(settings_get_many(settings, keys, 3, out) == 2);
+	test_assert((handle = settings_key_intern(settings, "b")) != NULL);
+	test_assert(settings_get_int_k(settings, handle, -1) == 23);
+	test_assert(settings_load_buffer(settings, "c = 456\n", 8));
+	test_assert(settings_remove(settings, "a"));
+	test_assert(settings_save(settings, config_path));
+	test_assert(remove(config_path) == 0);
+
+	test_assert(settings_stats(settings, &stats));
+	test_assert(stats.keys == 2);
+	test_assert(stats.key_bytes == 2);
+	test_assert(stats.value_bytes == 5);
+	test_assert(stats.node_bytes > 0 && stats.index_bytes > 0);
+	test_assert(stats.load_factor > 0.0 && stats.load_factor <= 0.75);
+	test_assert(stats.average_probe >= 1.0 && stats.max_probe >= 1);
+	test_assert(stats.get_hits == 4);
+	test_assert(stats.get_misses == 2);
+	test_assert(stats.sets == 2);
+	test_assert(stats.removes == 1);
+	test_assert(stats.loads == 1);
+	test_assert(stats.saves == 1);
+	test_assert(!settings_stats(NULL, &stats));
+	test_assert(!settings_stats(settings, NULL));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Keep a copy of each trace reported by settings_trace, by point.
+ */
+static void store_trace(const SettingsTrace *trace, void *context) {
+	SettingsTrace *traces = context;
+	traces[trace->point] = *trace;
+}
+
+static int test_settings_trace(void) {
+	Settings *settings = settings_create();
+	SettingsTrace traces[SETTINGS_TRACE_POINTS];
+#ifdef SETTINGS_TRACE
+	char config_path[] = "test_settings_trace.txt";
+	unsigned long long bucketed;
+	int point;
+	int i;
+
+	test_assert(settings_set_string(settings, "a", "1"));
+	test_assert(settings_set_int(settings, "b", 23));
+	test_assert(settings_get_int(settings, "a", -1) == 1);
+	test_assert(settings_get_int(settings, "c", -1) == -1);
+	test_assert(settings_remove(settings, "a"));
+	test_assert(settings_save(settings, config_path));
+	test_assert(settings_load(settings, config_path));
+	test_assert(remove(config_path) == 0);
+	test_assert(settings_load_buffer(settings, "c = 456\n", 8));
+
+	test_assert(settings_trace(settings, store_trace, traces));
+	for (point = 0; point < SETTINGS_TRACE_POINTS; ++point) {
+		test_assert((int) traces[point].point == point);
+		for (bucketed = 0, i = 0; i < SETTINGS_TRACE_BUCKETS; ++i) {
+			bucketed += traces[point].buckets[i];
+		}
+		test_assert(bucketed == traces[point].count);
+	}
+	test_assert(strcmp(traces[SETTINGS_TRACE_GET].name, "get") == 0);
+	test_assert(traces[SETTINGS_TRACE_LOAD].count == 2);
+	test_assert(traces[SETTINGS_TRACE_READ].count >= 2);
+	test_assert(traces[SETTINGS_TRACE_PARSE].count >= 2);
+	test_assert(traces[SETTINGS_TRACE_INSERT].count == 4);
+	test_assert(traces[SETTINGS_TRACE_GET].count == 2);
+	test_assert(traces[SETTINGS_TRACE_SET].count == 2);
+	test_assert(traces[SETTINGS_TRACE_REMOVE].count == 1);
+	test_assert(traces[SETTINGS_TRACE_SAVE].count == 1);
+	test_assert(!settings_trace(NULL, store_trace, traces));
+	test_assert(!settings_trace(settings, NULL, traces));
+#else
+	/* Nothing is recorded without tracing built in */
+	test_assert(!settings_trace(settings, store_trace, traces));
+#endif
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Key handle tests
+ */
+
+static int test_settings_key_intern(void) {
+	Settings *settings = settings_create();
+	SettingsKey *key;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert((key = settings_key_intern(settings, "foo")) != NULL);
+	test_assert(settings_key_intern(settings, "foo") == key);
+	test_assert(strncmp("abc", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	test_assert(settings_set_string(settings, "foo", "def"));
+	test_assert(strncmp("def", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	test_assert(settings_set_int_k(settings, key, 1264));
+	test_assert(settings_get_int(settings, "foo", 9999) == 1264);
+	test_assert(settings_get_int_k(settings, key, 9999) == 1264);
+	test_assert(settings_set_float_k(settings, key, 123.1f));
+	test_assert(settings_get_float_k(settings, key, 9999.0f) == 123.1f);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_key_intern_missing(void) {
+	Settings *settings = settings_create();
+	SettingsKey *key;
+	test_assert((key = settings_key_intern(settings, "foo")) != NULL);
+	test_assert(strncmp("ERROR", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	test_assert(strncmp("ERROR", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(!settings_remove(settings, "foo"));
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(strncmp("abc", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_key_intern_remove(void) {
+	Settings *settings = settings_create();
+	SettingsKey *key;
+	char key_str[32];
+	int i;
+	test_assert((key = settings_key_intern(settings, "foo")) != NULL);
+	test_assert(settings_set_string_k(settings, key, "abc"));
+	test_assert(settings_remove(settings, "foo"));
+	test_assert(strncmp("ERROR", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	/* The handle must survive the index growing */
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key_str, "key%d", i);
+		test_assert(settings_set_int(settings, key_str, i));
+	}
+	test_assert(settings_set_string(settings, "foo", "def"));
+	test_assert(strncmp("def", settings_get_string_k(settings, key, "ERROR"), 64) == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_key_intern_null(void) {
+	Settings *settings = settings_create();
+	test_assert(settings_key_intern(NULL, "foo") == NULL);
+	test_assert(settings_key_intern(settings, NULL) == NULL);
+	test_assert(strncmp("ERROR", settings_get_string_k(settings, NULL, "ERROR"), 64) == 0);
+	test_assert(!settings_set_string_k(settings, NULL, "abc"));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Iterator tests
+ */
+
+static int test_settings_iter(void) {
+	Settings *settings = settings_create();
+	SettingsIter iter;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_set_string(settings, "bar", "defg"));
+	test_assert(settings_set_string(settings, "baz", "hi"));
+	settings_iter_begin(settings, &iter);
+	test_assert(settings_iter_next(&iter));
+	test_assert(strcmp(iter.key, "foo") == 0 && iter.key_len == 3);
+	test_assert(strcmp(iter.value, "abc") == 0 && iter.value_len == 3);
+	test_assert(settings_iter_next(&iter));
+	test_assert(strcmp(iter.key, "bar") == 0 && iter.key_len == 3);
+	test_assert(strcmp(iter.value, "defg") == 0 && iter.value_len == 4);
+	test_assert(settings_iter_next(&iter));
+	test_assert(strcmp(iter.key, "baz") == 0);
+	test_assert(!settings_iter_next(&iter));
+	test_assert(iter.key == NULL);
+	test_assert(!settings_iter_next(&iter));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_iter_remove(void) {
+	Settings *settings = settings_create();
+	SettingsIter iter;
+	char key[32];
+	int visited = 0;
+	int i;
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	settings_iter_begin(settings, &iter);
+	while (settings_iter_next(&iter)) {
+		/* Remove the current key and the next one, which is then skipped */
+		test_assert(atoi(iter.value) == visited * 2);
+		sprintf(key, "key%d", visited * 2 + 1);
+		test_assert(settings_remove(settings, key));
+		test_assert(settings_remove(settings, iter.key));
+		++visited;
+	}
+	test_assert(visited == 500);
+	settings_iter_begin(settings, &iter);
+	test_assert(!settings_iter_next(&iter));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_iter_compact(void) {
+	Settings *settings = settings_create();
+	SettingsIter iter;
+	char key[32];
+	int visited = 0;
+	int i;
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	settings_iter_begin(settings, &iter);
+	while (settings_iter_next(&iter)) {
+		/* Churn enough for the list to be compacted along the way */
+		test_assert(atoi(iter.value) == visited);
+		test_assert(settings_remove(settings, iter.key));
+		test_assert(settings_set_string(settings, "temp", "abc"));
+		test_assert(settings_remove(settings, "temp"));
+		++visited;
+	}
+	test_assert(visited == 1000);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_iter_add(void) {
+	Settings *settings = settings_create();
+	SettingsIter iter;
+	char key[32];
+	int visited = 0;
+	test_assert(settings_set_int(settings, "key0", 0));
+	settings_iter_begin(settings, &iter);
+	while (settings_iter_next(&iter)) {
+		/* Added keys are visited as well */
+		test_assert(atoi(iter.value) == visited);
+		if (++visited < 100) {
+			sprintf(key, "key%d", visited);
+			test_assert(settings_set_int(settings, key, visited));
+		}
+	}
+	test_assert(visited == 100);
+	settings_iter_begin(NULL, &iter);
+	test_assert(!settings_iter_next(&iter));
+	settings_iter_begin(settings, NULL);
+	test_assert(!settings_iter_next(NULL));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Prefix tests
+ */
+
+/* Appends "key=value;" to the string buffer given as context */
+static int collect_pair(const char *key, const char *value, void *ctx) {
+	char *buf = ctx;
+	sprintf(buf + strlen(buf), "%s=%s;", key, value);
+	return 1;
+}
+
+/* Counts down from the int given as context, stopping at zero */
+static int count_down(const char *key, const char *value, void *ctx) {
+	int *remaining = ctx;
+	(void) key;
+	(void) value;
+	return --*remaining > 0;
+}
+
+static int test_settings_foreach_prefix(void) {
+	Settings *settings = settings_create();
+	char buf[1000] = {'\0'};
+	test_assert(settings_set_string(settings, "db.primary.port", "5432"));
+	test_assert(settings_set_string(settings, "db.replica.host", "db2"));
+	test_assert(settings_set_string(settings, "db.primary.host", "db1"));
+	test_assert(settings_set_string(settings, "db.primary", "yes"));
+	test_assert(settings_set_string(settings, "web.port", "80"));
+	test_assert(settings_foreach_prefix(settings, "db.primary.", collect_pair, buf));
+	test_assert(strcmp(buf, "db.primary.host=db1;db.primary.port=5432;") == 0);
+
+	/* Changes are picked up */
+	test_assert(settings_set_string(settings, "db.primary.name", "main"));
+	test_assert(settings_set_string(settings, "db.primary.port", "6543"));
+	test_assert(settings_remove(settings, "db.primary.host"));
+	buf[0] = '\0';
+	test_assert(settings_foreach_prefix(settings, "db.primary.", collect_pair, buf));
+	test_assert(strcmp(buf, "db.primary.name=main;db.primary.port=6543;") == 0);
+
+	buf[0] = '\0';
+	test_assert(settings_foreach_prefix(settings, "", collect_pair, buf));
+	test_assert(strcmp(buf, "db.primary=yes;db.primary.name=main;db.primary.port=6543;"
+		"db.replica.host=db2;web.port=80;") == 0);
+	buf[0] = '\0';
+	test_assert(settings_foreach_prefix(settings, "zzz", collect_pair, buf));
+	test_assert(strcmp(buf, "") == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_foreach_prefix_stop(void) {
+	Settings *settings = settings_create();
+	int remaining = 2;
+	test_assert(settings_set_string(settings, "a.1", "x"));
+	test_assert(settings_set_string(settings, "a.2", "x"));
+	test_assert(settings_set_string(settings, "a.3", "x"));
+	test_assert(settings_foreach_prefix(settings, "a.", count_down, &remaining));
+	test_assert(remaining == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/* The keys that settings_foreach_prefix visited, and how many were out of order */
+struct SortedVisit {
+	char last[64];
+	int count;
+	int unsorted;
+	const char *value; /* Value of the latest key */
+};
+
+static int visit_sorted(const char *key, const char *value, void *ctx) {
+	struct SortedVisit *visit = ctx;
+	visit->unsorted += visit->count > 0 && strcmp(visit->last, key) > 0;
+	sprintf(visit->last, "%.63s", key);
+	visit->value = value;
+	++visit->count;
+	return 1;
+}
+
+/* Goes through all the keys with visit_sorted, and returns how many there were if they were in order */
+static int count_sorted(Settings *settings) {
+	struct SortedVisit visit;
+	visit.count = 0;
+	visit.unsorted = 0;
+	if (!settings_foreach_prefix(settings, "", visit_sorted, &visit)) {
+		return -1;
+	}
+	return visit.unsorted == 0 ? visit.count : -1;
+}
+
+static int test_settings_foreach_prefix_changes(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_foreach_prefix_changes.txt";
+	struct SortedVisit visit;
+	int load_success;
+	char key[32];
+	FILE *f;
+	int i;
+
+	for (i = 0; i < 200; i += 2) {
+		sprintf(key, "k%03d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(count_sorted(settings) == 100);
+
+	/* A few changes at a time between visits, each one in its place */
+	for (i = 1; i < 200; i += 2) {
+		sprintf(key, "k%03d", i);
+		test_assert(settings_set_int(settings, key, i));
+		sprintf(key, "k%03d", i - 1);
+		test_assert(settings_remove(settings, key));
+		test_assert(settings_set_int(settings, key, i - 1));
+		if (i % 3 == 0) {
+			test_assert(settings_remove(settings, key));
+		}
+		test_assert(count_sorted(settings) == 100 + (i + 1) / 2 - (i + 3) / 6);
+	}
+
+	/* Many changes at once, like a load */
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "bulk%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(count_sorted(settings) == 200 - 33 + 1000);
+
+	settings_free(settings);
+
+	/* Keys that only differ after a NUL compare the same, but each is removed on its own */
+	settings = settings_create();
+	test_assert(settings_set_string_n(settings, "nul\0a", 5, "a", 1));
+	test_assert(settings_set_string(settings, "nul", "b"));
+	test_assert(settings_set_string_n(settings, "nul\0c", 5, "c", 1));
+	test_assert(count_sorted(settings) == 3);
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "nul = kept\n") > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_reload(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	visit.count = 0;
+	visit.unsorted = 0;
+	test_assert(settings_foreach_prefix(settings, "nul", visit_sorted, &visit));
+	test_assert(visit.count == 1);
+	test_assert(strcmp(visit.value, "kept") == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_foreach_prefix_null(void) {
+	Settings *settings = settings_create();
+	char buf[1000] = {'\0'};
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(!settings_foreach_prefix(NULL, "foo", collect_pair, buf));
+	test_assert(!settings_foreach_prefix(settings, NULL, collect_pair, buf));
+	test_assert(!settings_foreach_prefix(settings, "foo", NULL, buf));
+	test_malloc_disable();
+	test_realloc_disable();
+	test_assert(!settings_foreach_prefix(settings, "foo", collect_pair, buf));
+	test_assert(strcmp(buf, "") == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Reader tests
+ */
+
+static int test_settings_reader(void) {
+	Settings *settings = settings_create();
+	SettingsReader *reader;
+	test_assert((reader = settings_reader_create(settings)) != NULL);
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	settings_read_begin(reader);
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_read_end(reader);
+	settings_reader_free(reader);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_reader_keeps_values(void) {
+	Settings *settings = settings_create();
+	SettingsReader *reader = settings_reader_create(settings);
+	const char *old_value;
+	char key_str[32];
+	int i;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_set_string(settings, "bar", "def"));
+	test_assert(settings_set_string(settings, "foo", "ghi"));
+	settings_read_begin(reader);
+	test_assert((old_value = settings_get_string(settings, "foo", NULL)) != NULL);
+	/* Replaced and removed values must stay valid until the read ends */
+	test_assert(settings_set_string(settings, "foo", "jkl"));
+	test_assert(settings_remove(settings, "bar"));
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key_str, "key%d", i);
+		test_assert(settings_set_int(settings, key_str, i));
+		test_assert(settings_set_int(settings, key_str, i + 1));
+	}
+	test_assert(strncmp("ghi", old_value, 64) == 0);
+	test_assert(strncmp("jkl", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "key999", 0) == 1000);
+	settings_read_end(reader);
+	test_assert(settings_set_string(settings, "foo", "mno"));
+	settings_reader_free(reader);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_reader_free(void) {
+	Settings *settings = settings_create();
+	SettingsReader *first = settings_reader_create(settings);
+	SettingsReader *second = settings_reader_create(settings);
+	char key_str[32];
+	int i;
+	test_assert(first != NULL && second != NULL);
+	settings_reader_free(first);
+	/* The writer cleans up freed readers as it goes */
+	for (i = 0; i < 100; ++i) {
+		sprintf(key_str, "key%d", i % 10);
+		test_assert(settings_set_int(settings, key_str, i));
+	}
+	settings_reader_free(second);
+	test_assert(settings_reader_create(NULL) == NULL);
+	settings_reader_free(NULL);
+	settings_read_begin(NULL);
+	settings_read_end(NULL);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of readers and rounds of changes for test_settings_reader_threads */
+#define READER_THREADS 4
+#define READER_KEYS 64
+#define READER_ROUNDS 400
+
+/*
+ * Fill the buffer with a string of one letter, as many times as the
+ * letter is past 'a', for threads to check what they read.
+ */
+static void make_letters(char *buf, int len) {
+	memset(buf, 'a' + len - 1, len);
+	buf[len] = '\0';
+}
+
+/*
+ * Check that a string is one made by make_letters.
+ */
+static int letters_ok(const char *str) {
+	size_t i;
+	for (i = 0; str[i] != '\0'; ++i) {
+		if (str[i] != str[0]) {
+			return 0;
+		}
+	}
+	return i == (size_t) (str[0] - 'a' + 1);
+}
+
+/* A thread reading while test_settings_reader_threads writes, and how many wrong values it saw */
+struct ThreadReader {
+	Settings *settings;
+	int errors;
+};
+
+static void *read_while_writing(void *arg) {
+	struct ThreadReader *reader = arg;
+	SettingsReader *handle = settings_reader_create(reader->settings);
+	char key[32];
+	int round;
+	int i;
+	if (handle == NULL) {
+		++reader->errors;
+		return NULL;
+	}
+	for (round = 0; round < READER_ROUNDS; ++round) {
+		const char *str;
+		char letter;
+		settings_read_begin(handle);
+		sprintf(key, "key%d", round % READER_KEYS);
+		str = settings_get_string(reader->settings, key, "a");
+		letter = str[0];
+		/* The numbers never change, whatever happens to the index around them */
+		for (i = 0; i < READER_KEYS; ++i) {
+			sprintf(key, "number%d", i);
+			reader->errors += settings_get_int(reader->settings, key, -1) != i;
+		}
+		sched_yield();
+		/* The string of the first lookup must still be there, unchanged */
+		reader->errors += str[0] != letter || !letters_ok(str);
+		settings_read_end(handle);
+	}
+	settings_reader_free(handle);
+	return NULL;
+}
+#endif
+
+/*
+ * Threads read in read sections while the writer replaces and removes
+ * values, grows and rebuilds the index, and compacts the list.
+ */
+static int test_settings_reader_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create();
+	struct ThreadReader readers[READER_THREADS];
+	pthread_t threads[READER_THREADS];
+	char key[32];
+	char value[32];
+	int round;
+	int i;
+
+	for (i = 0; i < READER_KEYS; ++i) {
+		sprintf(key, "number%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	for (i = 0; i < READER_THREADS; ++i) {
+		readers[i].settings = settings;
+		readers[i].errors = 0;
+		test_assert(pthread_create(&threads[i], NULL, read_while_writing, &readers[i]) == 0);
+	}
+
+	for (round = 0; round < READER_ROUNDS; ++round) {
+		/* Replace or remove the strings */
+		for (i = 0; i < READER_KEYS; ++i) {
+			sprintf(key, "key%d", i);
+			if ((i + round) % 7 == 0) {
+				settings_remove(settings, key);
+			} else {
+				make_letters(value, 1 + (i + round) % 26);
+				test_assert(settings_set_string(settings, key, value));
+			}
+		}
+		/* Add enough keys to grow the index, then remove them again for tombstones and holes */
+		for (i = 0; i < 16 * (round % 8 + 1); ++i) {
+			sprintf(key, "churn%d", i);
+			test_assert(settings_set_int(settings, key, i));
+		}
+		for (i = 0; i < 16 * (round % 8 + 1); ++i) {
+			sprintf(key, "churn%d", i);
+			test_assert(settings_remove(settings, key));
+		}
+		if (round % 50 == 0) {
+			settings_shrink(settings);
+		}
+	}
+
+	for (i = 0; i < READER_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+		test_assert(readers[i].errors == 0);
+	}
+	settings_free(settings);
+#endif
+
+	return TEST_PASS;
+}
+
+/*
+ * Snapshot tests
+ */
+
+static int test_settings_snapshot(void) {
+	Settings *first = settings_create();
+	Settings *second = settings_create();
+	SettingsSnapshot *snapshot;
+	Settings *settings;
+	test_assert(settings_set_string(first, "foo", "abc"));
+	test_assert(settings_set_string(second, "foo", "def"));
+	test_assert((snapshot = settings_snapshot_create(first)) != NULL);
+	test_assert((settings = settings_snapshot_acquire(snapshot)) == first);
+	test_assert(settings_snapshot_publish(snapshot, second));
+	/* The old version stays valid until it is released */
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_snapshot_release(settings);
+	test_assert((settings = settings_snapshot_acquire(snapshot)) == second);
+	test_assert(strncmp("def", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_snapshot_free(snapshot);
+	/* The reader still holds the last version */
+	test_assert(strncmp("def", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	settings_snapshot_release(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_snapshot_load(void) {
+	SettingsSnapshot *snapshot = settings_snapshot_create(NULL);
+	char config_path[] = "test_settings_snapshot_load.txt";
+	Settings *settings;
+	int load_success;
+	FILE *f;
+
+	test_assert(settings_snapshot_acquire(snapshot) == NULL);
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "foo = abc\nbar = 123\n") > 0);
+	test_assert(fclose(f) == 0);
+	load_success = settings_snapshot_load(snapshot, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert((settings = settings_snapshot_acquire(snapshot)) != NULL);
+	test_assert(strncmp("abc", settings_get_string(settings, "foo", "ERROR"), 64) == 0);
+	test_assert(settings_get_int(settings, "bar", 0) == 123);
+	settings_snapshot_release(settings);
+	/* A failed load keeps the current version */
+	test_assert(!settings_snapshot_load(snapshot, "missing_file.txt"));
+	test_assert((settings = settings_snapshot_acquire(snapshot)) != NULL);
+	test_assert(settings_get_int(settings, "bar", 0) == 123);
+	settings_snapshot_release(settings);
+	settings_snapshot_free(snapshot);
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of readers, versions and keys per version for test_settings_snapshot_threads */
+#define SNAPSHOT_THREADS 4
+#define SNAPSHOT_VERSIONS 500
+#define SNAPSHOT_KEYS 32
+
+/* A thread acquiring versions of a snapshot, and how many broken ones it saw */
+struct SnapshotReader {
+	SettingsSnapshot *snapshot;
+	int errors;
+};
+
+/*
+ * Check that every key of an acquired version has the number of the
+ * version, and that it is no older than the one acquired before.
+ * Returns the number of the version, or -1 if it is broken.
+ */
+static int check_version(Settings *settings, int previous) {
+	const int version = settings_get_int(settings, "version", -1);
+	char key[32];
+	int i;
+	if (version < previous) {
+		return -1;
+	}
+	for (i = 0; i < SNAPSHOT_KEYS; ++i) {
+		sprintf(key, "key%d", i);
+		if (settings_get_int(settings, key, -1) != version) {
+			return -1;
+		}
+	}
+	return version;
+}
+
+static void *acquire_versions(void *arg) {
+	struct SnapshotReader *reader = arg;
+	int last = 0;
+	int round;
+	for (round = 0; round < SNAPSHOT_VERSIONS * 4 && last < SNAPSHOT_VERSIONS; ++round) {
+		Settings *first = settings_snapshot_acquire(reader->snapshot);
+		Settings *second;
+		if (first == NULL || (last = check_version(first, last)) < 0) {
+			++reader->errors;
+			break;
+		}
+		/* Hold on to it while new versions come out, along with a newer reference */
+		sched_yield();
+		second = settings_snapshot_acquire(reader->snapshot);
+		if (check_version(first, last) != last || second == NULL || check_version(second, last) < 0) {
+			++reader->errors;
+		}
+		settings_snapshot_release(first);
+		if (second != NULL) {
+			settings_snapshot_release(second);
+		}
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Threads acquire and release versions while new ones are published,
+ * and each version they get must be whole. Every version has to be freed
+ * exactly once by whichever thread lets go of it last, which running the
+ * tests under AddressSanitizer checks.
+ */
+static int test_settings_snapshot_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create();
+	SettingsSnapshot *snapshot;
+	struct SnapshotReader readers[SNAPSHOT_THREADS];
+	pthread_t threads[SNAPSHOT_THREADS];
+	char key[32];
+	int version;
+	int i;
+
+	for (i = 0; i < SNAPSHOT_KEYS; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, 0));
+	}
+	test_assert(settings_set_int(settings, "version", 0));
+	test_assert((snapshot = settings_snapshot_create(settings)) != NULL);
+	for (i = 0; i < SNAPSHOT_THREADS; ++i) {
+		readers[i].snapshot = snapshot;
+		readers[i].errors = 0;
+		test_assert(pthread_create(&threads[i], NULL, acquire_versions, &readers[i]) == 0);
+	}
+
+	for (version = 1; version <= SNAPSHOT_VERSIONS; ++version) {
+		test_assert((settings = settings_create()) != NULL);
+		for (i = 0; i < SNAPSHOT_KEYS; ++i) {
+			sprintf(key, "key%d", i);
+			test_assert(settings_set_int(settings, key, version));
+		}
+		test_assert(settings_set_int(settings, "version", version));
+		test_assert(settings_snapshot_publish(snapshot, settings));
+		if (version % 4 == 0) {
+			sched_yield();
+		}
+	}
+
+	for (i = 0; i < SNAPSHOT_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+		test_assert(readers[i].errors == 0);
+	}
+	settings_snapshot_free(snapshot);
+#endif
+
+	return TEST_PASS;
+}
+
+static int test_settings_snapshot_null(void) {
+	SettingsSnapshot *snapshot = settings_snapshot_create(NULL);
+	test_assert(snapshot != NULL);
+	test_assert(!settings_snapshot_publish(snapshot, NULL));
+	test_assert(!settings_snapshot_publish(NULL, NULL));
+	test_assert(!settings_snapshot_load(snapshot, NULL));
+	test_assert(!settings_snapshot_load(NULL, "foo.txt"));
+	test_assert(settings_snapshot_acquire(NULL) == NULL);
+	settings_snapshot_release(NULL);
+	settings_snapshot_free(snapshot);
+	settings_snapshot_free(NULL);
+	test_malloc_disable();
+	test_assert(settings_snapshot_create(NULL) == NULL);
+
+	return TEST_PASS;
+}
+
+/*
+ * Watch tests
+ */
+
+/* Calls to a watch callback, and the key of the latest one */
+struct WatchCalls {
+	int count;
+	const char *key;
+};
+
+static void count_watch_calls(Settings *settings, const char *key, void *ctx) {
+	struct WatchCalls *calls = ctx;
+	(void) settings;
+	++calls->count;
+	calls->key = key;
+}
+
+static int test_settings_watch(void) {
+	Settings *settings = settings_create();
+	struct WatchCalls calls = { 0, NULL };
+	SettingsWatch *watch;
+	SettingsKey *key;
+	test_assert((watch = settings_watch(settings, "foo", count_watch_calls, &calls)) != NULL);
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(calls.count == 1);
+	test_assert(strncmp("foo", calls.key, 64) == 0);
+	test_assert(settings_set_int(settings, "foobar", 1));
+	test_assert(settings_set_int(settings, "bar", 1));
+	test_assert(calls.count == 1);
+	test_assert((key = settings_key_intern(settings, "foo")) != NULL);
+	test_assert(settings_set_float_k(settings, key, 1.5f));
+	test_assert(calls.count == 2);
+	test_assert(settings_remove(settings, "foo"));
+	test_assert(!settings_remove(settings, "foo"));
+	test_assert(calls.count == 3);
+	settings_unwatch(settings, watch);
+	test_assert(settings_set_string(settings, "foo", "def"));
+	test_assert(calls.count == 3);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_watch_prefix(void) {
+	Settings *settings = settings_create();
+	struct WatchCalls net = { 0, NULL };
+	struct WatchCalls all = { 0, NULL };
+	const char *keys[] = { "net.host", "net.port", "log.level" };
+	const char *values[] = { "example.com", "80", "debug" };
+	const char config[] = "net.a = 1\nnet.b = 2\nlog.a = 3\n";
+	test_assert(settings_watch(settings, "net.*", count_watch_calls, &net) != NULL);
+	test_assert(settings_watch(settings, "*", count_watch_calls, &all) != NULL);
+	/* A load or a batch calls each watch once */
+	test_assert(settings_load_buffer(settings, config, strlen(config)));
+	test_assert(net.count == 1 && net.key == NULL);
+	test_assert(all.count == 1 && all.key == NULL);
+	test_assert(settings_set_many(settings, keys, values, 3));
+	test_assert(net.count == 2 && all.count == 2);
+	test_assert(settings_set_many(settings, keys + 2, values + 2, 1));
+	test_assert(net.count == 2 && all.count == 3);
+	test_assert(settings_set_string(settings, "net", "no match"));
+	test_assert(net.count == 2 && all.count == 4);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_watch_reload(void) {
+	Settings *settings = settings_create();
+	struct WatchCalls calls = { 0, NULL };
+	char config_path[] = "test_settings_watch_reload.txt";
+	int reload_success;
+	FILE *f;
+
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "net.a = 1\nnet.b = 2\nlog.a = 3\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_reload(settings, config_path));
+	test_assert(settings_watch(settings, "net.*", count_watch_calls, &calls) != NULL);
+	/* Only keys whose values change count */
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "net.a = 1\nnet.b = 2\nlog.a = 4\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_reload(settings, config_path));
+	test_assert(calls.count == 0);
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "net.a = 5\nlog.a = 4\n") > 0);
+	test_assert(fclose(f) == 0);
+	reload_success = settings_reload(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(reload_success);
+	test_assert(calls.count == 1);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_watch_reload_duplicates(void) {
+	Settings *settings = settings_create();
+	struct WatchCalls calls = { 0, NULL };
+	char config_path[] = "test_settings_watch_reload_duplicates.txt";
+	const char *unchanged;
+	int reload_success;
+	FILE *f;
+
+	test_assert(settings_set_int(settings, "a", 2));
+	test_assert(settings_set_int(settings, "b", 1));
+	unchanged = settings_get_string(settings, "a", "ERROR");
+	test_assert(settings_watch(settings, "*", count_watch_calls, &calls) != NULL);
+	/* Only the last line of a key counts, and it does not change a */
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a = 1\nb = 1\na = 2\n") > 0);
+	test_assert(fclose(f) == 0);
+	test_assert(settings_reload(settings, config_path));
+	test_assert(calls.count == 0);
+	test_assert(settings_get_string(settings, "a", "ERROR") == unchanged);
+	/* Or it does change it, however many lines come before */
+	test_assert((f = fopen(config_path, "wt")) != NULL);
+	test_assert(fprintf(f, "a = 2\nb = 1\nc = 1\na = 3\nc = 2\na = 4\n") > 0);
+	test_assert(fclose(f) == 0);
+	reload_success = settings_reload(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(reload_success);
+	test_assert(calls.count == 1);
+	test_assert(settings_get_int(settings, "a", 9999) == 4);
+	test_assert(settings_get_int(settings, "b", 9999) == 1);
+	test_assert(settings_get_int(settings, "c", 9999) == 2);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_watch_null(void) {
+	Settings *settings = settings_create();
+	struct WatchCalls calls = { 0, NULL };
+	test_assert(settings_watch(NULL, "foo", count_watch_calls, &calls) == NULL);
+	test_assert(settings_watch(settings, NULL, count_watch_calls, &calls) == NULL);
+	test_assert(settings_watch(settings, "foo", NULL, &calls) == NULL);
+	test_malloc_disable();
+	test_assert(settings_watch(settings, "foo", count_watch_calls, &calls) == NULL);
+	test_malloc_enable();
+	settings_unwatch(NULL, NULL);
+	settings_unwatch(settings, NULL);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Shard tests
+ */
+
+#ifdef HAVE_PTHREADS
+/* Counts the keys visited by a callback */
+static int count_keys(const char *key, const char *value, void *ctx) {
+	(void) key;
+	(void) value;
+	++*(int *) ctx;
+	return 1;
+}
+#endif
+
+static int test_settings_sharded(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create_sharded(4);
+	Settings *loaded = settings_create();
+	char config_path[] = "test_settings_sharded.txt";
+	const char *keys[] = { "a", "b", "c" };
+	const char *values[] = { "1", "2", "3" };
+	const char *out[3];
+	SettingsKey *handle;
+	SettingsIter iter;
+	SettingsStats stats;
+	char key[32];
+	int count = 0;
+	int i;
+
+	test_assert(settings != NULL);
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == i);
+	}
+	test_assert(settings_remove(settings, "key0"));
+	test_assert(!settings_remove(settings, "key0"));
+	test_assert(settings_get_int(settings, "key0", -1) == -1);
+
+	/* Batches, handles and loading go through the shards too */
+	test_assert(settings_set_many(settings, keys, values, 3));
+	test_assert(settings_get_many(settings, keys, 3, out) == 3);
+	test_assert(strncmp("2", out[1], 64) == 0);
+	test_assert((handle = settings_key_intern(settings, "key1")) != NULL);
+	test_assert(settings_set_float_k(settings, handle, 2.5f));
+	test_assert(settings_get_float(settings, "key1", 0.0f) == 2.5f);
+	test_assert(settings_load_buffer(settings, "c = 4\nd = 5\n", 12));
+	test_assert(settings_get_int(settings, "c", -1) == 4);
+	test_assert(settings_get_int(settings, "d", -1) == 5);
+	test_assert(settings_set_string_n(settings, "dx", 1, "6", 1));
+	test_assert(strncmp("6", settings_get_string_n(settings, "dy", 1, "ERROR", NULL), 64) == 0);
+
+	/* Every key is visited once, shard by shard */
+	settings_iter_begin(settings, &iter);
+	while (settings_iter_next(&iter)) {
+		++count;
+	}
+	test_assert(count == 1003);
+	count = 0;
+	test_assert(settings_foreach_prefix(settings, "key", count_keys, &count));
+	test_assert(count == 999);
+
+	test_assert(settings_save(settings, config_path));
+	test_assert(settings_load(loaded, config_path));
+	test_assert(remove(config_path) == 0);
+	test_assert(settings_get_int(loaded, "key999", -1) == 999);
+	test_assert(settings_get_int(loaded, "d", -1) == 6);
+	test_assert(!settings_save_binary(settings, config_path));
+	test_assert(settings_watch(settings, "a", NULL, NULL) == NULL);
+	test_assert(settings_stats(settings, &stats));
+	test_assert(stats.keys == 1003);
+	test_assert(stats.removes == 1);
+	test_assert(stats.saves == 1);
+	settings_free(loaded);
+	settings_free(settings);
+	test_assert(settings_create_sharded(0) == NULL);
+#else
+	/* Without locks for the shards, there are no sharded settings */
+	test_assert(settings_create_sharded(4) == NULL);
+#endif
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of threads and keys per thread for test_settings_sharded_threads */
+#define SHARDED_THREADS 4
+#define SHARDED_KEYS 2000
+
+/* A thread that sets its own keys, and a key shared with the others */
+struct ShardedWriter {
+	Settings *settings;
+	int id;
+};
+
+static void *write_sharded(void *arg) {
+	struct ShardedWriter *writer = arg;
+	char key[48];
+	int i;
+	for (i = 0; i < SHARDED_KEYS; ++i) {
+		snprintf(key, sizeof(key), "thread%d.key%d", writer->id, i);
+		settings_set_int(writer->settings, key, i);
+		settings_set_int(writer->settings, "shared", writer->id);
+		settings_get_int(writer->settings, "shared", -1);
+	}
+	return NULL;
+}
+#endif
+
+static int test_settings_sharded_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create_sharded(8);
+	struct ShardedWriter writers[SHARDED_THREADS];
+	pthread_t threads[SHARDED_THREADS];
+	char key[48];
+	int i;
+	int j;
+
+	test_assert(settings != NULL);
+	for (i = 0; i < SHARDED_THREADS; ++i) {
+		writers[i].settings = settings;
+		writers[i].id = i;
+		test_assert(pthread_create(&threads[i], NULL, write_sharded, &writers[i]) == 0);
+	}
+	for (i = 0; i < SHARDED_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+	}
+	for (i = 0; i < SHARDED_THREADS; ++i) {
+		for (j = 0; j < SHARDED_KEYS; ++j) {
+			snprintf(key, sizeof(key), "thread%d.key%d", i, j);
+			test_assert(settings_get_int(settings, key, -1) == j);
+		}
+	}
+	test_assert(settings_get_int(settings, "shared", -1) >= 0);
+	settings_free(settings);
+#endif
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of rounds that readers and writers of test_settings_sharded_readers go through */
+#define SHARDED_ROUNDS 20000
+
+/* A thread on sharded settings, and how many broken strings it saw */
+struct ShardedReader {
+	Settings *settings;
+	int id;
+	int errors;
+};
+
+static void *read_sharded_strings(void *arg) {
+	struct ShardedReader *reader = arg;
+	SettingsReader *handle = settings_reader_create(reader->settings);
+	char key[32];
+	int i;
+	if (handle == NULL) {
+		++reader->errors;
+		return NULL;
+	}
+	for (i = 0; i < SHARDED_ROUNDS; ++i) {
+		const char *str;
+		char letter;
+		snprintf(key, sizeof(key), "key%d", i % 16);
+		settings_read_begin(handle);
+		str = settings_get_string(reader->settings, key, "a");
+		letter = str[0];
+		/* Give the writers a chance to replace it; if it was freed, its memory would be reused */
+		sched_yield();
+		if (str[0] != letter || !letters_ok(str)) {
+			++reader->errors;
+		}
+		settings_read_end(handle);
+	}
+	settings_reader_free(handle);
+	return NULL;
+}
+
+static void *write_sharded_strings(void *arg) {
+	struct ShardedReader *writer = arg;
+	char key[32];
+	char value[32];
+	int i;
+	for (i = 0; i < SHARDED_ROUNDS; ++i) {
+		snprintf(key, sizeof(key), "key%d", (i * 7 + writer->id) % 16);
+		make_letters(value, 1 + (i + writer->id) % 26);
+		if (i % 5 == 0) {
+			settings_remove(writer->settings, key);
+		} else if (!settings_set_string(writer->settings, key, value)) {
+			++writer->errors;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Readers of sharded settings keep the strings they get, while other
+ * threads replace and remove them.
+ */
+static int test_settings_sharded_readers(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create_sharded(4);
+	struct ShardedReader readers[SHARDED_THREADS];
+	struct ShardedReader writers[2];
+	pthread_t reader_threads[SHARDED_THREADS];
+	pthread_t writer_threads[2];
+	SettingsReader *reader;
+	int i;
+
+	test_assert(settings != NULL);
+	for (i = 0; i < SHARDED_THREADS; ++i) {
+		readers[i].settings = settings;
+		readers[i].id = i;
+		readers[i].errors = 0;
+		test_assert(pthread_create(&reader_threads[i], NULL, read_sharded_strings, &readers[i]) == 0);
+	}
+	for (i = 0; i < 2; ++i) {
+		writers[i] = readers[0];
+		writers[i].id = i;
+		test_assert(pthread_create(&writer_threads[i], NULL, write_sharded_strings, &writers[i]) == 0);
+	}
+	for (i = 0; i < 2; ++i) {
+		test_assert(pthread_join(writer_threads[i], NULL) == 0);
+		test_assert(writers[i].errors == 0);
+	}
+	for (i = 0; i < SHARDED_THREADS; ++i) {
+		test_assert(pthread_join(reader_threads[i], NULL) == 0);
+		test_assert(readers[i].errors == 0);
+	}
+
+	/* Readers that are still there are freed along with the settings */
+	test_assert((reader = settings_reader_create(settings)) != NULL);
+	settings_read_begin(reader);
+	test_assert(letters_ok(settings_get_string(settings, "key1", "a")));
+	settings_read_end(reader);
+	settings_free(settings);
+#endif
+
+	return TEST_PASS;
+}
+
+/*
+ * Freeze tests
+ */
+
+static int test_settings_freeze(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_freeze.txt";
+	const char *keys[] = { "foo", "missing", "pi" };
+	const char *out[3];
+	SettingsStats stats;
+	SettingsIter iter;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_set_int(settings, "bar", 1264));
+	test_assert(settings_set_string(settings, "gone", "x"));
+	test_assert(settings_load_buffer(settings, "pi = 3.25\nbaz = -7\n", 19));
+	test_assert(settings_remove(settings, "gone"));
+	test_assert(settings_key_intern(settings, "unset") != NULL);
+	test_assert(settings_freeze(settings));
+	test_assert(settings_freeze(settings));
+
+	test_assert(strcmp(settings_get_string(settings, "foo", "ERROR"), "abc") == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 1264);
+	test_assert(settings_get_float(settings, "pi", 9999.0f) == 3.25f);
+	test_assert(settings_get_int(settings, "baz", 9999) == -7);
+	test_assert(settings_get_int(settings, "gone", 9999) == 9999);
+	test_assert(settings_get_int(settings, "unset", 9999) == 9999);
+	test_assert(settings_get_many(settings, keys, 3, out) == 2);
+	test_assert(strcmp(out[0], "abc") == 0 && out[1] == NULL && strcmp(out[2], "3.25") == 0);
+	test_assert(settings_key_intern(settings, "missing") == NULL);
+	test_assert(settings_get_int_k(settings, settings_key_intern(settings, "bar"), 9999) == 1264);
+
+	/* Nothing can be changed */
+	test_assert(!settings_set_string(settings, "foo", "def"));
+	test_assert(!settings_set_string(settings, "new", "def"));
+	test_assert(!settings_set_string_k(settings, settings_key_intern(settings, "foo"), "def"));
+	test_assert(!settings_remove(settings, "foo"));
+	test_assert(!settings_load_buffer(settings, "foo = def\n", 10));
+	test_assert(!settings_reserve(settings, 100));
+	test_assert(strcmp(settings_get_string(settings, "foo", "ERROR"), "abc") == 0);
+
+	/* The order stays the same */
+	settings_iter_begin(settings, &iter);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "foo") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "bar") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "pi") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "baz") == 0);
+	test_assert(!settings_iter_next(&iter));
+
+	test_assert(settings_stats(settings, &stats));
+	test_assert(stats.keys == 4);
+	test_assert(stats.load_factor == 1.0 && stats.max_probe == 1);
+	test_assert(settings_save(settings, config_path));
+	settings_free(settings);
+
+	settings = settings_create();
+	test_assert(settings_load(settings, config_path));
+	test_assert(remove(config_path) == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 1264);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_freeze_many(void) {
+	Settings *settings = settings_create();
+	char key[32];
+	int i;
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(settings_freeze(settings));
+	for (i = 0; i < 10000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, -1) == i);
+		sprintf(key, "other%d", i);
+		test_assert(settings_get_int(settings, key, -1) == -1);
+	}
+	settings_free(settings);
+
+	/* Empty settings freeze too */
+	settings = settings_create();
+	test_assert(settings_freeze(settings));
+	test_assert(settings_get_int(settings, "key", -1) == -1);
+	settings_free(settings);
+
+	/* So do settings in an arena, which let go of its chunks */
+	settings = settings_create_with_arena();
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_freeze(settings));
+	test_assert(strcmp(settings_get_string(settings, "foo", "ERROR"), "abc") == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_freeze_binary(void) {
+	Settings *settings = settings_create();
+	char config_path[] = "test_settings_freeze_binary.bin";
+	int load_success;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_assert(settings_set_int(settings, "bar", 54321));
+	test_assert(settings_save_binary(settings, config_path));
+	settings_free(settings);
+
+	/* The strings are copied out of the file before it is unmapped */
+	settings = settings_create();
+	load_success = settings_load_binary(settings, config_path);
+	test_assert(remove(config_path) == 0);
+	test_assert(load_success);
+	test_assert(settings_freeze(settings));
+	test_assert(strcmp(settings_get_string(settings, "foo", "ERROR"), "abc") == 0);
+	test_assert(settings_get_int(settings, "bar", 9999) == 54321);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+static int test_settings_freeze_no_memory(void) {
+	Settings *settings = settings_create();
+	int freeze_success;
+	test_assert(settings_set_string(settings, "foo", "abc"));
+	test_malloc_disable();
+	freeze_success = settings_freeze(settings);
+	test_malloc_enable();
+	test_assert(!freeze_success);
+	test_assert(settings_set_string(settings, "foo", "def"));
+	test_assert(strcmp(settings_get_string(settings, "foo", "ERROR"), "def") == 0);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of threads and keys for test_settings_freeze_threads */
+#define FROZEN_THREADS 4
+#define FROZEN_KEYS 20000
+
+/* A thread that reads frozen settings, counting what did not match */
+struct FrozenReader {
+	Settings *settings;
+	int errors;
+};
+
+static void *read_frozen(void *arg) {
+	struct FrozenReader *reader = arg;
+	char key[32];
+	int count;
+	int i;
+	for (i = 0; i < FROZEN_KEYS; i += 7) {
+		sprintf(key, "key%d", i);
+		reader->errors += settings_get_int(reader->settings, key, -1) != i;
+	}
+	count = 0;
+	reader->errors += !settings_foreach_prefix(reader->settings, "key1", count_keys, &count);
+	/* key1, key10 to key19, key100 to key199, and so on */
+	reader->errors += count != 11111;
+	return NULL;
+}
+#endif
+
+static int test_settings_freeze_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *settings = settings_create();
+	struct FrozenReader readers[FROZEN_THREADS];
+	pthread_t threads[FROZEN_THREADS];
+	char key[32];
+	int i;
+
+	for (i = 0; i < FROZEN_KEYS; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(settings, key, i));
+	}
+	test_assert(settings_freeze(settings));
+	for (i = 0; i < FROZEN_THREADS; ++i) {
+		readers[i].settings = settings;
+		readers[i].errors = 0;
+		test_assert(pthread_create(&threads[i], NULL, read_frozen, &readers[i]) == 0);
+	}
+	for (i = 0; i < FROZEN_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+		test_assert(readers[i].errors == 0);
+	}
+	settings_free(settings);
+#endif
+
+	return TEST_PASS;
+}
+
+static int test_settings_freeze_null(void) {
+	Settings *settings = settings_create_sharded(4);
+	test_assert(!settings_freeze(NULL));
+	test_assert(!settings_freeze(settings));
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+/*
+ * Overlay tests
+ */
+
+static int test_settings_overlay(void) {
+	Settings *defaults = settings_create();
+	Settings *project = settings_create();
+	Settings *settings;
+	const char *keys[] = { "color", "size", "missing", "name" };
+	const char *out[4];
+	SettingsKey *handle;
+	test_assert(settings_set_string(defaults, "color", "red"));
+	test_assert(settings_set_int(defaults, "size", 10));
+	test_assert(settings_set_string(defaults, "name", "default"));
+	test_assert(settings_set_int(project, "size", 12));
+	settings = settings_create_overlay(defaults, project);
+	test_assert(settings != NULL);
+
+	/* Keys fall through to the first layer that has them */
+	test_assert(strcmp(settings_get_string(settings, "color", "ERROR"), "red") == 0);
+	test_assert(settings_get_int(settings, "size", 9999) == 12);
+	test_assert(settings_get_int(settings, "missing", 9999) == 9999);
+	test_assert(settings_get_many(settings, keys, 4, out) == 3);
+	test_assert(strcmp(out[0], "red") == 0 && strcmp(out[1], "12") == 0);
+	test_assert(out[2] == NULL && strcmp(out[3], "default") == 0);
+
+	/* Its own keys come first, and do not change the layers */
+	test_assert(settings_set_string(settings, "name", "mine"));
+	test_assert(strcmp(settings_get_string(settings, "name", "ERROR"), "mine") == 0);
+	test_assert(strcmp(settings_get_string(defaults, "name", "ERROR"), "default") == 0);
+	test_assert(settings_remove(settings, "name"));
+	test_assert(strcmp(settings_get_string(settings, "name", "ERROR"), "default") == 0);
+	test_assert(!settings_remove(settings, "color"));
+
+	/* Changes to the layers show through, whether or not the key was cached */
+	test_assert(settings_set_string(defaults, "color", "blue"));
+	test_assert(strcmp(settings_get_string(settings, "color", "ERROR"), "blue") == 0);
+	test_assert(settings_set_string(project, "color", "green"));
+	test_assert(strcmp(settings_get_string(settings, "color", "ERROR"), "green") == 0);
+	test_assert(settings_remove(project, "size"));
+	test_assert(settings_get_int(settings, "size", 9999) == 10);
+	test_assert(settings_remove(defaults, "size"));
+	test_assert(settings_get_int(settings, "size", 9999) == 9999);
+	test_assert(settings_set_int(defaults, "missing", 7));
+	test_assert(settings_get_int(settings, "missing", 9999) == 7);
+
+	/* Handles of the overlay find layer values until it has its own */
+	handle = settings_key_intern(settings, "color");
+	test_assert(strcmp(settings_get_string_k(settings, handle, "ERROR"), "green") == 0);
+	test_assert(settings_set_string_k(settings, handle, "black"));
+	test_assert(strcmp(settings_get_string(settings, "color", "ERROR"), "black") == 0);
+	test_assert(strcmp(settings_get_string(project, "color", "ERROR"), "green") == 0);
+
+	settings_free(settings);
+	settings_free(project);
+	settings_free(defaults);
+
+	return TEST_PASS;
+}
+
+static int test_settings_overlay_nested(void) {
+	Settings *defaults = settings_create();
+	Settings *project = settings_create();
+	Settings *user = settings_create();
+	Settings *inner;
+	Settings *settings;
+	test_assert(settings_set_string(defaults, "a", "defaults"));
+	test_assert(settings_set_string(defaults, "b", "defaults"));
+	test_assert(settings_set_string(defaults, "c", "defaults"));
+	test_assert(settings_set_string(project, "b", "project"));
+	test_assert(settings_set_string(user, "c", "user"));
+	inner = settings_create_overlay(defaults, project);
+	settings = settings_create_overlay(inner, user);
+	test_assert(inner != NULL && settings != NULL);
+	test_assert(settings_set_string(inner, "a", "inner"));
+
+	test_assert(strcmp(settings_get_string(settings, "a", "ERROR"), "inner") == 0);
+	test_assert(strcmp(settings_get_string(settings, "b", "ERROR"), "project") == 0);
+	test_assert(strcmp(settings_get_string(settings, "c", "ERROR"), "user") == 0);
+	test_assert(strcmp(settings_get_string(inner, "c", "ERROR"), "defaults") == 0);
+	test_assert(settings_remove(inner, "a"));
+	test_assert(strcmp(settings_get_string(settings, "a", "ERROR"), "defaults") == 0);
+
+	settings_free(settings);
+	settings_free(inner);
+	settings_free(user);
+	settings_free(project);
+	settings_free(defaults);
+
+	return TEST_PASS;
+}
+
+static int test_settings_overlay_iter(void) {
+	Settings *defaults = settings_create();
+	Settings *project = settings_create();
+	Settings *settings;
+	Settings *loaded = settings_create();
+	char config_path[] = "test_settings_overlay_iter.txt";
+	char buf[1000] = {'\0'};
+	SettingsIter iter;
+	test_assert(settings_set_string(defaults, "db.host", "localhost"));
+	test_assert(settings_set_string(defaults, "db.port", "5432"));
+	test_assert(settings_set_string(defaults, "web.port", "80"));
+	test_assert(settings_set_string(project, "db.port", "6543"));
+	test_assert(settings_set_string(project, "db.name", "app"));
+	settings = settings_create_overlay(defaults, project);
+	test_assert(settings_set_string(settings, "db.host", "remote"));
+
+	/* Its own keys, then each layer's keys that are not set higher up */
+	settings_iter_begin(settings, &iter);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "db.host") == 0 && strcmp(iter.value, "remote") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "db.port") == 0 && strcmp(iter.value, "6543") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "db.name") == 0);
+	test_assert(settings_iter_next(&iter) && strcmp(iter.key, "web.port") == 0);
+	test_assert(!settings_iter_next(&iter));
+
+	test_assert(settings_foreach_prefix(settings, "db.", collect_pair, buf));
+	test_assert(strcmp(buf, "db.host=remote;db.name=app;db.port=6543;") == 0);
+
+	/* Saving writes out what it looks like */
+	test_assert(settings_save(settings, config_path));
+	test_assert(settings_load(loaded, config_path));
+	test_assert(remove(config_path) == 0);
+	test_assert(strcmp(settings_get_string(loaded, "db.host", "ERROR"), "remote") == 0);
+	test_assert(strcmp(settings_get_string(loaded, "db.port", "ERROR"), "6543") == 0);
+	test_assert(strcmp(settings_get_string(loaded, "web.port", "ERROR"), "80") == 0);
+	test_assert(!settings_save_binary(settings, config_path));
+
+	settings_free(loaded);
+	settings_free(settings);
+	settings_free(project);
+	settings_free(defaults);
+
+	return TEST_PASS;
+}
+
+static int test_settings_overlay_frozen(void) {
+	Settings *defaults = settings_create();
+	Settings *user = settings_create();
+	Settings *settings;
+	char key[32];
+	int i;
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(defaults, key, i));
+	}
+	test_assert(settings_freeze(defaults));
+	settings = settings_create_overlay(defaults, user);
+	test_assert(settings != NULL);
+	test_assert(settings_set_int(settings, "key5", -5));
+	for (i = 0; i < 1000; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_get_int(settings, key, 9999) == (i == 5 ? -5 : i));
+		test_assert(settings_get_int(settings, key, 9999) == (i == 5 ? -5 : i));
+	}
+	test_assert(settings_get_int(settings, "key1000", 9999) == 9999);
+	settings_free(settings);
+	settings_free(user);
+	settings_free(defaults);
+
+	return TEST_PASS;
+}
+
+#ifdef HAVE_PTHREADS
+/* Number of threads, keys and rounds for test_settings_overlay_threads */
+#define OVERLAY_THREADS 4
+#define OVERLAY_KEYS 200
+#define OVERLAY_ROUNDS 300
+
+/* A thread that reads an overlay while one of its layers changes */
+struct OverlayReader {
+	Settings *settings;
+	Settings *layer;
+	int errors;
+};
+
+static void *read_overlay(void *arg) {
+	struct OverlayReader *reader = arg;
+	SettingsReader *layer_reader = settings_reader_create(reader->layer);
+	char key[32];
+	int round;
+	int i;
+	for (round = 0; round < OVERLAY_ROUNDS; ++round) {
+		settings_read_begin(layer_reader);
+		for (i = 0; i < OVERLAY_KEYS; ++i) {
+			/* Either the default or the override, which is the same number negated */
+			int value;
+			sprintf(key, "key%d", i);
+			value = settings_get_int(reader->settings, key, 9999);
+			reader->errors += value != i && value != -i;
+		}
+		settings_read_end(layer_reader);
+	}
+	settings_reader_free(layer_reader);
+	return NULL;
+}
+#endif
+
+static int test_settings_overlay_threads(void) {
+#ifdef HAVE_PTHREADS
+	Settings *defaults = settings_create();
+	Settings *project = settings_create();
+	Settings *settings;
+	struct OverlayReader readers[OVERLAY_THREADS];
+	pthread_t threads[OVERLAY_THREADS];
+	char key[32];
+	int round;
+	int i;
+
+	for (i = 0; i < OVERLAY_KEYS; ++i) {
+		sprintf(key, "key%d", i);
+		test_assert(settings_set_int(defaults, key, i));
+	}
+	test_assert(settings_freeze(defaults));
+	settings = settings_create_overlay(defaults, project);
+	test_assert(settings != NULL);
+	for (i = 0; i < OVERLAY_THREADS; ++i) {
+		readers[i].settings = settings;
+		readers[i].layer = project;
+		readers[i].errors = 0;
+		test_assert(pthread_create(&threads[i], NULL, read_overlay, &readers[i]) == 0);
+	}
+
+	/* Override half of the keys and take them back, over and over */
+	for (round = 0; round < OVERLAY_ROUNDS; ++round) {
+		for (i = 0; i < OVERLAY_KEYS; i += 2) {
+			sprintf(key, "key%d", i);
+			if (round % 2 == 0) {
+				settings_set_int(project, key, -i);
+			} else {
+				settings_remove(project, key);
+			}
+		}
+	}
+	for (i = 0; i < OVERLAY_THREADS; ++i) {
+		test_assert(pthread_join(threads[i], NULL) == 0);
+		test_assert(readers[i].errors == 0);
+	}
+	test_assert(settings_get_int(settings, "key2", 9999) == 2);
+	settings_free(settings);
+	settings_free(project);
+	settings_free(defaults);
+#endif
+
+	return TEST_PASS;
+}
+
+static int test_settings_overlay_null(void) {
+	Settings *settings = settings_create();
+	Settings *sharded = settings_create_sharded(4);
+	test_assert(settings_create_overlay(NULL, settings) == NULL);
+	test_assert(settings_create_overlay(settings, NULL) == NULL);
+	test_assert(settings_create_overlay(sharded, settings) == NULL);
+	test_assert(settings_create_overlay(settings, sharded) == NULL);
+	test_malloc_disable();
+	test_assert(settings_create_overlay(settings, settings) == NULL);
+	test_malloc_enable();
+	settings_free(sharded);
+	settings_free(settings);
+
+	return TEST_PASS;
+}
+
+int main(void) {
 	setbuf(stdout, NULL);
 
 	test_run(test_settings_create);
 	test_run(test_settings_create_no_memory);
+	test_run(test_settings_create_with_arena);
+	test_run(test_settings_create_with_arena_no_memory);
+	test_run(test_settings_create_with_capacity);
+	test_run(test_settings_reserve_and_shrink);
 
 	test_run(test_settings_string_add);
 	test_run(test_settings_string_add_no_memory);
@@ -453,6 +3222,8 @@ int main(void) {
 	test_run(test_settings_string_exists);
 	test_run(test_settings_string_missing);
 	test_run(test_settings_string_missing_null);
+	test_run(test_settings_string_many);
+	test_run(test_settings_string_n);
 	
 	test_run(test_settings_int_add);
 	test_run(test_settings_int_negative);
@@ -461,6 +3232,9 @@ int main(void) {
 	test_run(test_settings_int_empty_key);
 	test_run(test_settings_int_exists);
 	test_run(test_settings_int_missing);
+	test_run(test_settings_int_cached);
+	test_run(test_settings_int_parse);
+	test_run(test_settings_int64);
 
 	test_run(test_settings_float_add);
 	test_run(test_settings_float_negative);
@@ -469,22 +3243,104 @@ int main(void) {
 	test_run(test_settings_float_empty_key);
 	test_run(test_settings_float_exists);
 	test_run(test_settings_float_missing);
+	test_run(test_settings_float_cached);
+	test_run(test_settings_float_shortest);
+
+	test_run(test_settings_double_add);
+	test_run(test_settings_double_parse);
 
 	test_run(test_settings_load);
 	test_run(test_settings_load_missing_file);
 	test_run(test_settings_load_null_settings);
 	test_run(test_settings_load_null_path);
+	test_run(test_settings_load_long_line);
+	test_run(test_settings_load_reuses_buffer);
+	test_run(test_settings_load_buffer);
+	test_run(test_settings_load_buffer_parallel);
+	test_run(test_settings_load_parallel);
+	test_run(test_settings_load_fd);
+	test_run(test_settings_load_fd_short_reads);
+	test_run(test_settings_load_mmap);
+	test_run(test_settings_load_mmap_long_lines);
+	test_run(test_settings_load_mmap_missing_file);
+	test_run(test_settings_reload);
+	test_run(test_settings_reload_unchanged);
+	test_run(test_settings_reload_missing_file);
 
 	test_run(test_settings_save);
 	test_run(test_settings_save_empty);
+	test_run(test_settings_save_replace);
+	test_run(test_settings_save_threads);
+	test_run(test_settings_save_no_memory);
 	test_run(test_settings_save_file_fails_to_open);
 	test_run(test_settings_save_null_settings);
 	test_run(test_settings_save_null_path);
 
+	test_run(test_settings_binary);
+	test_run(test_settings_binary_merge);
+	test_run(test_settings_binary_invalid);
+
+	test_run(test_settings_get_many);
+	test_run(test_settings_set_many);
+	test_run(test_settings_set_many_no_memory);
+
 	test_run(test_settings_remove);
 	test_run(test_settings_remove_null_settings);
 	test_run(test_settings_remove_null_key);
 	test_run(test_settings_remove_missing_key);
+	test_run(test_settings_remove_many);
+	test_run(test_settings_remove_recycles);
+	test_run(test_settings_memory_usage);
+	test_run(test_settings_stats);
+	test_run(test_settings_trace);
+
+	test_run(test_settings_key_intern);
+	test_run(test_settings_key_intern_missing);
+	test_run(test_settings_key_intern_remove);
+	test_run(test_settings_key_intern_null);
+
+	test_run(test_settings_iter);
+	test_run(test_settings_iter_remove);
+	test_run(test_settings_iter_compact);
+	test_run(test_settings_iter_add);
+
+	test_run(test_settings_foreach_prefix);
+	test_run(test_settings_foreach_prefix_stop);
+	test_run(test_settings_foreach_prefix_changes);
+	test_run(test_settings_foreach_prefix_null);
+
+	test_run(test_settings_reader);
+	test_run(test_settings_reader_keeps_values);
+	test_run(test_settings_reader_free);
+	test_run(test_settings_reader_threads);
+
+	test_run(test_settings_snapshot);
+	test_run(test_settings_snapshot_load);
+	test_run(test_settings_snapshot_threads);
+	test_run(test_settings_snapshot_null);
+
+	test_run(test_settings_watch);
+	test_run(test_settings_watch_prefix);
+	test_run(test_settings_watch_reload);
+	test_run(test_settings_watch_reload_duplicates);
+	test_run(test_settings_watch_null);
+
+	test_run(test_settings_sharded);
+	test_run(test_settings_sharded_threads);
+	test_run(test_settings_sharded_readers);
+
+	test_run(test_settings_freeze);
+	test_run(test_settings_freeze_many);
+	test_run(test_settings_freeze_binary);
+	test_run(test_settings_freeze_no_memory);
+	test_run(test_settings_freeze_threads);
+	test_run(test_settings_freeze_null);
+	test_run(test_settings_overlay);
+	test_run(test_settings_overlay_nested);
+	test_run(test_settings_overlay_iter);
+	test_run(test_settings_overlay_frozen);
+	test_run(test_settings_overlay_threads);
+	test_run(test_settings_overlay_null);
 
 	test_print_stats();
 